@@ -30,6 +30,8 @@ BUILD_TOOL_FIND_ITFS32=0
 BUILD_TOOL_FIND_ITFS64=0
 BUILD_TOOL_LOBBY32=0
 BUILD_TOOL_LOBBY64=0
+BUILD_TOOL_BENCH32=0
+BUILD_TOOL_BENCH64=0
 
 BUILD_LIB_NET_SOCKETS_32=0
 BUILD_LIB_NET_SOCKETS_64=0
@@ -89,6 +91,10 @@ for (( i=1; i<=$#; i++ )); do
     BUILD_TOOL_LOBBY32=1
   elif [[ "$var" = "+tool-lobby-64" ]]; then
     BUILD_TOOL_LOBBY64=1
+  elif [[ "$var" = "+tool-bench-32" ]]; then
+    BUILD_TOOL_BENCH32=1
+  elif [[ "$var" = "+tool-bench-64" ]]; then
+    BUILD_TOOL_BENCH64=1
   elif [[ "$var" = "+lib-netsockets-32" ]]; then
     BUILD_LIB_NET_SOCKETS_32=1
   elif [[ "$var" = "+lib-netsockets-64" ]]; then
@@ -251,6 +257,7 @@ release_libs_dir64=(
 release_libs=(
   "pthread"
   "dl"
+  "rt" # shm_open() with older glibc
   "ssq"
   "z" # libz library
   "curl"
@@ -541,6 +548,16 @@ if [[ "$BUILD_TOOL_LOBBY32" = "1" ]]; then
   last_code=$((last_code + $?))
 fi
 
+if [[ "$BUILD_TOOL_BENCH32" = "1" ]]; then
+  echo // building executable benchmark_x32 - 32
+  all_src_files=(
+    "${release_src[@]}"
+    "$tools_dir/benchmark/benchmark.cpp"
+  )
+  build_for 1 1 "$build_root_tools/benchmark/benchmark_x32" all_src_files empty_arr '-DNO_DISK_WRITES' empty_arr
+  last_code=$((last_code + $?))
+fi
+
 if [[ "$BUILD_TOOL_FIND_ITFS32" = "1" ]]; then
   echo // building executable generate_interfaces_file_x32 - 32
   all_src_files=(
@@ -638,6 +655,16 @@ if [[ "$BUILD_TOOL_LOBBY64" = "1" ]]; then
   last_code=$((last_code + $?))
 fi
 
+if [[ "$BUILD_TOOL_BENCH64" = "1" ]]; then
+  echo // building executable benchmark_x64 - 64
+  all_src_files=(
+    "${release_src[@]}"
+    "$tools_dir/benchmark/benchmark.cpp"
+  )
+  build_for 0 1 "$build_root_tools/benchmark/benchmark_x64" all_src_files empty_arr '-DNO_DISK_WRITES' empty_arr
+  last_code=$((last_code + $?))
+fi
+
 if [[ "$BUILD_TOOL_FIND_ITFS64" = "1" ]]; then
   echo // building executable generate_interfaces_file_x64 - 64
   all_src_files=(
@@ -35,6 +35,7 @@ set /a BUILD_EXPCLIENT_EXTRA_64=0
 
 set /a BUILD_TOOL_FIND_ITFS=0
 set /a BUILD_TOOL_LOBBY=0
+set /a BUILD_TOOL_BENCH=0
 
 set /a BUILD_LIB_NET_SOCKETS_32=0
 set /a BUILD_LIB_NET_SOCKETS_64=0
@@ -86,6 +87,8 @@ set /a VERBOSE=0
     set /a BUILD_TOOL_FIND_ITFS=1
   ) else if "%~1"=="+tool-lobby" (
     set /a BUILD_TOOL_LOBBY=1
+  ) else if "%~1"=="+tool-bench" (
+    set /a BUILD_TOOL_BENCH=1
   ) else if "%~1"=="+lib-netsockets-32" (
     set /a BUILD_LIB_NET_SOCKETS_32=1
   ) else if "%~1"=="+lib-netsockets-64" (
@@ -174,6 +177,7 @@ set "experimental_dir=%build_root_dir%\experimental"
 set "tools_dir=%build_root_dir%\tools"
 set "find_interfaces_dir=%tools_dir%\find_interfaces"
 set "lobby_connect_dir=%tools_dir%\lobby_connect"
+set "benchmark_dir=%tools_dir%\benchmark"
 
 :: common stuff
 set "deps_dir=build\deps\win"
@@ -410,6 +414,12 @@ if %BUILD_TOOL_LOBBY% equ 1 (
   )
   echo: & echo:
 )
+if %BUILD_TOOL_BENCH% equ 1 (
+  call :compile_tool_bench || (
+    set /a last_code+=1
+  )
+  echo: & echo:
+)
 
 :: networking sockets lib (x32)
 if %BUILD_LIB_NET_SOCKETS_32% equ 1 (
@@ -690,6 +700,17 @@ endlocal & exit /b %_exit%
   )
 endlocal & exit /b %_exit%
 
+:compile_tool_bench
+  setlocal
+  echo // building tool benchmark.exe - 32
+  set src_files="%tools_src_dir%\benchmark\benchmark.cpp" %release_src%
+  call :build_for 1 1 "%benchmark_dir%\benchmark.exe" src_files "" "/DNO_DISK_WRITES"
+  set /a _exit=%errorlevel%
+  if %_exit% equ 0 (
+    call "%signer_tool%" "%benchmark_dir%\benchmark.exe"
+  )
+endlocal & exit /b %_exit%
+
 :compile_networking_sockets_lib_32
   setlocal
   echo // building library steamnetworkingsockets.dll - 32
@@ -307,10 +307,13 @@ struct ips_test {
     uint32_t ip_to;
 };
 
+// set by every Networking instance, which can each run on their own I/O thread
+static std::mutex whitelist_ips_mutex;
 static std::vector<struct ips_test> whitelist_ips;
 
 void set_whitelist_ips(uint32_t *from, uint32_t *to, unsigned num_ips)
 {
+    std::lock_guard<std::mutex> lock(whitelist_ips_mutex);
     whitelist_ips.clear();
     for (unsigned i = 0; i < num_ips; ++i) {
         struct ips_test ip_a;
@@ -331,6 +334,7 @@ static bool is_whitelist_ip(unsigned char *ip)
     memcpy(&ip_temp, ip, sizeof(ip_temp));
     ip_temp = ntohl(ip_temp);
 
+    std::lock_guard<std::mutex> lock(whitelist_ips_mutex);
     for (auto &i : whitelist_ips) {
         if (i.ip_from <= ip_temp && ip_temp <= i.ip_to) {
             PRINT_DEBUG("IP IS WHITELISTED %hhu.%hhu.%hhu.%hhu", ip[0], ip[1], ip[2], ip[3]);
@@ -0,0 +1,168 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "dll/callback_payload.h"
+#include "dll/bounded_queue.h"
+#include <atomic>
+#include <cstring>
+#include <new>
+
+static const uint32 payload_classes[] = { 64, 256, CALLBACK_PAYLOAD_POOLED_SIZE };
+#define PAYLOAD_CLASSES (sizeof(payload_classes) / sizeof(payload_classes[0]))
+
+// the payload follows the header in the same allocation
+struct alignas(8) Callback_Payload_Block {
+    std::atomic<uint32> refs{};
+    uint32 size{};
+    uint32 size_class{}; // PAYLOAD_CLASSES for the big payloads, which aren't pooled
+
+    char *data()
+    {
+        return (char *)(this + 1);
+    }
+};
+
+// lock-free, the payloads are released by the game threads polling the manual dispatch
+struct Callback_Payload_Pool {
+    Bounded_Queue<struct Callback_Payload_Block *> blocks[PAYLOAD_CLASSES] = {
+        Bounded_Queue<struct Callback_Payload_Block *>(CALLBACK_PAYLOAD_POOL_MAX),
+        Bounded_Queue<struct Callback_Payload_Block *>(CALLBACK_PAYLOAD_POOL_MAX),
+        Bounded_Queue<struct Callback_Payload_Block *>(CALLBACK_PAYLOAD_POOL_MAX),
+    };
+};
+
+// never destroyed, the payloads of static objects can be released after the exit handlers
+static struct Callback_Payload_Pool *payload_pool()
+{
+    static struct Callback_Payload_Pool *pool = new Callback_Payload_Pool();
+    return pool;
+}
+
+static struct Callback_Payload_Block *new_block(uint32 size_class, size_t capacity)
+{
+    void *memory = ::operator new(sizeof(struct Callback_Payload_Block) + capacity);
+    auto block = new (memory) Callback_Payload_Block();
+    block->size_class = size_class;
+    return block;
+}
+
+static void delete_block(struct Callback_Payload_Block *block)
+{
+    block->~Callback_Payload_Block();
+    ::operator delete((void *)block);
+}
+
+static struct Callback_Payload_Block *acquire_block(size_t size)
+{
+    uint32 size_class = 0;
+    while (size_class < PAYLOAD_CLASSES && payload_classes[size_class] < size) ++size_class;
+    if (size_class == PAYLOAD_CLASSES) return new_block(size_class, size);
+
+    struct Callback_Payload_Block *block = nullptr;
+    if (payload_pool()->blocks[size_class].try_pop(block)) return block;
+
+    return new_block(size_class, payload_classes[size_class]);
+}
+
+static void recycle_block(struct Callback_Payload_Block *block)
+{
+    if (block->size_class < PAYLOAD_CLASSES && payload_pool()->blocks[block->size_class].try_push(block)) return;
+
+    delete_block(block);
+}
+
+Callback_Payload::Callback_Payload(const void *data, size_t size)
+{
+    if (!size) return;
+
+    block = acquire_block(size);
+    block->refs.store(1, std::memory_order_relaxed);
+    block->size = (uint32)size;
+    if (data) {
+        memcpy(block->data(), data, size);
+    } else {
+        memset(block->data(), 0, size);
+    }
+}
+
+Callback_Payload::Callback_Payload(const Callback_Payload &other)
+{
+    block = other.block;
+    if (block) block->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+Callback_Payload::Callback_Payload(Callback_Payload &&other) noexcept
+{
+    block = other.block;
+    other.block = nullptr;
+}
+
+Callback_Payload &Callback_Payload::operator=(const Callback_Payload &other)
+{
+    if (other.block) other.block->refs.fetch_add(1, std::memory_order_relaxed);
+    release();
+    block = other.block;
+    return *this;
+}
+
+Callback_Payload &Callback_Payload::operator=(Callback_Payload &&other) noexcept
+{
+    if (this != &other) {
+        release();
+        block = other.block;
+        other.block = nullptr;
+    }
+
+    return *this;
+}
+
+Callback_Payload::~Callback_Payload()
+{
+    release();
+}
+
+void Callback_Payload::release()
+{
+    if (!block) return;
+
+    if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        recycle_block(block);
+    }
+
+    block = nullptr;
+}
+
+char *Callback_Payload::data() const
+{
+    return block ? block->data() : nullptr;
+}
+
+size_t Callback_Payload::size() const
+{
+    return block ? block->size : 0;
+}
+
+bool Callback_Payload::empty() const
+{
+    return !block;
+}
+
+bool Callback_Payload::equals(const void *data, size_t size) const
+{
+    if (size != this->size()) return false;
+    return !size || memcmp(this->data(), data, size) == 0;
+}
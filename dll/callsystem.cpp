@@ -38,12 +38,14 @@ bool CCallbackMgr::isServer(class CCallbackBase *pCallback)
 
 
 Steam_Call_Result::Steam_Call_Result(SteamAPICall_t a, int icb, void *r, unsigned int s, double r_in, bool run_cc_cb)
+    : Steam_Call_Result(a, icb, Callback_Payload(r, s), r_in, run_cc_cb)
+{
+}
+
+Steam_Call_Result::Steam_Call_Result(SteamAPICall_t a, int icb, const Callback_Payload &r, double r_in, bool run_cc_cb)
 {
     api_call = a;
-    result.resize(s);
-    if (s > 0 && r != NULL) {
-        memcpy(&(result[0]), r, s);
-    }
+    result = r;
     run_in = r_in;
     run_call_completed_cb = run_cc_cb;
     iCallback = icb;
@@ -55,21 +57,11 @@ bool Steam_Call_Result::operator==(const struct Steam_Call_Result& other) const
     return other.api_call == api_call && other.callbacks == callbacks;
 }
 
-bool Steam_Call_Result::timed_out() const
-{
-    return check_timedout(created, STEAM_CALLRESULT_TIMEOUT);
-}
-
 bool Steam_Call_Result::call_completed() const
 {
     return (!reserved) && check_timedout(created, run_in);
 }
 
-bool Steam_Call_Result::can_execute() const
-{
-    return (!to_delete) && call_completed() && (has_cb() || check_timedout(created, STEAM_CALLRESULT_WAIT_FOR_CB));
-}
-
 bool Steam_Call_Result::has_cb() const
 {
     return callbacks.size() > 0;
@@ -77,6 +69,26 @@ bool Steam_Call_Result::has_cb() const
 
 
 
+enum Call_Result_Timer {
+    CALLRESULT_TIMER_READY,
+    CALLRESULT_TIMER_EXPIRY,
+};
+
+// timer keys: the generation and index of the slot, then the kind
+#define CALLRESULT_TIMER_KIND_BITS 1
+#define CALLRESULT_TIMER_SLOT_BITS 32
+
+static std::chrono::high_resolution_clock::duration callresult_duration(double seconds)
+{
+    return std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+static void erase_one(std::vector<uint32> &slots, uint32 slot)
+{
+    auto it = std::find(slots.begin(), slots.end(), slot);
+    if (it != slots.end()) slots.erase(it);
+}
+
 void SteamCallResults::addCallCompleted(class CCallbackBase *cb)
 {
     if (std::find(completed_callbacks.begin(), completed_callbacks.end(), cb) == completed_callbacks.end()) {
@@ -94,11 +106,155 @@ void SteamCallResults::rmCallCompleted(class CCallbackBase *cb)
     }
 }
 
+uint32 SteamCallResults::find_slot(SteamAPICall_t api_call) const
+{
+    auto it = slot_by_api_call.find(api_call);
+    if (it == slot_by_api_call.end()) return CALLRESULT_NO_SLOT;
+    return it->second;
+}
+
+uint32 SteamCallResults::new_slot(struct Steam_Call_Result &&call_result)
+{
+    uint32 slot = free_slots;
+    if (slot != CALLRESULT_NO_SLOT) {
+        free_slots = slots[slot].next_free;
+    } else {
+        slot = (uint32)slots.size();
+        slots.emplace_back();
+    }
+
+    // the callbacks of a slot keep their capacity across the reuses
+    auto &entry = slots[slot];
+    std::vector<class CCallbackBase *> callbacks = std::move(entry.call_result.callbacks);
+    callbacks.insert(callbacks.end(), call_result.callbacks.begin(), call_result.callbacks.end());
+    entry.call_result = std::move(call_result);
+    entry.call_result.callbacks = std::move(callbacks);
+    entry.used = true;
+    entry.serial = ++last_serial;
+    entry.next_free = CALLRESULT_NO_SLOT;
+    slot_by_api_call[entry.call_result.api_call] = slot;
+
+    schedule_timer(slot, entry.expiry_timer, CALLRESULT_TIMER_EXPIRY, entry.call_result.created + callresult_duration(STEAM_CALLRESULT_TIMEOUT));
+    schedule_ready(slot);
+    return slot;
+}
+
+void SteamCallResults::free_slot(uint32 slot)
+{
+    auto &entry = slots[slot];
+    slot_by_api_call.erase(entry.call_result.api_call);
+    for (auto cb : entry.call_result.callbacks) {
+        auto registered = slots_by_callback.find(cb);
+        if (registered == slots_by_callback.end()) continue;
+
+        erase_one(registered->second, slot);
+        if (registered->second.empty()) slots_by_callback.erase(registered);
+    }
+
+    std::vector<class CCallbackBase *> callbacks = std::move(entry.call_result.callbacks);
+    callbacks.clear();
+    entry.call_result = Steam_Call_Result();
+    entry.call_result.callbacks = std::move(callbacks);
+    entry.used = false;
+    entry.state = CALLRESULT_WAITING;
+    entry.ready_timer = {};
+    entry.expiry_timer = {};
+    // the timers and ready entries left behind don't match anymore
+    ++entry.generation;
+    entry.next_free = free_slots;
+    free_slots = slot;
+}
+
+void SteamCallResults::schedule_timer(uint32 slot, struct Scheduled_Timer &timer, uint64 kind, std::chrono::high_resolution_clock::time_point deadline)
+{
+    uint64 tick = timers.tick_of(deadline);
+    if (timer.pending && timer.tick == tick) return;
+
+    uint64 key = ((((uint64)slots[slot].generation << CALLRESULT_TIMER_SLOT_BITS) | slot) << CALLRESULT_TIMER_KIND_BITS) | kind;
+    timer.tick = timers.schedule(key, deadline);
+    timer.pending = true;
+}
+
+void SteamCallResults::schedule_ready(uint32 slot)
+{
+    auto &entry = slots[slot];
+    if (entry.call_result.reserved) return; // scheduled when it's filled
+
+    entry.state = CALLRESULT_WAITING;
+    schedule_timer(slot, entry.ready_timer, CALLRESULT_TIMER_READY, entry.call_result.created + callresult_duration(entry.call_result.run_in));
+}
+
+void SteamCallResults::set_ready(uint32 slot)
+{
+    auto &entry = slots[slot];
+    entry.state = CALLRESULT_READY;
+    entry.ready_timer.pending = false;
+
+    struct Steam_Call_Result_Ready item{};
+    item.serial = entry.serial;
+    item.slot = slot;
+    item.generation = entry.generation;
+    ready.push_back(item);
+}
+
+void SteamCallResults::retire(uint32 slot, double keep)
+{
+    auto &entry = slots[slot];
+    entry.call_result.to_delete = true;
+    entry.state = CALLRESULT_DONE;
+    entry.ready_timer.pending = false;
+
+    auto deadline = std::chrono::high_resolution_clock::now() + callresult_duration(keep);
+    if (entry.expiry_timer.pending && timers.tick_of(deadline) >= entry.expiry_timer.tick) return;
+    schedule_timer(slot, entry.expiry_timer, CALLRESULT_TIMER_EXPIRY, deadline);
+}
+
+void SteamCallResults::run_timers()
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    expired_timers.clear();
+    timers.advance(now, expired_timers);
+
+    for (auto &timer : expired_timers) {
+        uint64 kind = timer.key & ((1ULL << CALLRESULT_TIMER_KIND_BITS) - 1);
+        uint32 slot = (uint32)(timer.key >> CALLRESULT_TIMER_KIND_BITS);
+        uint32 generation = (uint32)(timer.key >> (CALLRESULT_TIMER_KIND_BITS + CALLRESULT_TIMER_SLOT_BITS));
+        if (slot >= slots.size() || !slots[slot].used || slots[slot].generation != generation) continue;
+
+        auto &entry = slots[slot];
+        if (kind == CALLRESULT_TIMER_READY) {
+            if (!entry.ready_timer.pending || entry.ready_timer.tick != timer.tick) continue;
+            entry.ready_timer.pending = false;
+            if (entry.call_result.to_delete) continue;
+
+            // without callback it waits a bit for the game to add one
+            auto wait_for_cb = entry.call_result.created + callresult_duration(STEAM_CALLRESULT_WAIT_FOR_CB);
+            if (entry.call_result.has_cb() || wait_for_cb <= now) {
+                set_ready(slot);
+            } else {
+                entry.state = CALLRESULT_WAITING_FOR_CB;
+                schedule_timer(slot, entry.ready_timer, CALLRESULT_TIMER_READY, wait_for_cb);
+            }
+        } else {
+            if (!entry.expiry_timer.pending || entry.expiry_timer.tick != timer.tick) continue;
+            PRINT_DEBUG("removed callresult %i", entry.call_result.iCallback);
+            free_slot(slot);
+        }
+    }
+
+    // the timers expire by tick, the ready results run in the order they were added
+    std::sort(ready.begin(), ready.end(), [](const struct Steam_Call_Result_Ready &a, const struct Steam_Call_Result_Ready &b) {
+        return a.serial < b.serial;
+    });
+}
+
 void SteamCallResults::addCallBack(SteamAPICall_t api_call, class CCallbackBase *cb)
 {
-    auto cb_result = std::find_if(callresults.begin(), callresults.end(), [api_call](struct Steam_Call_Result const& item) { return item.api_call == api_call; });
-    if (cb_result != callresults.end()) {
-        cb_result->callbacks.push_back(cb);
+    uint32 slot = find_slot(api_call);
+    if (slot != CALLRESULT_NO_SLOT) {
+        slots[slot].call_result.callbacks.push_back(cb);
+        slots_by_callback[cb].push_back(slot);
+        if (slots[slot].state == CALLRESULT_WAITING_FOR_CB) set_ready(slot);
         CCallbackMgr::SetRegister(cb, cb->GetICallback());
         PRINT_DEBUG("new cb for call result [api id=%llu, result k_iCallback=%i] %p", api_call, cb ? (cb->GetICallback()) : -1, cb);
     }
@@ -106,25 +262,22 @@ void SteamCallResults::addCallBack(SteamAPICall_t api_call, class CCallbackBase
 
 bool SteamCallResults::exists(SteamAPICall_t api_call) const
 {
-    auto cr = std::find_if(callresults.begin(), callresults.end(), [api_call](struct Steam_Call_Result const& item) {
-        return item.api_call == api_call;
-    });
-    if (callresults.end() == cr) return false;
-    if (!cr->call_completed()) return false;
+    uint32 slot = find_slot(api_call);
+    if (slot == CALLRESULT_NO_SLOT) return false;
+    if (!slots[slot].call_result.call_completed()) return false;
     return true;
 }
 
 bool SteamCallResults::callback_result(SteamAPICall_t api_call, void *copy_to, unsigned int size)
 {
-    auto cb_result = std::find_if(callresults.begin(), callresults.end(), [api_call](struct Steam_Call_Result const& item) {
-        return item.api_call == api_call;
-    });
-    if (cb_result != callresults.end()) {
-        if (!cb_result->call_completed()) return false;
-        if (cb_result->result.size() > size) return false;
+    uint32 slot = find_slot(api_call);
+    if (slot != CALLRESULT_NO_SLOT) {
+        auto &cb_result = slots[slot].call_result;
+        if (!cb_result.call_completed()) return false;
+        if (cb_result.result.size() > size) return false;
 
-        memcpy(copy_to, &(cb_result->result[0]), cb_result->result.size());
-        cb_result->to_delete = true;
+        if (cb_result.result.size()) memcpy(copy_to, cb_result.result.data(), cb_result.result.size());
+        retire(slot, STEAM_CALLRESULT_KEEP_DELIVERED);
         return true;
     } else {
         return false;
@@ -133,11 +286,18 @@ bool SteamCallResults::callback_result(SteamAPICall_t api_call, void *copy_to, u
 
 void SteamCallResults::rmCallBack(SteamAPICall_t api_call, class CCallbackBase *cb)
 {
-    auto cb_result = std::find_if(callresults.begin(), callresults.end(), [api_call](struct Steam_Call_Result const& item) { return item.api_call == api_call; });
-    if (cb_result != callresults.end()) {
-        auto it = std::find(cb_result->callbacks.begin(), cb_result->callbacks.end(), cb);
-        if (it != cb_result->callbacks.end()) {
-            cb_result->callbacks.erase(it);
+    uint32 slot = find_slot(api_call);
+    if (slot != CALLRESULT_NO_SLOT) {
+        auto &callbacks = slots[slot].call_result.callbacks;
+        auto it = std::find(callbacks.begin(), callbacks.end(), cb);
+        if (it != callbacks.end()) {
+            callbacks.erase(it);
+            auto registered = slots_by_callback.find(cb);
+            if (registered != slots_by_callback.end()) {
+                erase_one(registered->second, slot);
+                if (registered->second.empty()) slots_by_callback.erase(registered);
+            }
+
             CCallbackMgr::SetUnregister(cb);
             PRINT_DEBUG("removed cb for call result [api id=%llu, result k_iCallback=%i] %p", api_call, cb ? (cb->GetICallback()) : -1, cb);
         }
@@ -147,37 +307,48 @@ void SteamCallResults::rmCallBack(SteamAPICall_t api_call, class CCallbackBase *
 void SteamCallResults::rmCallBack(class CCallbackBase *cb)
 {
     //TODO: check if callback is callback or call result?
-    for (auto & cr: callresults) {
-        auto it = std::find(cr.callbacks.begin(), cr.callbacks.end(), cb);
-        if (it != cr.callbacks.end()) {
-            cr.callbacks.erase(it);
-            PRINT_DEBUG("removed cb %p, kind=%i (0=callback, 1=call result)", cb, (int)cr.run_call_completed_cb);
-        }
-
+    auto registered = slots_by_callback.find(cb);
+    if (registered == slots_by_callback.end()) return;
+
+    std::vector<uint32> cb_slots = std::move(registered->second);
+    slots_by_callback.erase(registered);
+    for (auto slot : cb_slots) {
+        auto &cr = slots[slot].call_result;
+        auto it = std::remove(cr.callbacks.begin(), cr.callbacks.end(), cb);
+        if (it == cr.callbacks.end()) continue; // registered more than once on this result, already removed
+
+        cr.callbacks.erase(it, cr.callbacks.end());
+        PRINT_DEBUG("removed cb %p, kind=%i (0=callback, 1=call result)", cb, (int)cr.run_call_completed_cb);
         if (cr.callbacks.size() == 0) {
-            cr.to_delete = true;
+            retire(slot, STEAM_CALLRESULT_KEEP_DELIVERED);
         }
     }
 }
 
 SteamAPICall_t SteamCallResults::addCallResult(SteamAPICall_t api_call, int iCallback, void *result, unsigned int size, double timeout, bool run_call_completed_cb)
+{
+    return addCallResult(api_call, iCallback, Callback_Payload(result, size), timeout, run_call_completed_cb);
+}
+
+SteamAPICall_t SteamCallResults::addCallResult(SteamAPICall_t api_call, int iCallback, const Callback_Payload &result, double timeout, bool run_call_completed_cb)
 {
     PRINT_DEBUG("%i", iCallback);
-    auto cb_result = std::find_if(callresults.begin(), callresults.end(), [api_call](struct Steam_Call_Result const& item) { return item.api_call == api_call; });
-    if (cb_result != callresults.end()) {
+    uint32 slot = find_slot(api_call);
+    if (slot != CALLRESULT_NO_SLOT) {
+        auto &cb_result = slots[slot].call_result;
         // only change the data if this is a previously reserved callresult
-        if (cb_result->reserved) {
-            std::chrono::high_resolution_clock::time_point created = cb_result->created;
-            std::vector<class CCallbackBase *> temp_cbs = cb_result->callbacks;
-            *cb_result = Steam_Call_Result(api_call, iCallback, result, size, timeout, run_call_completed_cb);
-            cb_result->callbacks = temp_cbs;
-            cb_result->created = created;
-            return cb_result->api_call;
+        if (cb_result.reserved) {
+            std::chrono::high_resolution_clock::time_point created = cb_result.created;
+            std::vector<class CCallbackBase *> temp_cbs = std::move(cb_result.callbacks);
+            cb_result = Steam_Call_Result(api_call, iCallback, result, timeout, run_call_completed_cb);
+            cb_result.callbacks = std::move(temp_cbs);
+            cb_result.created = created;
+            schedule_ready(slot);
+            return cb_result.api_call;
         }
     } else {
-        struct Steam_Call_Result res = Steam_Call_Result(api_call, iCallback, result, size, timeout, run_call_completed_cb);
-        callresults.push_back(res);
-        return callresults.back().api_call;
+        slot = new_slot(Steam_Call_Result(api_call, iCallback, result, timeout, run_call_completed_cb));
+        return slots[slot].call_result.api_call;
     }
 
     PRINT_DEBUG("ERROR");
@@ -188,8 +359,8 @@ SteamAPICall_t SteamCallResults::reserveCallResult()
 {
     struct Steam_Call_Result res = Steam_Call_Result(generate_steam_api_call_id(), 0, NULL, 0, 0.0, true);
     res.reserved = true;
-    callresults.push_back(res);
-    return callresults.back().api_call;
+    uint32 slot = new_slot(std::move(res));
+    return slots[slot].call_result.api_call;
 }
 
 SteamAPICall_t SteamCallResults::addCallResult(int iCallback, void *result, unsigned int size, double timeout, bool run_call_completed_cb)
@@ -197,100 +368,119 @@ SteamAPICall_t SteamCallResults::addCallResult(int iCallback, void *result, unsi
     return addCallResult(generate_steam_api_call_id(), iCallback, result, size, timeout, run_call_completed_cb);
 }
 
-void SteamCallResults::setCbAll(void (*cb_all)(std::vector<char> result, int callback))
+SteamAPICall_t SteamCallResults::addCallResult(int iCallback, const Callback_Payload &result, double timeout, bool run_call_completed_cb)
 {
-    this->cb_all = cb_all;
+    return addCallResult(generate_steam_api_call_id(), iCallback, result, timeout, run_call_completed_cb);
 }
 
-void SteamCallResults::runCallResults()
+void SteamCallResults::setCbAll(void (*cb_all)(const Callback_Payload &result, int callback))
 {
-    unsigned long current_size = callresults.size();
-    for (unsigned i = 0; i < current_size; ++i) {
-        unsigned index = i;
+    this->cb_all = cb_all;
+}
 
-        if (!callresults[index].to_delete) {
-            if (callresults[index].can_execute()) {
-                std::vector<char> result = callresults[index].result;
-                SteamAPICall_t api_call = callresults[index].api_call;
-                bool run_call_completed_cb = callresults[index].run_call_completed_cb;
-                int iCallback = callresults[index].iCallback;
-                if (run_call_completed_cb) {
-                    callresults[index].run_call_completed_cb = false;
-                }
+void SteamCallResults::runCallResults(std::chrono::high_resolution_clock::time_point deadline)
+{
+    run_timers();
+
+    // the results which become ready during the callbacks below wait for the next run
+    size_t run_begin = running.size();
+    running.insert(running.end(), ready.begin(), ready.end());
+    ready.clear();
+    size_t run_end = running.size();
+    for (size_t r = run_begin; r < run_end; ++r) {
+        if (deadline != CALLBACKS_NO_DEADLINE && r > run_begin && std::chrono::high_resolution_clock::now() >= deadline) {
+            // sorted back in order with the ones which became ready meanwhile at the start of the next run
+            deferred_results += run_end - r;
+            ready.insert(ready.end(), running.begin() + r, running.begin() + run_end);
+            PRINT_DEBUG("out of time, %zu call results deferred", run_end - r);
+            break;
+        }
 
-                callresults[index].to_delete = true;
-                if (callresults[index].has_cb()) {
-                    std::vector<class CCallbackBase *> temp_cbs = callresults[index].callbacks;
-                    for (auto & cb : temp_cbs) {
-                        PRINT_DEBUG("Calling callresult %p %i, kind=%i (0=callback, 1=call result)", cb, cb->GetICallback(), (int)run_call_completed_cb);
-                        global_mutex.unlock();
-
-                        //TODO: unlock relock doesn't work if mutex was locked more than once.
-                        if (run_call_completed_cb) { //run the right function depending on if it's a callback or a call result.
-                            cb->Run(&(result[0]), false, api_call);
-                        } else { // if this is a callback
-                            cb->Run(&(result[0]));
-                        }
-
-                        // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-                        //COULD BE DELETED SO DON'T TOUCH CB
-                        // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-
-                        global_mutex.lock();
-                        PRINT_DEBUG("callresult done");
-                    }
-                }
+        uint32 index = running[r].slot;
+        if (!slots[index].used || slots[index].generation != running[r].generation) continue;
+        if (slots[index].state != CALLRESULT_READY || slots[index].call_result.to_delete) continue;
 
-                if (run_call_completed_cb) {
-                    //can it happen that one is removed during the callback?
-                    std::vector<class CCallbackBase *> callbacks = completed_callbacks;
-                    SteamAPICallCompleted_t data{};
-                    data.m_hAsyncCall = api_call;
-                    data.m_iCallback = iCallback;
-                    data.m_cubParam = (uint32)result.size();
-
-                    for (auto & cb: callbacks) {
-                        PRINT_DEBUG("Calling complete cb %p %i %llu", cb, iCallback, api_call);
-                        //TODO: check if this is a problem or not.
-                        SteamAPICallCompleted_t temp = data;
-                        global_mutex.unlock();
-                        cb->Run(&temp);
-                        global_mutex.lock();
-                    }
-
-                    if (cb_all) {
-                        std::vector<char> res{};
-                        res.resize(sizeof(data));
-                        memcpy(&(res[0]), &data, sizeof(data));
-                        cb_all(res, data.k_iCallback);
-                    }
-                } else {
-                    if (cb_all) {
-                        cb_all(result, iCallback);
-                    }
-                }
-            } else {
-                if (callresults[index].timed_out()) {
-                    callresults[index].to_delete = true;
+        Callback_Payload result = slots[index].call_result.result;
+        SteamAPICall_t api_call = slots[index].call_result.api_call;
+        bool run_call_completed_cb = slots[index].call_result.run_call_completed_cb;
+        int iCallback = slots[index].call_result.iCallback;
+        if (run_call_completed_cb) {
+            slots[index].call_result.run_call_completed_cb = false;
+        }
+
+        // the game got it, unless only the completion was notified: it can read it with GetAPICallResult() until it times out
+        bool delivered = !run_call_completed_cb || (slots[index].call_result.has_cb() && !cb_all);
+        retire(index, delivered ? STEAM_CALLRESULT_KEEP_DELIVERED : STEAM_CALLRESULT_TIMEOUT);
+        if (slots[index].call_result.has_cb()) {
+            auto &temp_cbs = slots[index].call_result.callbacks;
+            size_t cbs_begin = callbacks_to_run.size();
+            callbacks_to_run.insert(callbacks_to_run.end(), temp_cbs.begin(), temp_cbs.end());
+            size_t cbs_end = callbacks_to_run.size();
+            for (size_t c = cbs_begin; c < cbs_end; ++c) {
+                auto cb = callbacks_to_run[c];
+                PRINT_DEBUG("Calling callresult %p %i, kind=%i (0=callback, 1=call result)", cb, cb->GetICallback(), (int)run_call_completed_cb);
+                global_mutex.unlock();
+
+                //TODO: unlock relock doesn't work if mutex was locked more than once.
+                if (run_call_completed_cb) { //run the right function depending on if it's a callback or a call result.
+                    cb->Run(result.data(), false, api_call);
+                } else { // if this is a callback
+                    cb->Run(result.data());
                 }
+
+                // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+                //COULD BE DELETED SO DON'T TOUCH CB
+                // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+
+                global_mutex.lock();
+                PRINT_DEBUG("callresult done");
             }
+
+            callbacks_to_run.resize(cbs_begin);
         }
-    }
 
-    PRINT_DEBUG("erase to_delete");
-    auto c = std::begin(callresults);
-    while (c != std::end(callresults)) {
-        if (c->to_delete) {
-            if (c->timed_out()) {
-                PRINT_DEBUG("removed callresult %i", c->iCallback);
-                c = callresults.erase(c);
-            } else {
-                ++c;
+        if (run_call_completed_cb) {
+            //can it happen that one is removed during the callback?
+            size_t cbs_begin = callbacks_to_run.size();
+            callbacks_to_run.insert(callbacks_to_run.end(), completed_callbacks.begin(), completed_callbacks.end());
+            size_t cbs_end = callbacks_to_run.size();
+            SteamAPICallCompleted_t data{};
+            data.m_hAsyncCall = api_call;
+            data.m_iCallback = iCallback;
+            data.m_cubParam = (uint32)result.size();
+
+            for (size_t c = cbs_begin; c < cbs_end; ++c) {
+                auto cb = callbacks_to_run[c];
+                PRINT_DEBUG("Calling complete cb %p %i %llu", cb, iCallback, api_call);
+                //TODO: check if this is a problem or not.
+                SteamAPICallCompleted_t temp = data;
+                global_mutex.unlock();
+                cb->Run(&temp);
+                global_mutex.lock();
+            }
+
+            callbacks_to_run.resize(cbs_begin);
+            if (cb_all) {
+                cb_all(Callback_Payload(&data, sizeof(data)), data.k_iCallback);
             }
         } else {
-            ++c;
+            if (cb_all) {
+                cb_all(result, iCallback);
+            }
         }
     }
+
+    running.resize(run_begin);
+}
+
+uint64 SteamCallResults::deferred() const
+{
+    return deferred_results;
+}
+
+size_t SteamCallResults::size() const
+{
+    return slot_by_api_call.size();
 }
 
 
@@ -315,7 +505,7 @@ void SteamCallBacks::addCallBack(int iCallback, class CCallbackBase *cb)
         CCallbackMgr::SetRegister(cb, iCallback);
         for (auto & res: callbacks[iCallback].results) {
             //TODO: timeout?
-            SteamAPICall_t api_id = results->addCallResult(iCallback, &(res[0]), res.size(), 0.0, false);
+            SteamAPICall_t api_id = results->addCallResult(iCallback, res, 0.0, false);
             results->addCallBack(api_id, cb);
         }
     }
@@ -325,26 +515,23 @@ void SteamCallBacks::addCBResult(int iCallback, void *result, unsigned int size,
 {
     if (dont_post_if_already) {
         for (auto & r : callbacks[iCallback].results) {
-            if (r.size() == size) {
-                if (memcmp(&(r[0]), result, size) == 0) {
-                    //cb already posted
-                    return;
-                }
+            if (r.equals(result, size)) {
+                //cb already posted
+                return;
             }
         }
     }
 
-    std::vector<char> temp{};
-    temp.resize(size);
-    memcpy(&(temp[0]), result, size);
-    callbacks[iCallback].results.push_back(temp);
+    // one copy shared by all the call results of this broadcast
+    Callback_Payload payload(result, size);
+    callbacks[iCallback].results.push_back(payload);
     for (auto cb: callbacks[iCallback].callbacks) {
-        SteamAPICall_t api_id = results->addCallResult(iCallback, result, size, timeout, false);
+        SteamAPICall_t api_id = results->addCallResult(iCallback, payload, timeout, false);
         results->addCallBack(api_id, cb);
     }
 
     if (callbacks[iCallback].callbacks.empty()) {
-        results->addCallResult(iCallback, result, size, timeout, false);
+        results->addCallResult(iCallback, payload, timeout, false);
     }
 }
 
@@ -410,10 +597,28 @@ void RunEveryRunCB::remove(void (*cb)(void *object), void *object)
     }
 }
 
-void RunEveryRunCB::run() const
+bool RunEveryRunCB::run(std::chrono::high_resolution_clock::time_point deadline)
 {
     std::vector<struct RunCBs> temp_cbs = cbs;
-    for (auto c : temp_cbs) {
+    size_t count = temp_cbs.size();
+    size_t first = count ? next_cb % count : 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (deadline != CALLBACKS_NO_DEADLINE && i && std::chrono::high_resolution_clock::now() >= deadline) {
+            next_cb = (first + i) % count;
+            deferred_cbs += count - i;
+            PRINT_DEBUG("out of time, %zu callbacks deferred", count - i);
+            return false;
+        }
+
+        auto &c = temp_cbs[(first + i) % count];
         c.function(c.object);
     }
+
+    next_cb = 0;
+    return true;
+}
+
+uint64 RunEveryRunCB::deferred() const
+{
+    return deferred_cbs;
 }
@@ -0,0 +1,159 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "dll/capture.h"
+#include "dll/common_includes.h"
+
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+#define CAPTURE_FLUSH_INTERVAL std::chrono::seconds(1)
+// a bigger record is a corrupted file, the biggest messages are fragmented well below that
+#define CAPTURE_MAX_RECORD_SIZE (64 * 1024 * 1024)
+
+static void append_varint(std::string &out, uint64 value)
+{
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+
+    out.push_back((char)value);
+}
+
+static bool read_varint(std::ifstream &in, uint64 &value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == std::char_traits<char>::eof()) return false;
+
+        value |= (uint64)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+
+    return false;
+}
+
+Capture_Writer::~Capture_Writer()
+{
+    close();
+}
+
+bool Capture_Writer::open(const std::string &path, uint64 steam_id)
+{
+    close();
+    file.open(utf8_decode(path), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        PRINT_DEBUG("failed to create '%s'", path.c_str());
+        return false;
+    }
+
+    buffer.append(CAPTURE_MAGIC);
+    buffer.push_back((char)CAPTURE_VERSION);
+    for (int i = 0; i < 8; ++i) {
+        buffer.push_back((char)(steam_id >> (i * 8)));
+    }
+
+    start = last_flush = std::chrono::steady_clock::now();
+    last_time_us = 0;
+    flush();
+    PRINT_DEBUG("recording the network messages to '%s'", path.c_str());
+    return true;
+}
+
+void Capture_Writer::close()
+{
+    if (!file.is_open()) return;
+
+    flush();
+    file.close();
+}
+
+bool Capture_Writer::is_open() const
+{
+    return file.is_open();
+}
+
+void Capture_Writer::write(enum Capture_Record_Type type, bool reliable, const std::string &data)
+{
+    if (!file.is_open()) return;
+
+    auto now = std::chrono::steady_clock::now();
+    uint64 time_us = (uint64)std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+    buffer.push_back((char)(type | (reliable ? CAPTURE_FLAG_RELIABLE : 0)));
+    append_varint(buffer, time_us - last_time_us);
+    append_varint(buffer, data.size());
+    buffer.append(data);
+    last_time_us = time_us;
+
+    if (buffer.size() >= CAPTURE_BUFFER_SIZE || now - last_flush >= CAPTURE_FLUSH_INTERVAL) {
+        flush();
+    }
+}
+
+// the last records don't wait for the next write when the traffic stops
+void Capture_Writer::flush_due()
+{
+    if (!buffer.empty() && std::chrono::steady_clock::now() - last_flush >= CAPTURE_FLUSH_INTERVAL) flush();
+}
+
+void Capture_Writer::flush()
+{
+    last_flush = std::chrono::steady_clock::now();
+    if (buffer.empty()) return;
+
+    file.write(buffer.data(), buffer.size());
+    file.flush();
+    buffer.clear();
+}
+
+bool Capture_Reader::open(const std::string &path)
+{
+    file.open(utf8_decode(path), std::ios::in | std::ios::binary);
+    if (!file.is_open()) return false;
+
+    char header[sizeof(CAPTURE_MAGIC) - 1 + 1 + 8];
+    if (!file.read(header, sizeof(header))) return false;
+    if (memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1) != 0) return false;
+    if (header[sizeof(CAPTURE_MAGIC) - 1] != CAPTURE_VERSION) return false;
+
+    steam_id = 0;
+    for (int i = 0; i < 8; ++i) {
+        steam_id |= (uint64)(uint8)header[sizeof(CAPTURE_MAGIC) + i] << (i * 8);
+    }
+
+    time_us = 0;
+    return true;
+}
+
+bool Capture_Reader::next(struct Capture_Record &record)
+{
+    int type = file.get();
+    if (type == std::char_traits<char>::eof()) return false;
+
+    uint64 delta_us{}, size{};
+    if (!read_varint(file, delta_us) || !read_varint(file, size)) return false;
+    if (size > CAPTURE_MAX_RECORD_SIZE) return false;
+
+    record.data.resize((size_t)size);
+    if (size && !file.read(&record.data[0], (std::streamsize)size)) return false;
+
+    time_us += delta_us;
+    record.type = (uint8)(type & ~CAPTURE_FLAG_RELIABLE);
+    record.reliable = (type & CAPTURE_FLAG_RELIABLE) != 0;
+    record.time_us = time_us;
+    return true;
+}
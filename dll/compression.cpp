@@ -0,0 +1,179 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "dll/compression.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// the last 5 bytes are always literals and the last match starts at least 12 bytes before the end
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_FIND_LIMIT 12
+#define LZ_HASH_BITS 12
+// after this many misses in a row the search starts skipping bytes, cheap on incompressible data
+#define LZ_SKIP_TRIGGER 6
+
+static inline uint32 lz_read32(const uint8 *p)
+{
+    uint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32 lz_hash(uint32 sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8 *lz_write_length(uint8 *op, size_t length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+
+    *op++ = (uint8)length;
+    return op;
+}
+
+static bool lz_read_length(const uint8 *&ip, const uint8 *end, size_t &length)
+{
+    uint8 byte;
+    do {
+        if (ip == end) return false;
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+static uint8 *lz_write_sequence(uint8 *op, const uint8 *literals, size_t literals_size, size_t offset, size_t match_size)
+{
+    uint8 *token = op++;
+    *token = (uint8)(std::min(literals_size, (size_t)15) << 4);
+    if (literals_size >= 15) op = lz_write_length(op, literals_size - 15);
+    memcpy(op, literals, literals_size);
+    op += literals_size;
+
+    // the last sequence has no match
+    if (!offset) return op;
+
+    *op++ = (uint8)(offset & 0xFF);
+    *op++ = (uint8)(offset >> 8);
+    match_size -= LZ_MIN_MATCH;
+    *token |= (uint8)std::min(match_size, (size_t)15);
+    if (match_size >= 15) op = lz_write_length(op, match_size - 15);
+    return op;
+}
+
+size_t lz_compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+    if (capacity < lz_compress_bound(size)) return 0;
+
+    const uint8 *in = (const uint8 *)src;
+    const uint8 *end = in + size;
+    const uint8 *anchor = in;
+    uint8 *op = (uint8 *)dst;
+
+    if (size > LZ_MATCH_FIND_LIMIT) {
+        // position + 1 of the last sequence seen with each hash, 0 = none
+        uint32 table[1 << LZ_HASH_BITS]{};
+        const uint8 *match_start_limit = end - LZ_MATCH_FIND_LIMIT;
+        const uint8 *match_end_limit = end - LZ_LAST_LITERALS;
+        const uint8 *ip = in;
+        unsigned misses = 0;
+        while (ip <= match_start_limit) {
+            uint32 sequence = lz_read32(ip);
+            uint32 &entry = table[lz_hash(sequence)];
+            const uint8 *ref = entry ? in + entry - 1 : nullptr;
+            entry = (uint32)(ip - in) + 1;
+            if (!ref || (size_t)(ip - ref) > LZ_MAX_OFFSET || lz_read32(ref) != sequence) {
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+
+            misses = 0;
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+
+            const uint8 *match_end = ip + LZ_MIN_MATCH;
+            const uint8 *ref_end = ref + LZ_MIN_MATCH;
+            while (match_end < match_end_limit && *match_end == *ref_end) {
+                ++match_end;
+                ++ref_end;
+            }
+
+            op = lz_write_sequence(op, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(match_end - ip));
+            ip = anchor = match_end;
+            // helps finding the next match right after this one
+            if (ip <= match_start_limit) table[lz_hash(lz_read32(ip - 2))] = (uint32)(ip - 2 - in) + 1;
+        }
+    }
+
+    op = lz_write_sequence(op, anchor, (size_t)(end - anchor), 0, 0);
+    return (size_t)(op - (uint8 *)dst);
+}
+
+bool lz_decompress(const char *src, size_t src_size, char *dst, size_t size)
+{
+    const uint8 *ip = (const uint8 *)src;
+    const uint8 *end = ip + src_size;
+    uint8 *out = (uint8 *)dst;
+    uint8 *op = out;
+    uint8 *out_end = out + size;
+
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t literals_size = token >> 4;
+        if (literals_size == 15 && !lz_read_length(ip, end, literals_size)) return false;
+        if ((size_t)(end - ip) < literals_size || (size_t)(out_end - op) < literals_size) return false;
+
+        memcpy(op, ip, literals_size);
+        op += literals_size;
+        ip += literals_size;
+        if (ip == end) break;
+
+        if (end - ip < 2) return false;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (size_t)(op - out)) return false;
+
+        size_t match_size = token & 15;
+        if (match_size == 15 && !lz_read_length(ip, end, match_size)) return false;
+        match_size += LZ_MIN_MATCH;
+        if ((size_t)(out_end - op) < match_size) return false;
+
+        const uint8 *ref = op - offset;
+        if (offset >= match_size) {
+            memcpy(op, ref, match_size);
+        } else {
+            // overlapping match, repeats the last 'offset' bytes
+            for (size_t i = 0; i < match_size; ++i) op[i] = ref[i];
+        }
+
+        op += match_size;
+    }
+
+    return op == out_end;
+}
@@ -18,6 +18,7 @@
 #define STEAM_API_FUNCTIONS_IMPL
 #include "dll/dll.h"
 #include "dll/settings_parser.h"
+#include "dll/bounded_queue.h"
 
 
 static char old_client[128] = STEAMCLIENT_INTERFACE_VERSION; //"SteamClient017";
@@ -1010,29 +1011,58 @@ STEAMAPI_API void S_CALLTYPE SteamAPI_SetBreakpadAppID( uint32 unAppID )
     PRINT_DEBUG_TODO();
 }
 
+// filled by the callback pump, polled by the game without the global lock, often from its own job threads
+// when the game doesn't poll, the oldest callbacks are dropped (a power of 2)
+#define MANUAL_DISPATCH_QUEUE_SIZE 4096
+
 struct cb_data {
     int cb_id{};
-    std::vector<char> result{};
+    Callback_Payload result{}; // shared with the call result, not copied
+};
+
+struct manual_dispatch_pipe {
+    Bounded_Queue<struct cb_data> queue{MANUAL_DISPATCH_QUEUE_SIZE};
+    // given by SteamAPI_ManualDispatch_GetNextCallback() until SteamAPI_ManualDispatch_FreeLastCallback(),
+    // only touched by the thread polling the pipe
+    struct cb_data last{};
+    bool has_last = false;
 };
-static std::queue<struct cb_data> client_cb{};
-static std::queue<struct cb_data> server_cb{};
+static struct manual_dispatch_pipe client_cb{};
+static struct manual_dispatch_pipe server_cb{};
 
-static void cb_add_queue_server(std::vector<char> result, int callback)
+static void cb_add_queue(struct manual_dispatch_pipe &pipe, const Callback_Payload &result, int callback)
 {
-    PRINT_DEBUG("adding callback=%i, size=%zu", callback, result.size());
     struct cb_data cb{};
     cb.cb_id = callback;
     cb.result = result;
-    server_cb.push(cb);
+    while (!pipe.queue.try_push(cb)) {
+        struct cb_data dropped{};
+        if (pipe.queue.try_pop(dropped)) PRINT_DEBUG("queue full, dropped callback=%i", dropped.cb_id);
+    }
 }
 
-static void cb_add_queue_client(std::vector<char> result, int callback)
+static void cb_add_queue_server(const Callback_Payload &result, int callback)
 {
-    PRINT_DEBUG("adding callback=%i, m_iCallback=%i", callback, ((SteamAPICallCompleted_t *)&result[0])->m_iCallback);
-    struct cb_data cb{};
-    cb.cb_id = callback;
-    cb.result = result;
-    client_cb.push(cb);
+    PRINT_DEBUG("adding callback=%i, size=%zu", callback, result.size());
+    cb_add_queue(server_cb, result, callback);
+}
+
+static void cb_add_queue_client(const Callback_Payload &result, int callback)
+{
+    PRINT_DEBUG("adding callback=%i, m_iCallback=%i", callback, ((SteamAPICallCompleted_t *)result.data())->m_iCallback);
+    cb_add_queue(client_cb, result, callback);
+}
+
+static void cb_free_last(struct manual_dispatch_pipe &pipe)
+{
+    if (pipe.has_last) {
+        pipe.last.result = Callback_Payload();
+        pipe.has_last = false;
+    } else {
+        // freeing without getting it first drops the next one
+        struct cb_data dropped{};
+        pipe.queue.try_pop(dropped);
+    }
 }
 
 /// Inform the API that you wish to use manual event dispatch.  This must be called after SteamAPI_Init, but before
@@ -1074,7 +1104,9 @@ STEAMAPI_API steam_bool S_CALLTYPE SteamAPI_ManualDispatch_GetNextCallback( HSte
     PRINT_DEBUG("%i %p", hSteamPipe, pCallbackMsg);
     Steam_Client *steam_client = get_steam_client();
     if (!steam_client->steamclient_server_inited) {
-        while(!server_cb.empty()) server_cb.pop();
+        // any thread can drain the queue, the last one given belongs to the thread polling the server pipe
+        struct cb_data dropped{};
+        while (server_cb.queue.try_pop(dropped)) {}
     }
 
     auto it = steam_client->steam_pipes.find(hSteamPipe);
@@ -1083,11 +1115,15 @@ STEAMAPI_API steam_bool S_CALLTYPE SteamAPI_ManualDispatch_GetNextCallback( HSte
         return false;
     }
 
-    std::queue<struct cb_data> *q = NULL;
+    struct manual_dispatch_pipe *q = NULL;
     HSteamUser m_hSteamUser = 0;
     if (it->second == Steam_Pipe::SERVER) {
         q = &server_cb;
         m_hSteamUser = SERVER_HSTEAMUSER;
+        if (!steam_client->steamclient_server_inited) {
+            q->last.result = Callback_Payload();
+            q->has_last = false;
+        }
     } else if (it->second == Steam_Pipe::CLIENT) {
         q = &client_cb;
         m_hSteamUser = CLIENT_HSTEAMUSER;
@@ -1096,29 +1132,33 @@ STEAMAPI_API steam_bool S_CALLTYPE SteamAPI_ManualDispatch_GetNextCallback( HSte
         return false;
     }
 
-    if (q->empty()) {
-        PRINT_DEBUG("error queue is empty");
+    if (!pCallbackMsg) {
+        PRINT_DEBUG("error nullptr pCallbackMsg");
         return false;
     }
 
-    if (pCallbackMsg) {
-        pCallbackMsg->m_hSteamUser = m_hSteamUser;
-        pCallbackMsg->m_iCallback = q->front().cb_id;
-        pCallbackMsg->m_pubParam = (uint8 *)&(q->front().result[0]);
-        pCallbackMsg->m_cubParam = q->front().result.size();
-        PRINT_DEBUG("cb number %i", q->front().cb_id);
-        return true;
+    // the same one until it's freed
+    if (!q->has_last) {
+        if (!q->queue.try_pop(q->last)) {
+            PRINT_DEBUG("error queue is empty");
+            return false;
+        }
+
+        q->has_last = true;
     }
 
-    PRINT_DEBUG("error nullptr pCallbackMsg");
-    return false;
+    pCallbackMsg->m_hSteamUser = m_hSteamUser;
+    pCallbackMsg->m_iCallback = q->last.cb_id;
+    pCallbackMsg->m_pubParam = (uint8 *)q->last.result.data();
+    pCallbackMsg->m_cubParam = (int)q->last.result.size();
+    PRINT_DEBUG("cb number %i", q->last.cb_id);
+    return true;
 }
 
 /// You must call this after dispatching the callback, if SteamAPI_ManualDispatch_GetNextCallback returns true.
 STEAMAPI_API void S_CALLTYPE SteamAPI_ManualDispatch_FreeLastCallback( HSteamPipe hSteamPipe )
 {
     PRINT_DEBUG("%i", hSteamPipe);
-    std::queue<struct cb_data> *q = NULL;
     Steam_Client *steam_client = get_steam_client();
     auto it = steam_client->steam_pipes.find(hSteamPipe);
     if (steam_client->steam_pipes.end() == it) {
@@ -1126,14 +1166,10 @@ STEAMAPI_API void S_CALLTYPE SteamAPI_ManualDispatch_FreeLastCallback( HSteamPip
     }
 
     if (it->second == Steam_Pipe::SERVER) {
-        q = &server_cb;
+        cb_free_last(server_cb);
     } else if (it->second == Steam_Pipe::CLIENT) {
-        q = &client_cb;
-    } else {
-        return;
+        cb_free_last(client_cb);
     }
-
-    if (!q->empty()) q->pop();
 }
 
 /// Return the call result for the specified call on the specified pipe.  You really should
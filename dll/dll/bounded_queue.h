@@ -0,0 +1,104 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef BOUNDED_QUEUE_INCLUDE_H
+#define BOUNDED_QUEUE_INCLUDE_H
+
+// included by callback_payload.cpp and dll.cpp, keep it free of the emulator headers
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// lock-free multi-producer multi-consumer FIFO of a fixed capacity (Vyukov's bounded queue)
+// every cell has a sequence number telling whose turn it is: a producer waits for it to be equal to
+// its position, a consumer for position + 1, so the cells are never shared and never allocated again
+template <typename T>
+class Bounded_Queue {
+    struct Cell {
+        std::atomic<size_t> sequence{};
+        T value{};
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos{};
+    alignas(64) std::atomic<size_t> dequeue_pos{};
+
+public:
+    // the capacity is a power of 2
+    explicit Bounded_Queue(size_t capacity)
+        : cells(new Cell[capacity]), mask(capacity - 1)
+    {
+        for (size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    Bounded_Queue(const Bounded_Queue &) = delete;
+    Bounded_Queue &operator=(const Bounded_Queue &) = delete;
+
+    // false when full, 'value' is only moved from on success
+    bool try_push(T &value)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // false when empty
+    bool try_pop(T &value)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        // moved out so the cell doesn't keep a reference to it until it's reused
+        value = std::move(cell->value);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif // BOUNDED_QUEUE_INCLUDE_H
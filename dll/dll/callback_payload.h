@@ -0,0 +1,57 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef CALLBACK_PAYLOAD_INCLUDE_H
+#define CALLBACK_PAYLOAD_INCLUDE_H
+
+// included by callsystem.h, keep it free of the emulator headers
+#include <cstddef>
+#include "steam/steamtypes.h"
+
+// almost all the callback structs are smaller than this, they're stored right after the header of
+// a pooled block of the smallest size class which fits, the bigger ones get a block of their size
+#define CALLBACK_PAYLOAD_POOLED_SIZE 1024
+// blocks of each size class kept for reuse, the ones released beyond that are freed (a power of 2)
+#define CALLBACK_PAYLOAD_POOL_MAX 1024
+
+struct Callback_Payload_Block;
+
+// bytes of a callback or call result, copied once when created and read only after that
+// copies of a payload share the same block (reference counted), so a callback broadcast to N
+// listeners or queued for the manual dispatch isn't copied again
+class Callback_Payload {
+    struct Callback_Payload_Block *block = nullptr;
+
+    void release();
+
+public:
+    Callback_Payload() = default;
+    Callback_Payload(const void *data, size_t size);
+    Callback_Payload(const Callback_Payload &other);
+    Callback_Payload(Callback_Payload &&other) noexcept;
+    Callback_Payload &operator=(const Callback_Payload &other);
+    Callback_Payload &operator=(Callback_Payload &&other) noexcept;
+    ~Callback_Payload();
+
+    // nullptr when empty, writable since the callbacks get a non const pointer
+    char *data() const;
+    size_t size() const;
+    bool empty() const;
+    bool equals(const void *data, size_t size) const;
+};
+
+#endif // CALLBACK_PAYLOAD_INCLUDE_H
@@ -19,10 +19,17 @@
 #define __INCLUDED_CALLSYSTEM_H__
 
 #include "common_includes.h"
+#include "callback_payload.h"
+#include "timer_wheel.h"
 
 #define DEFAULT_CB_TIMEOUT 0.002
 #define STEAM_CALLRESULT_TIMEOUT 120.0
 #define STEAM_CALLRESULT_WAIT_FOR_CB 0.01
+// a call result delivered to its callbacks, or read with GetAPICallResult(), can still be read this long after
+#define STEAM_CALLRESULT_KEEP_DELIVERED 1.0
+#define CALLRESULT_NO_SLOT ((uint32)-1)
+// no time budget for the runs below
+#define CALLBACKS_NO_DEADLINE (std::chrono::high_resolution_clock::time_point::max())
 
 
 class CCallbackMgr
@@ -37,7 +44,7 @@ public:
 struct Steam_Call_Result {
     SteamAPICall_t api_call{};
     std::vector<class CCallbackBase *> callbacks{};
-    std::vector<char> result{};
+    Callback_Payload result{};
     bool to_delete = false;
     bool reserved = false;
     std::chrono::high_resolution_clock::time_point created{};
@@ -45,24 +52,73 @@ struct Steam_Call_Result {
     bool run_call_completed_cb{};
     int iCallback{};
 
+    Steam_Call_Result() = default;
     Steam_Call_Result(SteamAPICall_t a, int icb, void *r, unsigned int s, double r_in, bool run_cc_cb);
+    Steam_Call_Result(SteamAPICall_t a, int icb, const Callback_Payload &r, double r_in, bool run_cc_cb);
 
     bool operator==(const struct Steam_Call_Result& other) const;
 
-    bool timed_out() const;
-
     bool call_completed() const;
 
-    bool can_execute() const;
-
     bool has_cb() const;
 
 };
 
+enum Steam_Call_Result_State {
+    CALLRESULT_WAITING, // for its run_in delay, or to be filled when reserved
+    CALLRESULT_WAITING_FOR_CB, // completed without callback, runs when one is added or after STEAM_CALLRESULT_WAIT_FOR_CB
+    CALLRESULT_READY, // in SteamCallResults::ready
+    CALLRESULT_DONE, // delivered or deleted, until its expiry
+};
+
+struct Steam_Call_Result_Slot {
+    struct Steam_Call_Result call_result{};
+    uint64 serial{}; // order of the results
+    uint32 generation{}; // incremented when freed, for the timers of the previous results of the slot
+    uint32 next_free = CALLRESULT_NO_SLOT;
+    bool used = false;
+    uint8 state = CALLRESULT_WAITING; // Steam_Call_Result_State
+    struct Scheduled_Timer ready_timer{}, expiry_timer{};
+};
+
+// a result to run, checked against its slot when it's its turn
+struct Steam_Call_Result_Ready {
+    uint64 serial{};
+    uint32 slot{};
+    uint32 generation{};
+};
+
 class SteamCallResults {
-    std::vector<struct Steam_Call_Result> callresults{};
+    // the results live in a slab of reused slots, referenced by index since the slab can grow
+    // while the callbacks run
+    std::vector<struct Steam_Call_Result_Slot> slots{};
+    uint32 free_slots = CALLRESULT_NO_SLOT;
+    uint64 last_serial{};
+    std::unordered_map<SteamAPICall_t, uint32> slot_by_api_call{};
+    // the slots each callback is registered on, once per registration
+    std::unordered_map<class CCallbackBase *, std::vector<uint32>> slots_by_callback{};
     std::vector<class CCallbackBase *> completed_callbacks{};
-    void (*cb_all)(std::vector<char> result, int callback) = nullptr;
+    void (*cb_all)(const Callback_Payload &result, int callback) = nullptr;
+    // snapshots of the callbacks to run, as a stack shared with the nested runs so it doesn't allocate once grown
+    std::vector<class CCallbackBase *> callbacks_to_run{};
+    // the results become ready and expire on timers, a run only touches the results which are due
+    Timer_Wheel timers{};
+    std::vector<struct Timer_Wheel_Entry> expired_timers{};
+    // sorted by serial when a run starts
+    std::vector<struct Steam_Call_Result_Ready> ready{};
+    // the ready results taken by the runs, as a stack shared with the nested runs
+    std::vector<struct Steam_Call_Result_Ready> running{};
+    uint64 deferred_results{};
+
+    uint32 find_slot(SteamAPICall_t api_call) const;
+    uint32 new_slot(struct Steam_Call_Result &&call_result);
+    void free_slot(uint32 slot);
+    void schedule_timer(uint32 slot, struct Scheduled_Timer &timer, uint64 kind, std::chrono::high_resolution_clock::time_point deadline);
+    void schedule_ready(uint32 slot);
+    void set_ready(uint32 slot);
+    // marks it to_delete, it's freed 'keep' seconds from now unless it expires earlier
+    void retire(uint32 slot, double keep);
+    void run_timers();
 
 public:
     void addCallCompleted(class CCallbackBase *cb);
@@ -81,18 +137,31 @@ public:
 
     SteamAPICall_t addCallResult(SteamAPICall_t api_call, int iCallback, void *result, unsigned int size, double timeout=DEFAULT_CB_TIMEOUT, bool run_call_completed_cb=true);
 
+    SteamAPICall_t addCallResult(SteamAPICall_t api_call, int iCallback, const Callback_Payload &result, double timeout=DEFAULT_CB_TIMEOUT, bool run_call_completed_cb=true);
+
     SteamAPICall_t reserveCallResult();
 
     SteamAPICall_t addCallResult(int iCallback, void *result, unsigned int size, double timeout=DEFAULT_CB_TIMEOUT, bool run_call_completed_cb=true);
 
-    void setCbAll(void (*cb_all)(std::vector<char> result, int callback));
+    SteamAPICall_t addCallResult(int iCallback, const Callback_Payload &result, double timeout=DEFAULT_CB_TIMEOUT, bool run_call_completed_cb=true);
+
+    // the payload is only valid during the call, a copy of it shares the bytes instead of copying them
+    void setCbAll(void (*cb_all)(const Callback_Payload &result, int callback));
 
-    void runCallResults();
+    // after the deadline, the ready results left (at least one runs) wait for the next run, still first in line
+    void runCallResults(std::chrono::high_resolution_clock::time_point deadline=CALLBACKS_NO_DEADLINE);
+
+    // ready results left for the next run because of the deadline, since the start
+    uint64 deferred() const;
+
+    // results still stored, including the delivered ones kept until they time out
+    size_t size() const;
 };
 
 struct Steam_Call_Back {
     std::vector<class CCallbackBase *> callbacks{};
-    std::vector<std::vector<char>> results{};
+    // posted this run, for the callbacks registered later, shared with their call results
+    std::vector<Callback_Payload> results{};
 };
 
 class SteamCallBacks {
@@ -120,13 +189,20 @@ struct RunCBs {
 
 class RunEveryRunCB {
     std::vector<struct RunCBs> cbs{};
+    // where the next run starts after a deadline, it goes around from there
+    size_t next_cb{};
+    uint64 deferred_cbs{};
 
 public:
     void add(void (*cb)(void *object), void *object);
 
     void remove(void (*cb)(void *object), void *object);
 
-    void run() const;
+    // after the deadline, the callbacks left (at least one runs) run first the next time, false if some were left
+    bool run(std::chrono::high_resolution_clock::time_point deadline=CALLBACKS_NO_DEADLINE);
+
+    // callbacks left for the next run because of the deadline, since the start
+    uint64 deferred() const;
 };
 
 #endif // __INCLUDED_CALLSYSTEM_H__
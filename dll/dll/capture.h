@@ -0,0 +1,85 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef CAPTURE_INCLUDE_H
+#define CAPTURE_INCLUDE_H
+
+// included by network.h, keep it free of the emulator headers
+#include <chrono>
+#include <fstream>
+#include <string>
+#include "steam/steamtypes.h"
+
+// recording of the Common_Message stream of an instance, to replay the same traffic later
+// the file starts with CAPTURE_MAGIC, the format version (1 byte) and the steam id of the
+// recording instance (8 bytes, little endian), then one record per message:
+//   type (1 byte, Capture_Record_Type, | CAPTURE_FLAG_RELIABLE for reliable sends)
+//   microseconds since the previous record (varint)
+//   size of the serialized Common_Message (varint)
+//   the serialized Common_Message
+
+#define CAPTURE_MAGIC "GBECAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FLAG_RELIABLE 0x80
+
+enum Capture_Record_Type {
+    CAPTURE_RECEIVED = 1, // delivered to the callbacks, after decompression and reordering
+    CAPTURE_USER_STATUS = 2, // a peer connected or disconnected, Low_Level message
+    CAPTURE_SENT = 3, // given to one of the send functions, before the fan-out and compression
+};
+
+struct Capture_Record {
+    uint8 type{}; // Capture_Record_Type
+    bool reliable = false;
+    uint64 time_us{}; // since the start of the recording, monotonic
+    std::string data{};
+};
+
+class Capture_Writer {
+    std::ofstream file{};
+    std::string buffer{};
+    std::chrono::steady_clock::time_point start{}, last_flush{};
+    uint64 last_time_us{};
+
+public:
+    ~Capture_Writer();
+
+    // an existing file is overwritten
+    bool open(const std::string &path, uint64 steam_id);
+    void close();
+    bool is_open() const;
+
+    // the records are buffered, written when the buffer is big enough, every second and when closed
+    void write(enum Capture_Record_Type type, bool reliable, const std::string &data);
+    void flush_due(); // called regularly, flushes what was buffered more than a second ago
+    void flush();
+};
+
+class Capture_Reader {
+    std::ifstream file{};
+    uint64 time_us{};
+
+public:
+    uint64 steam_id{}; // of the recording instance
+
+    // false when it isn't a capture or the version isn't supported
+    bool open(const std::string &path);
+    // false at the end of the file or on a truncated record
+    bool next(struct Capture_Record &record);
+};
+
+#endif // CAPTURE_INCLUDE_H
@@ -57,19 +57,24 @@
 #include <string_view>
 #include <chrono>
 #include <cctype>
+#include <cmath>
 #include <iomanip>
 #include <fstream>
 #include <sstream>
 #include <iterator>
+#include <memory>
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <queue>
+#include <deque>
 #include <list>
 
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 
 #include <string.h>
@@ -143,6 +148,11 @@ static inline void reset_LastError()
     #include <sys/stat.h>
     #include <sys/statvfs.h>
     #include <sys/time.h>
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <linux/futex.h>
 
     #include <netinet/in.h>
     #include <netinet/tcp.h>
@@ -154,6 +164,7 @@ static inline void reset_LastError()
     #include <netdb.h>
     #include <dlfcn.h>
     #include <utime.h>
+    #include <signal.h>
 
     #include "crash_printer/linux.hpp"
 
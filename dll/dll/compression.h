@@ -0,0 +1,35 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef COMPRESSION_INCLUDE_H
+#define COMPRESSION_INCLUDE_H
+
+#include "common_includes.h"
+
+// fast LZ compression of network messages, the output is a LZ4 block (no frame, no checksum)
+// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+
+// worst case size of the output of lz_compress()
+size_t lz_compress_bound(size_t size);
+
+// returns the compressed size, 0 if 'capacity' is smaller than lz_compress_bound(size)
+size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity);
+
+// fails on malformed input or when it doesn't decompress to exactly 'size' bytes
+bool lz_decompress(const char *src, size_t src_size, char *dst, size_t size);
+
+#endif // COMPRESSION_INCLUDE_H
@@ -0,0 +1,84 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef IMPAIRMENT_INCLUDE_H
+#define IMPAIRMENT_INCLUDE_H
+
+// included by settings.h and network.h, keep it free of the emulator headers
+#include <chrono>
+#include "steam/steamtypes.h"
+
+// fake bad network conditions, like the k_ESteamNetworkingConfig_FakePacket* and FakeRateLimit*
+// options of the real steam networking
+// every packet draws the same amount of random numbers from a seeded generator, so the same seed
+// and the same packets in the same order get the same losses, delays and duplicates
+// only the rate limit depends on the time the packets are sent
+
+struct Impairment_Direction {
+    float loss_pct{}; // 0-100, packets discarded
+    int32 lag_ms{}; // added to every packet
+    int32 jitter_ms{}; // random extra delay between 0 and this, later packets can overtake earlier ones
+    float reorder_pct{}; // 0-100, packets delayed by Impairment_Config::reorder_time_ms more than the others
+    float dup_pct{}; // 0-100, packets delivered a second time
+    int32 rate{}; // token bucket, bytes/sec, 0 = unlimited
+    int32 burst = 16 * 1024; // bytes the bucket can hold
+
+    bool active() const;
+};
+
+struct Impairment_Config {
+    Impairment_Direction send{}, recv{};
+    int32 reorder_time_ms = 15;
+    int32 dup_time_max_ms = 10; // the duplicates are delayed by a random time up to this
+
+    bool active() const;
+};
+
+struct Impairment_Verdict {
+    bool drop = false;
+    uint32 delay_ms{};
+    bool duplicate = false;
+    uint32 duplicate_delay_ms{};
+};
+
+// one direction of the traffic, the packets must go through impair() in the order they're sent/received
+class Impairment_Stage {
+    uint64 rng_state{};
+    double tokens{};
+    std::chrono::high_resolution_clock::time_point last_refill{};
+
+    uint64 next_random();
+    // uniform in [0, 1)
+    double next_unit();
+
+public:
+    void seed(uint64 seed);
+
+    // 'reliable' packets (TCP) are only delayed: no loss, duplicates or reordering
+    Impairment_Verdict impair(const Impairment_Direction &dir, const Impairment_Config &config, size_t size, bool reliable, std::chrono::high_resolution_clock::time_point now);
+};
+
+// a config with the state of both directions
+struct Impairment {
+    Impairment_Config config{};
+    Impairment_Stage send{}, recv{};
+
+    // 'peer_id' is 0 for the datagrams of unknown peers, every peer gets its own sequence of random numbers, with its own config or the global one
+    void seed(uint64 seed, uint64 peer_id);
+};
+
+#endif // IMPAIRMENT_INCLUDE_H
@@ -19,6 +19,10 @@
 #define NETWORK_INCLUDE
 
 #include "base.h"
+#include "shm_transport.h"
+#include "impairment.h"
+#include "capture.h"
+#include "timer_wheel.h"
 #include <curl/curl.h>
 
 #define DEFAULT_PORT 47584
@@ -71,15 +75,352 @@ enum Callback_Ids {
 };
 
 struct Network_Callback_Container {
-    std::vector<struct Network_Callback> callbacks{};
+    std::vector<struct Network_Callback> callbacks{}; // all of them, for the broadcasted messages
+    std::vector<struct Network_Callback> broadcast{}; // the ones registered with steam id 0
+    // destination steam id -> its callbacks and the broadcast ones, in registration order
+    std::unordered_map<uint64, std::vector<struct Network_Callback>> by_dest{};
+};
+
+// lock-free multi-producer/single-consumer queue (Vyukov's non-intrusive design)
+// producers never block each other, the single consumer never blocks producers
+template<typename T>
+class MPSC_Queue {
+    struct Node {
+        std::atomic<Node *> next{nullptr};
+        T value{};
+    };
+
+    std::atomic<Node *> head; // producers
+    Node *tail; // consumer, always points at the current stub node
+
+public:
+    MPSC_Queue()
+    {
+        tail = new Node();
+        head.store(tail, std::memory_order_relaxed);
+    }
+
+    ~MPSC_Queue()
+    {
+        T ignored{};
+        while (pop(ignored)) { }
+        delete tail;
+    }
+
+    MPSC_Queue(const MPSC_Queue &) = delete;
+    MPSC_Queue& operator=(const MPSC_Queue &) = delete;
+
+    void push(T &&value)
+    {
+        Node *node = new Node();
+        node->value = std::move(value);
+        Node *prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // consumer side only
+    bool pop(T &out)
+    {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (!next) return false;
+
+        out = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+};
+
+// message received by the I/O thread, waiting to be dispatched by Networking::Run()
+struct Received_Message {
+    Common_Message msg{};
+    bool user_status = false; // CALLBACK_ID_USER_STATUS connect/disconnect notification
+};
+
+// counters used to tune the networking, read them with Networking::getCounters()
+struct Network_Counters {
+    // bucket i counts the recvmmsg()/sendmmsg() calls which handled [2^i, 2^(i+1)) datagrams
+    constexpr const static unsigned BATCH_BUCKETS = 8;
+
+    uint64 udp_recv_calls{};
+    uint64 udp_recv_datagrams{};
+    uint64 udp_recv_batch_sizes[BATCH_BUCKETS]{};
+
+    uint64 udp_send_calls{};
+    uint64 udp_send_datagrams{};
+    uint64 udp_send_batch_sizes[BATCH_BUCKETS]{};
+
+    uint64 fragmented_messages_sent{};
+    uint64 fragments_sent{};
+    uint64 fragments_received{};
+    uint64 fragmented_messages_received{};
+    uint64 fragments_dropped{}; // invalid, duplicated or from an unknown peer
+    uint64 fragmented_messages_incomplete{}; // timed out or evicted before all the fragments arrived
+
+    uint64 reliable_sent{};
+    uint64 reliable_retransmits{}; // after a timeout
+    uint64 reliable_fast_retransmits{}; // after later messages were acknowledged
+    uint64 reliable_duplicates{};
+    uint64 reliable_fallbacks{}; // peers which went back to TCP after too many retransmits
+    uint64 acks_sent{};
+
+    uint64 coalesced_batches_sent{};
+    uint64 coalesced_messages_sent{};
+    uint64 coalesced_batches_received{};
+
+    uint64 compressed_messages{};
+    uint64 uncompressible_messages{}; // big enough but didn't shrink, sent as is
+    uint64 decompressed_messages{};
+    uint64 decompression_errors{};
+
+    uint64 announce_broadcasts{};
+    uint64 pongs_sent{};
+    uint64 pongs_without_peers{}; // gossip: the requester already knew the same peers
+    uint64 gossip_peers_sent{};
+
+    uint64 shm_messages_sent{};
+    uint64 shm_messages_received{};
+    uint64 shm_ring_full{}; // unreliable messages sent over the sockets instead, reliable ones wait
+
+    // network impairment, in packets
+    uint64 impaired_dropped{};
+    uint64 impaired_delayed{};
+    uint64 impaired_duplicated{};
+
+    // parse arena of the received messages
+    uint64 parse_arena_resets{};
+    uint64 parse_arena_overflows{}; // resets which freed blocks allocated from the heap, 0 in the steady state
+    uint64 parse_arena_peak{}; // most bytes used before a reset
+
+    // compact data packets
+    uint64 compact_sent{};
+    uint64 compact_received{};
+    uint64 compact_dropped{}; // unknown version, connection or steam id, truncated
+
+    uint64 timers_expired{}; // including the ones left behind by a reschedule
+    uint64 connections_visited{}; // by run_io() for their socket events, the others are only reached by their timers
+
+    // indexed by Common_Message::messages_case(), must stay above the highest oneof field number
+    constexpr const static unsigned MESSAGE_TYPES = 32;
+    uint64 messages_sent[MESSAGE_TYPES]{}; // once per sendTo*() call, not per peer
+    uint64 messages_received[MESSAGE_TYPES]{};
+    // size before/after compression, once per compressed message even when sent to many peers
+    uint64 compression_bytes_in[MESSAGE_TYPES]{};
+    uint64 compression_bytes_out[MESSAGE_TYPES]{};
+};
+
+// transport statistics of a peer, every message exchanged with it counts as a packet
+struct Connection_Stats {
+    // measured with timestamped UDP heartbeats, in milliseconds
+    bool rtt_sampled = false;
+    double rtt_ms{}; // smoothed
+    double last_rtt_ms{};
+    double jitter_ms{}; // mean deviation between consecutive samples (RFC 3550)
+
+    uint64 packets_sent{};
+    uint64 bytes_sent{};
+    uint64 packets_received{};
+    uint64 bytes_received{};
+    // indexed by Common_Message::messages_case()
+    uint64 packets_sent_by_type[Network_Counters::MESSAGE_TYPES]{};
+    uint64 bytes_sent_by_type[Network_Counters::MESSAGE_TYPES]{};
+    uint64 packets_received_by_type[Network_Counters::MESSAGE_TYPES]{};
+    uint64 bytes_received_by_type[Network_Counters::MESSAGE_TYPES]{};
+
+    // over the last rates interval
+    double out_packets_per_sec{};
+    double out_bytes_per_sec{};
+    double in_packets_per_sec{};
+    double in_bytes_per_sec{};
+
+    uint32 reliable_unacked_bytes{}; // sent over reliable UDP and not acknowledged yet
+
+    void sent(int type, size_t size);
+    void received(int type, size_t size);
+    void rtt_sample(double rtt_ms);
+    void update_rates(double elapsed);
+
+private:
+    // totals at the last update_rates()
+    uint64 rates_packets_sent{};
+    uint64 rates_bytes_sent{};
+    uint64 rates_packets_received{};
+    uint64 rates_bytes_received{};
+};
+
+// a message serialized once without its dest_id, shared by all the sends of a fan-out,
+// every destination prepends its own encoded dest_id field (see encode_dest_id())
+typedef std::shared_ptr<const std::string> Wire_Buffer;
+
+// datagrams waiting to be sent with as few syscalls as possible (sendmmsg() on Linux)
+struct UDP_Send_Batch {
+    struct Entry {
+        IP_PORT ip_port{};
+        size_t offset{};
+        size_t size{};
+        Wire_Buffer body{}; // optional, sent right after the bytes in 'data'
+    };
+
+    std::vector<char> data{};
+    std::vector<struct Entry> entries{};
+
+    void add(IP_PORT ip_port, const char *buf, size_t size);
+    void add(IP_PORT ip_port, const char *header, size_t header_size, const Wire_Buffer &body);
+    // send the same payload as the last added datagram to another destination
+    void add_again(IP_PORT ip_port);
+    bool empty() const;
+    void clear();
+};
+
+// broadcast addresses of the local interfaces, per Networking since each one can run on its own I/O thread
+struct Broadcast_Interfaces {
+    constexpr const static int MAX = 16;
+
+    int count = -1; // not looked up yet
+    IP_PORT broadcasts[MAX]{};
+    uint32_t lower_range_ips[MAX]{};
+    uint32_t upper_range_ips[MAX]{};
+    std::chrono::high_resolution_clock::time_point last_lookup{};
+};
+
+#if defined(__linux__)
+// preallocated scatter array for recvmmsg()
+struct UDP_Recv_Batch {
+    constexpr const static unsigned SIZE = 32;
+
+    std::vector<char> buffers{};
+    struct mmsghdr msgs[SIZE]{};
+    struct iovec iovs[SIZE]{};
+    struct sockaddr_in addrs[SIZE]{};
+};
+#endif
+
+// outgoing TCP stream, frames are appended to chunks which are dropped once sent
+// so consuming never moves the rest of the queue, see send_tcp_pending()
+// the last drained chunk is kept to be reused, an idle socket doesn't allocate for each message
+struct TCP_Send_Queue {
+    constexpr const static size_t CHUNK_SIZE = 64 * 1024;
+
+    struct Chunk {
+        std::vector<char> data{}; // frames are appended here
+        Wire_Buffer shared{}; // or a reference to a shared message body, nothing can be appended after it
+
+        const char *bytes() const;
+        size_t size() const;
+    };
+
+    std::deque<struct Chunk> chunks{};
+    std::vector<char> spare{}; // empty, at most CHUNK_SIZE of capacity
+    size_t offset{}; // already sent bytes of the front chunk
+    size_t pending{}; // unsent bytes in all chunks
+
+    // returns 'size' contiguous bytes at the end of the queue to write a frame into
+    char *append(size_t size);
+    void append(const Wire_Buffer &body);
+    void consume(size_t size);
+    bool empty() const;
+};
+
+// incoming TCP stream, parsed frames are consumed by moving the read offset
+// and the consumed space is only reclaimed once it's at least half of the buffer
+struct TCP_Recv_Buffer {
+    std::vector<char> data{};
+    size_t offset{};
+
+    // unread bytes
+    const char *begin() const;
+    size_t size() const;
+
+    // reserve 'size' bytes at the end, then commit() how many were actually written
+    char *prepare(size_t size);
+    void commit(size_t prepared, size_t written);
+    void consume(size_t size);
 };
 
 struct TCP_Socket {
     sock_t sock = static_cast<sock_t>(~0);
     bool received_data = false;
-    std::vector<char> recv_buffer{};
-    std::vector<char> send_buffer{};
+    struct TCP_Recv_Buffer recv_buffer{};
+    struct TCP_Send_Queue send_buffer{};
     std::chrono::high_resolution_clock::time_point last_heartbeat_sent{}, last_heartbeat_received{};
+    // what the socket is registered with in epoll, see Networking::poll_writable()
+    bool poll_out = false;
+    uint64 poll_owner{}; // Connection::serial, 0 = not owned by a connection yet
+};
+
+// datagram held back by the network impairment
+struct Delayed_Datagram {
+    std::chrono::high_resolution_clock::time_point due{};
+    uint64 order{}; // same due time, first impaired first out
+    IP_PORT ip_port{};
+    std::string data{};
+
+    bool operator >(const Delayed_Datagram &other) const
+    {
+        return due > other.due || (due == other.due && order > other.order);
+    }
+};
+
+typedef std::priority_queue<struct Delayed_Datagram, std::vector<struct Delayed_Datagram>, std::greater<struct Delayed_Datagram>> Delayed_Datagrams;
+
+// message received or sent over TCP and held back by the network impairment, each direction is handled in order
+struct Delayed_TCP_Message {
+    std::chrono::high_resolution_clock::time_point due{};
+    Common_Message msg{};
+    bool incoming = false; // from tcp_socket_incoming
+    std::string serialized{}; // a sent message, without its length
+};
+
+// unreliable message being reassembled from its fragments
+struct Fragmented_Message {
+    std::vector<std::string> parts{};
+    uint32 received{};
+    size_t reserved{}; // counted against the peer's reassembly budget
+    std::chrono::high_resolution_clock::time_point first_received{};
+};
+
+struct Reliable_Packet {
+    uint32 seq{};
+    std::string serialized{};
+    std::chrono::high_resolution_clock::time_point sent{};
+    uint32 transmissions{};
+    uint32 missing_reports{}; // acks which acknowledged later packets but not this one
+};
+
+// sending side of a reliable UDP channel, one per Common_Message oneof case
+struct Reliable_Send_Channel {
+    uint32 next_seq = 1;
+    std::map<uint32, struct Reliable_Packet> unacked{};
+    std::deque<struct Reliable_Packet> waiting{}; // not sent yet, congestion window full
+};
+
+// receiving side of a reliable UDP channel
+struct Reliable_Recv_Channel {
+    uint32 next_seq = 1;
+    std::map<uint32, Common_Message> out_of_order{};
+    bool ack_pending = false;
+};
+
+// reliable UDP state of a connection, see Networking::send_reliable()
+struct Reliable_UDP {
+    std::map<int, struct Reliable_Send_Channel> send{}; // by Common_Message::MessagesCase
+    std::map<int, struct Reliable_Recv_Channel> recv{};
+    bool ack_pending = false;
+    bool failed = false; // too many retransmits, everything goes through TCP until the peer answers a PING over UDP
+
+    // retransmission timer (RFC 6298), in seconds
+    bool rtt_sampled = false;
+    double srtt{};
+    double rttvar{};
+    double rto = 1.0;
+
+    // AIMD congestion window and pacing, in packets
+    double cwnd = 4.0;
+    double ssthresh = 64.0;
+    uint32 in_flight{};
+    double pacing_tokens = 4.0;
+    std::chrono::high_resolution_clock::time_point last_pacing{};
+    std::chrono::high_resolution_clock::time_point recovery_end{}; // the window is only halved once per round trip
 };
 
 struct Connection {
@@ -91,6 +432,43 @@ struct Connection {
     std::vector<CSteamID> ids{};
     uint32 appid{};
     std::chrono::high_resolution_clock::time_point last_received{};
+    uint32 capabilities{}; // Announce::Capabilities bitmask advertised by the peer
+    std::map<uint32, struct Fragmented_Message> fragments{}; // by message id
+    size_t fragments_reserved{};
+    struct Reliable_UDP reliable_udp{};
+    // small unreliable messages waiting to be sent in a single datagram
+    Batch coalesced{};
+    size_t coalesced_size{};
+    std::chrono::high_resolution_clock::time_point coalesced_since{};
+    uint64 serial{}; // creation order, lookups return the oldest match like a scan of all the connections would
+    struct Connection_Stats stats{};
+    std::chrono::high_resolution_clock::time_point last_ping_sent{}, rates_updated{};
+    std::chrono::high_resolution_clock::time_point stats_wanted{}; // last getConnectionStats(), see run_stats()
+    // gossip: when the peer was reached over UDP and the newest peer already listed to it, see gossip_generation
+    uint64 gossip_generation{};
+    uint64 gossip_generation_sent{};
+    // same host peer, 0 = not on this host or not supported
+    uint64 shm_id{};
+    struct Shm_Ring shm_in{}, shm_out{};
+    struct Shm_Doorbell shm_out_doorbell{};
+    std::deque<std::string> shm_pending{}; // reliable messages waiting for shm_out, in order
+    size_t shm_pending_offset{}; // bytes of the front one already in the ring, when it's split in chunks
+    bool shm_off_ring = true; // reliable messages went through the sockets since the last barrier
+    uint64 shm_barrier_sent{};
+    // the last barrier received over TCP, and the one read from shm_in which the ring waits for
+    uint64 shm_barrier_received{}, shm_barrier_wait{};
+    std::chrono::high_resolution_clock::time_point shm_barrier_since{};
+    std::string shm_partial{}; // chunks of a big message read from shm_in
+    std::deque<struct Delayed_TCP_Message> tcp_delayed{}, tcp_delayed_sends{};
+    // compact data packets: Announce.compact_id of the peer (0 = not supported), its Announce.ids
+    // in order, the compact headers index them
+    uint32 peer_compact_id{};
+    std::vector<uint64> peer_ids{};
+    // TCP heartbeats and USER_TIMEOUT, only moved earlier, it schedules the next deadline when it expires
+    struct Scheduled_Timer timer{};
+    // the same for the fragments reassembly timeouts, the reliable UDP retransmissions and pacing,
+    // the RTT pings and rates, the coalesced batch, the retries to open shm_out and both tcp_delayed
+    struct Scheduled_Timer fragments_timer{}, reliable_timer{}, stats_timer{}, coalesce_timer{}, shm_timer{}, delayed_tcp_timer{};
 };
 
 class Networking
@@ -101,19 +479,204 @@ class Networking
     sock_t query_socket, udp_socket{}, tcp_socket{};
     uint16 udp_port{}, tcp_port{};
     uint32 own_ip{};
-    std::vector<struct Connection> connections{};
+    // a list so the indexes below can point to its elements, kept in sync by new_connection(),
+    // add_id_connection(), remove_id_connection(), set_connection_ip() and remove_connection()
+    std::list<struct Connection> connections{};
+    std::unordered_map<uint64, std::vector<struct Connection *>> connections_by_id{};
+    std::unordered_map<uint32, std::vector<struct Connection *>> connections_by_ip{}; // by tcp_ip_port.ip
+    // the timers and epoll events of the connections point to them with their serial, an iterator to remove them too
+    std::unordered_map<uint64, std::list<struct Connection>::iterator> connections_by_serial{};
+    uint64 next_connection_serial = 1;
 
     std::vector<CSteamID> ids;
     uint32 appid;
     std::chrono::high_resolution_clock::time_point last_broadcast;
     std::vector<IP_PORT> custom_broadcasts;
+    struct Broadcast_Interfaces broadcast_interfaces{};
 
     std::vector<struct TCP_Socket> accepted;
     std::recursive_mutex mutex;
 
     struct Network_Callback_Container callbacks[CALLBACK_IDS_MAX];
+    // run_callbacks() calls a copy of the targets since a callback can add or remove callbacks, one
+    // per nesting level and kept for the next messages, and skips the ones removed meanwhile
+    std::deque<std::vector<struct Network_Callback>> dispatching{};
+    size_t dispatch_depth{};
+    std::vector<struct Network_Callback> removed_while_dispatching{};
     std::vector<Common_Message> local_send;
 
+#if defined(__linux__)
+    // epoll backend: every socket is registered once when it's created,
+    // and Run() only does syscalls on the ones reported as readable or writable
+    int epoll_fd = -1;
+    std::vector<sock_t> readable_socks{}, writable_socks{}; // sorted
+#endif
+    // serials of the connections run_io() visits: the owners of the sockets with events, the ones
+    // which asked for it (new, lost a socket), or all of them without a poller
+    std::vector<uint64> ready_connections{}, connections_to_visit{}, visiting{};
+
+    // optional dedicated I/O thread, when active it owns all the sockets and Run() only
+    // dispatches what it received, everything touching the sockets must lock 'mutex'
+    std::thread io_thread{};
+    std::atomic_bool io_thread_active = false;
+    std::atomic_bool io_thread_kill = false;
+    MPSC_Queue<struct Received_Message> received{};
+#if defined(__linux__)
+    int wake_fd = -1; // eventfd used to wake up the I/O thread
+#endif
+
+    struct Network_Counters counters{};
+    std::chrono::high_resolution_clock::time_point last_counters_dump{};
+    struct UDP_Send_Batch udp_batch{};
+#if defined(__linux__)
+    struct UDP_Recv_Batch udp_recv_batch{};
+#endif
+
+    void poll_add(sock_t sock);
+    // watches the socket of the connection for writability while its send queue isn't empty, call it
+    // after queuing or sending on a TCP socket, a connecting socket always has its first message queued
+    void poll_writable(Connection &conn, struct TCP_Socket &socket);
+    void poll_sockets(int timeout_ms = 0);
+    bool is_readable(sock_t sock) const;
+    bool is_writable(sock_t sock) const;
+
+    void io_thread_run();
+    void run_io();
+    void visit_connection(Connection &conn);
+    void check_connected(Connection &conn);
+    void run_source_query();
+    void deliver_message(Common_Message *msg);
+
+    // heartbeats, timeouts and broadcasts, a run only looks at the timers which expired
+    Timer_Wheel timers{};
+    std::vector<struct Timer_Wheel_Entry> expired_timers{};
+    struct Scheduled_Timer broadcast_timer{}, legacy_announces_timer{}, accepted_timer{};
+    void schedule_timer(struct Scheduled_Timer &timer, uint64 key, std::chrono::high_resolution_clock::time_point deadline);
+    void schedule_connection_timer(Connection &conn);
+    // moves a timer of the connection earlier, its handler schedules the next deadline when it expires
+    void schedule_connection_timer(Connection &conn, struct Scheduled_Timer &timer, uint64 kind, std::chrono::high_resolution_clock::time_point deadline);
+    void run_timers(double time_extra);
+    int timers_wait_ms(int wait_ms); // the I/O thread wakes up for the next one
+    void run_connection_timer(Connection &conn, uint64 kind, const struct Timer_Wheel_Entry &entry, double time_extra);
+    void connection_timeouts(Connection &conn, double time_extra);
+    void accepted_timeouts(double time_extra);
+
+    void receive_udp();
+    void handle_udp_packet(const char *data, int len, IP_PORT ip_port);
+    void flush_udp_batch();
+    // like sendTo() but UDP datagrams stay in udp_batch until flush_udp_batch()
+    bool queue_send(Common_Message *msg, bool reliable, Connection *conn, bool no_nagle = false);
+    // same for a message serialized once by a fan-out, 'compressed_body' caches its compressed
+    // version for the other peers of the fan-out
+    bool queue_send(const Wire_Buffer &body, int channel, uint64 dest_id, bool reliable, Connection *conn, Wire_Buffer *compressed_body = NULL, bool no_nagle = false);
+    void dump_counters();
+
+    uint32 next_fragment_id{};
+    bool use_fragments(size_t size, const Connection *conn) const;
+    void send_fragmented(const std::string &serialized, Connection *conn);
+    void handle_fragment(Common_Message *msg, IP_PORT ip_port);
+    void expire_fragments(Connection &conn);
+
+    bool reliable_udp_enabled = false;
+    bool use_reliable_udp(const Connection *conn) const;
+    void send_reliable(std::string &&serialized, int channel, Connection *conn);
+    void send_reliable_packet(struct Reliable_Packet &packet, Connection *conn);
+    void send_reliable_tcp(const struct Reliable_Packet &packet, Connection *conn);
+    bool send_tcp(Connection &conn, const std::string &serialized);
+    void send_reliable_waiting(Connection &conn);
+    void run_reliable_udp(Connection &conn);
+    std::vector<uint64> acks_pending{}; // serials of the connections to acknowledge at the end of the run
+    void send_acks();
+    void handle_ack(Common_Message *msg);
+    void handle_reliable(Common_Message *msg);
+    void receive_message(Common_Message *msg, IP_PORT ip_port);
+
+    unsigned coalesce_delay_ms = 0;
+    bool use_coalescing(size_t size, const Connection *conn) const;
+    void coalesce(std::string &&serialized, Connection *conn, bool flush);
+    void flush_coalesced(Connection &conn);
+    void flush_coalesced_timer(Connection &conn);
+    void handle_batch(Common_Message *msg, IP_PORT ip_port);
+
+    // compact data packets, random id of this instance, the peers find the connection of the
+    // packets we send with it
+    uint32 compact_id{};
+    std::unordered_map<uint32, struct Connection *> connections_by_compact_id{};
+    bool encode_compact(Common_Message *msg, const Connection *conn, std::string &out);
+    std::string serialize_unreliable(Common_Message *msg, const Connection *conn);
+    void handle_compact(const char *data, size_t len, IP_PORT ip_port);
+
+    void run_stats(Connection &conn);
+
+    bool gossip_discovery = false;
+    double broadcast_interval{};
+    // incremented every time a peer is reached over UDP, orders the peers for the incremental lists
+    uint64 gossip_generation{};
+    void peers_digest(uint64 &digest, uint32 &count);
+    void add_gossip_peers(Announce *announce, Connection *requester, const Announce &ping);
+    void send_legacy_announces();
+
+    // shared memory transport, 0 when disabled
+    uint64 shm_id{};
+    uint64 host_id{};
+    struct Shm_Doorbell shm_doorbell{};
+    std::thread shm_waiter{};
+    std::atomic_bool shm_waiter_kill = false;
+    std::vector<struct Connection *> shm_connections{}; // the ones with a shm_id, kept in sync by shm_connect() and shm_disconnect()
+    void shm_connect(Connection *conn, uint64 peer_shm_id);
+    void shm_disconnect(Connection &conn);
+    bool shm_send(Connection *conn, const char *prefix, size_t prefix_size, const std::string &data, bool reliable);
+    void shm_flush(Connection &conn);
+    bool shm_push_front(Connection &conn);
+    bool shm_push_barrier(Connection &conn);
+    void handle_shm_barrier(Common_Message *msg);
+    void shm_open_out(Connection &conn);
+    void run_shm(Connection &conn);
+    int shm_wait_ms(int wait_ms);
+    void shm_waiter_run();
+    void count_received(Common_Message *msg, size_t size);
+
+    // fake network conditions, the global one applies to the peers without their own
+    bool impairment_enabled = false; // any of them is active
+    uint64 impairment_seed{};
+    struct Impairment impairment{};
+    std::unordered_map<uint64, struct Impairment> peer_impairments{}; // by steam id
+    std::unordered_map<uint64, struct Impairment> global_impairments{}; // the global one for each peer without its own, by first steam id
+    Delayed_Datagrams delayed_sends{}, delayed_receives{};
+    size_t tcp_delayed_messages{}; // in the tcp_delayed and tcp_delayed_sends of all the connections
+    uint64 next_delayed_order{};
+    void update_impairment_enabled();
+    struct Impairment &impairment_for(IP_PORT ip_port);
+    struct Impairment &impairment_for(const Connection &conn);
+    void delay_datagram(Delayed_Datagrams &queue, std::chrono::high_resolution_clock::time_point due, IP_PORT ip_port, std::string &&data);
+    void impair_udp_batch();
+    void impair_received(const char *data, int len, IP_PORT ip_port);
+    void release_delayed_receives();
+    bool delay_tcp(Connection &conn, Common_Message *msg, bool incoming);
+    // the messages sent over TCP while the impairment is active go through delay_tcp_send(),
+    // which returns false when the connection has no TCP socket to send on
+    bool impaired_tcp_send(const Connection &conn) const;
+    bool delay_tcp_send(Connection &conn, std::string &&serialized);
+    void release_delayed_tcp(Connection &conn);
+    int impairment_wait_ms(int wait_ms);
+
+    // recording of the received and sent messages, see capture.h
+    Capture_Writer capture{};
+    void capture_sent(Common_Message *msg, bool reliable);
+
+    bool use_compression(size_t size, const Connection *conn) const;
+    Wire_Buffer compress_message(const std::string &serialized, int type);
+    bool decompress_message(Common_Message *msg);
+    std::string decompressed{}; // reused, keeps its capacity
+
+    // the received messages are parsed in this arena, they must not be kept once handled (copy or move them)
+    // it's reset after each batch of datagrams, each connection's TCP messages and at the end of run_io()
+    // its first block is reused, so in the steady state parsing doesn't allocate from the heap
+    std::unique_ptr<char[]> parse_arena_block{};
+    std::unique_ptr<google::protobuf::Arena> parse_arena{};
+    Common_Message *parsed_message();
+    void reset_parse_arena();
+
     struct Connection *find_connection(CSteamID id, uint32 appid = 0);
     struct Connection *new_connection(CSteamID id, uint32 appid);
 
@@ -123,11 +686,15 @@ class Networking
     void send_announce_broadcasts();
 
     bool add_id_connection(struct Connection *connection, CSteamID steam_id);
+    void remove_id_connection(struct Connection *connection, std::vector<CSteamID>::iterator id);
+    void set_connection_ip(struct Connection *connection, IP_PORT ip_port);
+    std::list<struct Connection>::iterator remove_connection(std::list<struct Connection>::iterator connection);
     void run_callbacks(Callback_Ids id, Common_Message *msg);
     void run_callback_user(CSteamID steam_id, bool online, uint32 appid);
     void do_callbacks_message(Common_Message *msg);
 
-    Common_Message create_announce(bool request);
+    // a PONG answering 'ping' from 'requester' only lists what it's missing when both use gossip discovery
+    Common_Message create_announce(bool request, Connection *requester = NULL, const Announce *ping = NULL);
 
 
 public:
@@ -142,8 +709,35 @@ public:
     void setAppID(uint32 appid);
     void Run();
 
+    // move all socket I/O to a dedicated thread, Run() will only dispatch the received messages
+    void startIOThread();
+    void stopIOThread();
+
+    // send reliable messages over UDP to the peers which support it, TCP is still used as a fallback
+    void setReliableUDP(bool enable);
+    // hold small unreliable messages up to 'delay_ms' to pack them in a single datagram, 0 = disabled
+    void setCoalesceDelay(unsigned delay_ms);
+    // back off the announce broadcasts while the peers are stable and only exchange the missing peers
+    void setGossipDiscovery(bool enable);
+    // send to the peers running on this host through shared memory instead of the sockets, call before startIOThread()
+    void setSharedMemoryTransport(bool enable);
+
+    // seed of the network impairment, the same seed reproduces the same losses, delays and duplicates
+    void setImpairmentSeed(uint64 seed);
+    // fake network conditions for everyone, or only for the user 'peer_id' when it isn't 0
+    void setImpairment(const struct Impairment_Config &config, uint64 peer_id = 0);
+
+    // record all the received and sent messages to this file, replay it with the benchmark tool
+    bool startCapture(const std::string &path);
+    // deliver a message of a capture as if it was received now, 'user_status' for the CAPTURE_USER_STATUS records
+    void replayMessage(Common_Message *msg, bool user_status);
+
     // send to a specific user, set_dest_id() must be called
-    bool sendTo(Common_Message *msg, bool reliable, Connection *conn = NULL);
+    // no_nagle sends this message and the ones waiting to be coalesced with it right away
+    bool sendTo(Common_Message *msg, bool reliable, Connection *conn = NULL, bool no_nagle = false);
+
+    // send the small messages waiting to be coalesced for this user right away
+    void flushMessages(CSteamID id);
     
     // send to all users whose account type is Individual, no need to call set_dest_id(), this is done automatically
     bool sendToAllIndividuals(Common_Message *msg, bool reliable);
@@ -164,6 +758,10 @@ public:
     uint32 getIP(CSteamID id);
     uint32 getOwnIP();
 
+    struct Network_Counters getCounters();
+    // false when there is no connection to this user
+    bool getConnectionStats(CSteamID id, struct Connection_Stats &stats);
+
     void startQuery(IP_PORT ip_port);
     void shutDownQuery();
     bool isQueryAlive();
@@ -19,6 +19,7 @@
 #define SETTINGS_INCLUDE_H
 
 #include "base.h"
+#include "impairment.h"
 
 struct IP_PORT;
 
@@ -199,6 +200,22 @@ public:
 
     //networking
     bool disable_networking = false;
+    // do all the socket I/O on a dedicated thread instead of inside RunCallbacks()
+    bool network_io_thread = false;
+    // send reliable messages over UDP to the peers which support it instead of TCP
+    bool reliable_udp = false;
+    // how long small unreliable messages may wait to be packed with others in the same datagram, 0 = disabled
+    unsigned udp_coalesce_delay_ms = 0;
+    // broadcast less and less while the peers are stable and only exchange the peers the others don't know yet
+    bool gossip_discovery = false;
+    // talk to the other instances on this host through shared memory instead of the sockets
+    bool shared_memory_transport = false;
+    // fake network conditions, the same seed reproduces the same losses, delays and duplicates
+    uint64 network_impairment_seed{};
+    Impairment_Config network_impairment{};
+    std::map<uint64, Impairment_Config> network_impairment_peers{}; // steam id -> its own conditions
+    // record the received and sent messages to this file, empty = disabled
+    std::string network_capture{};
 
     //gameserver source query
     bool disable_source_query = false;
@@ -263,6 +280,8 @@ public:
     bool disable_sharing_stats_with_gameserver = false;
     // synchronize user stats/achievements with game servers as soon as possible instead of caching them.
     bool immediate_gameserver_stats = false;
+    // time a RunCallbacks() call may spend on the callbacks and call results after the networking, 0 = unlimited
+    unsigned callbacks_time_budget_us = 0;
 
     //overlay
     bool disable_overlay = true;
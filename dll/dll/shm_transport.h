@@ -0,0 +1,77 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef SHM_TRANSPORT_INCLUDE_H
+#define SHM_TRANSPORT_INCLUDE_H
+
+// included by network.h, keep it free of the emulator headers
+#include <string>
+#include "steam/steamtypes.h"
+
+// transport between instances running on the same host (Linux only, everything fails elsewhere)
+// every instance receives from each local peer through a single producer single consumer ring
+// in shared memory created by the receiver, and has a doorbell the peers ring to wake it up
+// when it's waiting for something to read
+
+struct Shm_Ring {
+    struct Shm_Ring_Header *header = nullptr;
+    size_t mapped_size{};
+    std::string owned_name{}; // removed by the creator when it closes the ring
+};
+
+struct Shm_Doorbell {
+    struct Shm_Doorbell_Header *header = nullptr;
+    std::string owned_name{};
+};
+
+// unique id of this instance, 0 if shared memory isn't available
+uint64 shm_new_instance_id();
+// same value for all the instances running on this host
+uint64 shm_host_id();
+// removes the segments left behind by instances which didn't exit cleanly
+void shm_cleanup_stale();
+
+std::string shm_ring_name(uint64 receiver_id, uint64 sender_id);
+std::string shm_doorbell_name(uint64 owner_id);
+
+bool shm_ring_create(struct Shm_Ring &ring, const std::string &name, uint32 capacity);
+// fails until the receiver created the ring
+bool shm_ring_open(struct Shm_Ring &ring, const std::string &name);
+void shm_ring_close(struct Shm_Ring &ring);
+bool shm_ring_is_open(const struct Shm_Ring &ring);
+// sender side, true once the receiver closed the ring, a new one must be opened
+bool shm_ring_closed_by_peer(const struct Shm_Ring &ring);
+// a record is 'prefix' followed by 'data', false when there isn't enough room
+bool shm_ring_push(struct Shm_Ring &ring, const char *prefix, size_t prefix_size, const std::string &data);
+// false when empty
+bool shm_ring_pop(struct Shm_Ring &ring, std::string &data);
+bool shm_ring_empty(const struct Shm_Ring &ring);
+
+bool shm_doorbell_create(struct Shm_Doorbell &bell, const std::string &name);
+bool shm_doorbell_open(struct Shm_Doorbell &bell, const std::string &name);
+void shm_doorbell_close(struct Shm_Doorbell &bell);
+// after writing to the owner's ring, only does a syscall when the owner is waiting
+void shm_doorbell_ring(struct Shm_Doorbell &bell);
+// owner side, the peers only ring while this is set
+void shm_doorbell_set_waiting(struct Shm_Doorbell &bell, bool waiting);
+uint32 shm_doorbell_seq(const struct Shm_Doorbell &bell);
+// owner side, returns when rung (seq changed) or after 'timeout_ms'
+void shm_doorbell_wait(struct Shm_Doorbell &bell, uint32 seq, int timeout_ms);
+// wakes up the owner's waiter even when it isn't waiting, used to stop it
+void shm_doorbell_wake(struct Shm_Doorbell &bell);
+
+#endif // SHM_TRANSPORT_INCLUDE_H
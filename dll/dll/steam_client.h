@@ -149,6 +149,13 @@ public:
     std::atomic<unsigned long long> last_cb_run{};
     std::atomic_bool cb_run_active = false;
 
+    // RunCallbacks() stops after the networking once it's spent, 0 = unlimited
+    std::chrono::high_resolution_clock::duration callbacks_time_budget{};
+    uint64 callbacks_runs{};
+    uint64 callbacks_runs_over_budget{};
+    std::chrono::high_resolution_clock::time_point last_callbacks_counters_dump{};
+    void dump_callbacks_counters();
+
     unsigned steam_pipe_counter = 1;
     std::map<HSteamPipe, enum Steam_Pipe> steam_pipes{};
 
@@ -40,6 +40,15 @@ public ISteamNetworkingUtils
     static void free_steam_message_data(SteamNetworkingMessage_t *pMsg);
     static void delete_steam_message(SteamNetworkingMessage_t *pMsg);
 
+    // measured round trip time to this user in ms
+    int estimate_ping(uint64 id);
+
+    // FakePacket* and FakeRateLimit* config values, given to the networking whenever they change
+    Impairment_Config impairment{};
+    // the field of 'config' holding this config value, NULL when it isn't one of them or has another type
+    static float *impairment_float(Impairment_Config &config, ESteamNetworkingConfigValue eValue);
+    static int32 *impairment_int32(Impairment_Config &config, ESteamNetworkingConfigValue eValue);
+
     static void steam_callback(void *object, Common_Message *msg);
     static void steam_run_every_runcb(void *object);
 
@@ -0,0 +1,82 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef TIMER_WHEEL_INCLUDE_H
+#define TIMER_WHEEL_INCLUDE_H
+
+// included by network.h and callsystem.h, keep it free of the emulator headers
+#include <chrono>
+#include <vector>
+#include "steam/steamtypes.h"
+
+// hierarchical timing wheel (Varghese & Lauck): scheduling is O(1) and advancing only touches
+// the timers which expire, plus one cascade of a higher level slot every 64 ticks of the level below
+// timers are opaque keys and can't be cancelled: the owner keeps the tick returned by schedule()
+// and ignores the expired entries which don't match it anymore (rescheduled or deleted object)
+
+struct Timer_Wheel_Entry {
+    uint64 key{};
+    uint64 tick{}; // deadline
+};
+
+// a timer which can move, the entries it left behind are ignored when they expire
+struct Scheduled_Timer {
+    bool pending = false;
+    uint64 tick{}; // of the valid entry
+};
+
+class Timer_Wheel {
+public:
+    constexpr const static unsigned SLOT_BITS = 6;
+    constexpr const static unsigned SLOTS = 1 << SLOT_BITS;
+    // 1 ms ticks, 2^30 ms (12 days) before the farthest timers go around the top level again
+    constexpr const static unsigned LEVELS = 5;
+
+private:
+    std::chrono::high_resolution_clock::time_point start{};
+    uint64 current{}; // next tick to process, everything before it expired
+    size_t count{};
+    std::vector<struct Timer_Wheel_Entry> slots[LEVELS][SLOTS]{};
+    uint64 occupied[LEVELS]{}; // bit i = slots[level][i] not empty
+    std::vector<struct Timer_Wheel_Entry> cascading{}; // swapped with the slot it empties, the buffers keep their capacity
+
+    void insert(const struct Timer_Wheel_Entry &entry);
+    void cascade();
+
+public:
+    Timer_Wheel();
+
+    // the deadlines before the creation of the wheel are tick 0, the others are rounded up
+    uint64 tick_of(std::chrono::high_resolution_clock::time_point time) const;
+
+    // a tick already passed expires on the next advance(), returns the tick of the timer
+    uint64 schedule(uint64 key, std::chrono::high_resolution_clock::time_point deadline);
+
+    // appends the timers with a tick up to 'now' rounded down to 'expired', so none expires before
+    // its deadline, in deadline order except the ones scheduled already expired, which come with
+    // the timers of the next tick
+    void advance(std::chrono::high_resolution_clock::time_point now, std::vector<struct Timer_Wheel_Entry> &expired);
+
+    // no timer expires before it, it's only exact for the current rotation of the lowest level,
+    // time_point::max() when nothing is scheduled
+    std::chrono::high_resolution_clock::time_point next_deadline() const;
+
+    // scheduled timers, including the ones the owner will ignore
+    size_t size() const;
+};
+
+#endif // TIMER_WHEEL_INCLUDE_H
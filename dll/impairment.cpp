@@ -0,0 +1,112 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "dll/impairment.h"
+#include <algorithm>
+
+// unreliable packets waiting longer than this for the rate limit are dropped, like a full router queue
+#define IMPAIRMENT_MAX_RATE_DELAY_MS 1000.0
+
+static uint64 splitmix64(uint64 value)
+{
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+bool Impairment_Direction::active() const
+{
+    return loss_pct > 0 || lag_ms > 0 || jitter_ms > 0 || reorder_pct > 0 || dup_pct > 0 || rate > 0;
+}
+
+bool Impairment_Config::active() const
+{
+    return send.active() || recv.active();
+}
+
+void Impairment_Stage::seed(uint64 seed)
+{
+    rng_state = seed;
+}
+
+uint64 Impairment_Stage::next_random()
+{
+    rng_state += 0x9E3779B97F4A7C15ULL;
+    return splitmix64(rng_state);
+}
+
+double Impairment_Stage::next_unit()
+{
+    return (double)(next_random() >> 11) * (1.0 / (double)(1ULL << 53));
+}
+
+Impairment_Verdict Impairment_Stage::impair(const Impairment_Direction &dir, const Impairment_Config &config, size_t size, bool reliable, std::chrono::high_resolution_clock::time_point now)
+{
+    // always the same draws, whatever the config, so changing one option doesn't change the others' decisions
+    double loss = next_unit() * 100.0;
+    double jitter = next_unit();
+    double reorder = next_unit() * 100.0;
+    double dup = next_unit() * 100.0;
+    double dup_delay = next_unit();
+
+    Impairment_Verdict verdict{};
+    if (!reliable && loss < dir.loss_pct) {
+        verdict.drop = true;
+        return verdict;
+    }
+
+    double delay_ms = std::max(0, dir.lag_ms) + jitter * std::max(0, dir.jitter_ms);
+    if (!reliable && reorder < dir.reorder_pct) delay_ms += std::max(0, config.reorder_time_ms);
+
+    if (dir.rate > 0) {
+        // tokens go negative while packets are queued, the debt is how long this one waits
+        double burst = (double)std::max(0, dir.burst);
+        if (last_refill.time_since_epoch().count() == 0) {
+            tokens = burst; // starts full
+        } else {
+            double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(now - last_refill).count();
+            tokens = std::min(tokens + std::max(0.0, elapsed) * dir.rate, burst);
+        }
+
+        last_refill = now;
+
+        double rate_delay_ms = tokens < (double)size ? ((double)size - tokens) * 1000.0 / dir.rate : 0;
+        if (!reliable && rate_delay_ms > IMPAIRMENT_MAX_RATE_DELAY_MS) {
+            verdict.drop = true;
+            return verdict;
+        }
+
+        tokens -= (double)size;
+        delay_ms += rate_delay_ms;
+    }
+
+    verdict.delay_ms = (uint32)delay_ms;
+    if (!reliable && dup < dir.dup_pct) {
+        verdict.duplicate = true;
+        verdict.duplicate_delay_ms = verdict.delay_ms + (uint32)(dup_delay * std::max(0, config.dup_time_max_ms));
+    }
+
+    return verdict;
+}
+
+void Impairment::seed(uint64 seed, uint64 peer_id)
+{
+    uint64 base = splitmix64(seed ^ splitmix64(peer_id));
+    send.seed(base);
+    recv.seed(splitmix64(base));
+}
@@ -17,18 +17,104 @@
 
 #include "dll/network.h"
 #include "dll/dll.h"
+#include "dll/compression.h"
 
-#define MAX_BROADCASTS 16
-static int number_broadcasts = -1;
-static IP_PORT broadcasts[MAX_BROADCASTS];
-static uint32_t lower_range_ips[MAX_BROADCASTS];
-static uint32_t upper_range_ips[MAX_BROADCASTS];
+#include <random>
 
 #define BROADCAST_INTERVAL 5.0
 #define HEARTBEAT_TIMEOUT 20.0
 #define USER_TIMEOUT 20.0
 
+// gossip discovery, the broadcast interval doubles up to this while there are peers
+#define GOSSIP_MAX_BROADCAST_INTERVAL 80.0
+// keeps the PONGs under FRAGMENT_MTU, the rest is listed in the next ones
+#define GOSSIP_MAX_PEERS_PER_PONG 32
+
+// shared memory transport, one ring per direction and per pair of instances on the host
+#define SHM_RING_CAPACITY (512 * 1024)
+// bigger messages are rare, the reliable ones are split in chunks of this size and the unreliable
+// ones go through the sockets instead of filling the ring
+#define SHM_MAX_MESSAGE_SIZE (64 * 1024)
+// the records of the ring which aren't datagrams, wire type 7 like the compact packets with versions they never use
+// SHM_CHUNK_MAGIC (1 byte) | 1 if more chunks follow (1) | piece of the message
+#define SHM_CHUNK_MAGIC ((30 << 3) | 7)
+#define SHM_CHUNK_HEADER_SIZE 2
+// SHM_BARRIER_MAGIC (1 byte) | Low_Level.shm_barrier (8, native byte order)
+#define SHM_BARRIER_MAGIC ((31 << 3) | 7)
+#define SHM_OPEN_RETRY_INTERVAL 1.0
+
 #define MAX_UDP_SIZE 16384
+// tag + up to 10 bytes of varint
+#define DEST_ID_HEADER_MAX_SIZE 11
+
+// unreliable messages bigger than this are split in fragments when the peer supports it,
+// small enough to never be fragmented by IP even with tunnel/VPN headers
+#define FRAGMENT_MTU 1200
+// room left for the Common_Message and Fragment fields around the data
+#define FRAGMENT_DATA_SIZE (FRAGMENT_MTU - 64)
+#define MAX_FRAGMENTED_SIZE (1024 * 1024)
+// reassembly limits per peer, the oldest incomplete message is evicted to make room
+#define MAX_PENDING_FRAGMENTED 16
+#define MAX_FRAGMENTS_RESERVED (4 * 1024 * 1024)
+#define FRAGMENTS_TIMEOUT 5.0
+
+// reliable UDP
+#define RELIABLE_MIN_RTO 0.2
+#define RELIABLE_MAX_RTO 60.0
+#define RELIABLE_INITIAL_CWND 4.0
+#define RELIABLE_MAX_TRANSMISSIONS 8 // then the peer goes back to TCP
+#define RELIABLE_FAST_RETRANSMIT_REPORTS 3
+// out of order messages the receiver keeps per channel, also caps the congestion window
+#define RELIABLE_RECV_WINDOW 1024
+#define RELIABLE_MAX_SACK_RANGES 16
+
+// coalescing, batches are kept under FRAGMENT_MTU
+#define BATCH_OVERHEAD 16 // source_id + Batch field header
+#define BATCH_ENTRY_OVERHEAD 3 // tag + length of each message
+
+// round trip time measurement and per peer rates, a peer is only pinged while its stats are read
+#define PING_INTERVAL 1.0
+#define STATS_WANTED_TIMEOUT 10.0
+#define RATES_INTERVAL 1.0
+
+// compression, smaller messages aren't worth it
+#define COMPRESSION_MIN_SIZE 256
+#define MAX_DECOMPRESSED_SIZE (64 * 1024 * 1024)
+// a LZ4 block can't expand more than this
+#define MAX_COMPRESSION_RATIO 255
+
+// first block of the parse arena, kept across resets, a full recvmmsg() batch of small messages fits in it
+#define PARSE_ARENA_BLOCK_SIZE (64 * 1024)
+// the blocks allocated from the heap once the first one is full
+#define PARSE_ARENA_MAX_BLOCK_SIZE (64 * 1024)
+
+// compact data packets, see handle_compact()
+// version in the high bits, protobuf wire type 7 (invalid) in the low ones
+#define COMPACT_VERSION 1
+#define COMPACT_MAGIC ((COMPACT_VERSION << 3) | 7)
+#define COMPACT_HEADER_SIZE 8
+#define COMPACT_MAX_HEADER_SIZE (COMPACT_HEADER_SIZE + 16)
+
+// keys of Networking::timers: the kind in the low bits, the Connection::serial above for the timers of a connection
+enum Network_Timer {
+    TIMER_CONNECTION = 0, // TCP heartbeats and USER_TIMEOUT of a connection
+    TIMER_ACCEPTED = 1, // HEARTBEAT_TIMEOUT of the accepted sockets which didn't identify yet
+    TIMER_BROADCAST = 2,
+    TIMER_LEGACY_ANNOUNCES = 3,
+    TIMER_FRAGMENTS = 4, // FRAGMENTS_TIMEOUT of the oldest incomplete message of a connection
+    TIMER_RELIABLE = 5, // retransmission timeout or pacing of the reliable UDP packets of a connection
+    TIMER_STATS = 6, // RTT ping and rates of a connection
+    TIMER_COALESCE = 7, // the coalesced batch of a connection waited long enough
+    TIMER_SHM = 8, // opening the ring we write to a peer on this host again
+    TIMER_DELAYED_TCP = 9, // TCP messages of a connection held back by the impairment
+};
+#define TIMER_KIND_BITS 8
+#define TIMER_KIND_MASK ((1ULL << TIMER_KIND_BITS) - 1)
+
+static std::chrono::high_resolution_clock::duration timer_duration(double seconds)
+{
+    return std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::duration<double>(seconds));
+}
 
 #if defined(STEAM_WIN32)
 
@@ -71,8 +157,12 @@ inet_pton4(const char *src, uint32_t *dst)
 	return (1);
 }
 
-static void get_broadcast_info(uint16 port)
+static void get_broadcast_info(struct Broadcast_Interfaces &interfaces, uint16 port)
 {
+    int &number_broadcasts = interfaces.count;
+    IP_PORT *broadcasts = interfaces.broadcasts;
+    uint32_t *lower_range_ips = interfaces.lower_range_ips;
+    uint32_t *upper_range_ips = interfaces.upper_range_ips;
     number_broadcasts = 0;
 
     IP_ADAPTER_INFO *pAdapterInfo = (IP_ADAPTER_INFO *)malloc(sizeof(IP_ADAPTER_INFO));
@@ -109,7 +199,7 @@ static void get_broadcast_info(uint16 port)
                     upper_range_ips[number_broadcasts] = broadcast_ip;
                     number_broadcasts++;
 
-                    if (number_broadcasts >= MAX_BROADCASTS) {
+                    if (number_broadcasts >= Broadcast_Interfaces::MAX) {
                         return;
                     }
                 }
@@ -125,12 +215,14 @@ static void get_broadcast_info(uint16 port)
 
 #elif defined(__linux__)
 
-static void get_broadcast_info(uint16 port)
+static void get_broadcast_info(struct Broadcast_Interfaces &interfaces, uint16 port)
 {
     /* Not sure how many platforms this will run on,
      * so it's wrapped in __linux for now.
      * Definitely won't work like this on Windows...
      */
+    int &number_broadcasts = interfaces.count;
+    IP_PORT *broadcasts = interfaces.broadcasts;
     number_broadcasts = 0;
     sock_t sock = 0;
 
@@ -138,8 +230,8 @@ static void get_broadcast_info(uint16 port)
         return;
 
     /* Configure ifconf for the ioctl call. */
-    struct ifreq i_faces[MAX_BROADCASTS];
-    memset(i_faces, 0, sizeof(struct ifreq) * MAX_BROADCASTS);
+    struct ifreq i_faces[Broadcast_Interfaces::MAX];
+    memset(i_faces, 0, sizeof(struct ifreq) * Broadcast_Interfaces::MAX);
 
     struct ifconf ifconf;
     ifconf.ifc_buf = (char *)i_faces;
@@ -168,7 +260,7 @@ static void get_broadcast_info(uint16 port)
 
         struct sockaddr_in *sock4 = (struct sockaddr_in *)&i_faces[i].ifr_broadaddr;
 
-        if (number_broadcasts >= MAX_BROADCASTS) {
+        if (number_broadcasts >= Broadcast_Interfaces::MAX) {
             close(sock);
             return;
         }
@@ -284,6 +376,8 @@ static void reset_last_error()
 #endif
 }
 
+// Linux sends its datagrams in batches with sendmmsg(), see Networking::flush_udp_batch()
+#if !defined(__linux__)
 static int send_packet_to(sock_t sock, IP_PORT ip_port, char *data, unsigned long length)
 {
     PRINT_DEBUG("send: %lu %hhu.%hhu.%hhu.%hhu:%hu", length, ((unsigned char *)&ip_port.ip)[0], ((unsigned char *)&ip_port.ip)[1], ((unsigned char *)&ip_port.ip)[2], ((unsigned char *)&ip_port.ip)[3], htons(ip_port.port));
@@ -298,6 +392,40 @@ static int send_packet_to(sock_t sock, IP_PORT ip_port, char *data, unsigned lon
     return sendto(sock, data, length, 0, (struct sockaddr *)&addr, addrsize);
 }
 
+// send a datagram made of a header followed by a body without joining them first
+static int send_packet_parts_to(sock_t sock, IP_PORT ip_port, const char *header, unsigned long header_length, const char *body, unsigned long body_length)
+{
+    PRINT_DEBUG("send: %lu %hhu.%hhu.%hhu.%hhu:%hu", header_length + body_length, ((unsigned char *)&ip_port.ip)[0], ((unsigned char *)&ip_port.ip)[1], ((unsigned char *)&ip_port.ip)[2], ((unsigned char *)&ip_port.ip)[3], htons(ip_port.port));
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip_port.ip;
+    addr.sin_port = ip_port.port;
+
+#if defined(STEAM_WIN32)
+    WSABUF buffers[2];
+    buffers[0].buf = (CHAR *)header;
+    buffers[0].len = (ULONG)header_length;
+    buffers[1].buf = (CHAR *)body;
+    buffers[1].len = (ULONG)body_length;
+    DWORD sent = 0;
+    if (WSASendTo(sock, buffers, 2, &sent, 0, (struct sockaddr *)&addr, sizeof(addr), NULL, NULL) != 0) return -1;
+    return (int)sent;
+#else
+    struct iovec buffers[2];
+    buffers[0].iov_base = (void *)header;
+    buffers[0].iov_len = header_length;
+    buffers[1].iov_base = (void *)body;
+    buffers[1].iov_len = body_length;
+    struct msghdr hdr{};
+    hdr.msg_name = &addr;
+    hdr.msg_namelen = sizeof(addr);
+    hdr.msg_iov = buffers;
+    hdr.msg_iovlen = 2;
+    return sendmsg(sock, &hdr, MSG_NOSIGNAL);
+#endif
+}
+#endif
+
 static int receive_packet(sock_t sock, IP_PORT *ip_port, char *data, unsigned long max_length)
 {
     struct sockaddr_storage addr{};
@@ -318,33 +446,32 @@ static int receive_packet(sock_t sock, IP_PORT *ip_port, char *data, unsigned lo
     return -1;
 }
 
-static bool send_broadcasts(sock_t sock, uint16 port, char *data, unsigned long length, std::vector<IP_PORT> *custom_broadcasts)
+static bool send_broadcasts(struct Broadcast_Interfaces &interfaces, struct UDP_Send_Batch &batch, uint16 port, const char *data, unsigned long length, std::vector<IP_PORT> *custom_broadcasts)
 {
-    static std::chrono::high_resolution_clock::time_point last_get_broadcast_info;
-    if (number_broadcasts < 0 || check_timedout(last_get_broadcast_info, 60.0)) {
+    int &number_broadcasts = interfaces.count;
+    if (number_broadcasts < 0 || check_timedout(interfaces.last_lookup, 60.0)) {
         PRINT_DEBUG("get_broadcast_info");
-        get_broadcast_info(port);
-        std::vector<uint32_t> lower_range(lower_range_ips, lower_range_ips + number_broadcasts), upper_range(upper_range_ips, upper_range_ips + number_broadcasts);
+        get_broadcast_info(interfaces, port);
+        std::vector<uint32_t> lower_range(interfaces.lower_range_ips, interfaces.lower_range_ips + number_broadcasts), upper_range(interfaces.upper_range_ips, interfaces.upper_range_ips + number_broadcasts);
         for(auto &addr : *custom_broadcasts) {
             lower_range.push_back(addr.ip);
             upper_range.push_back(addr.ip);
         }
 
         set_whitelist_ips(lower_range.data(), upper_range.data(), lower_range.size());
-        last_get_broadcast_info = std::chrono::high_resolution_clock::now();
+        interfaces.last_lookup = std::chrono::high_resolution_clock::now();
     }
 
     IP_PORT main_broadcast;
     main_broadcast.ip = INADDR_BROADCAST;
     main_broadcast.port = port;
-    int ret = send_packet_to(sock, main_broadcast, data, length);
+    batch.add(main_broadcast, data, length);
 
     if (!number_broadcasts)
         return false;
 
     for (int i = 0; i < number_broadcasts; i++) {
-        ret = send_packet_to(sock, broadcasts[i], data, length);
-        IP_PORT ip_port = broadcasts[i];
+        batch.add_again(interfaces.broadcasts[i]);
     }
 
     /** 
@@ -355,13 +482,59 @@ static bool send_broadcasts(sock_t sock, uint16 port, char *data, unsigned long
      */
     PRINT_DEBUG("start custom broadcasts");
     for(auto &addr : *custom_broadcasts) {
-        send_packet_to(sock, addr, data, length);
+        batch.add_again(addr);
     }
     PRINT_DEBUG("end custom broadcasts");
 
     return true;
 }
 
+void UDP_Send_Batch::add(IP_PORT ip_port, const char *buf, size_t size)
+{
+    struct Entry entry{};
+    entry.ip_port = ip_port;
+    entry.offset = data.size();
+    entry.size = size;
+    data.insert(data.end(), buf, buf + size);
+    entries.push_back(entry);
+}
+
+void UDP_Send_Batch::add(IP_PORT ip_port, const char *header, size_t header_size, const Wire_Buffer &body)
+{
+    add(ip_port, header, header_size);
+    entries.back().body = body;
+}
+
+void UDP_Send_Batch::add_again(IP_PORT ip_port)
+{
+    if (entries.empty()) return;
+
+    struct Entry entry = entries.back();
+    entry.ip_port = ip_port;
+    entries.push_back(entry);
+}
+
+bool UDP_Send_Batch::empty() const
+{
+    return entries.empty();
+}
+
+void UDP_Send_Batch::clear()
+{
+    data.clear();
+    entries.clear();
+}
+
+static void count_batch(uint64 (&buckets)[Network_Counters::BATCH_BUCKETS], unsigned int datagrams)
+{
+    unsigned int bucket = 0;
+    while ((datagrams >>= 1) && bucket < Network_Counters::BATCH_BUCKETS - 1) {
+        ++bucket;
+    }
+
+    ++buckets[bucket];
+}
+
 static void buffers_set(sock_t sock)
 {
     int n = 1024 * 1024;
@@ -417,23 +590,231 @@ unsigned int receive_buffer_amount(sock_t sock)
 }
 
 
+const char *TCP_Send_Queue::Chunk::bytes() const
+{
+    return shared ? shared->data() : data.data();
+}
+
+size_t TCP_Send_Queue::Chunk::size() const
+{
+    return shared ? shared->size() : data.size();
+}
+
+char *TCP_Send_Queue::append(size_t size)
+{
+    // new chunks reserve their full capacity upfront, appending never reallocates
+    if (chunks.empty() || chunks.back().shared || (chunks.back().data.capacity() - chunks.back().data.size()) < size) {
+        chunks.emplace_back();
+        if (size <= spare.capacity()) {
+            chunks.back().data.swap(spare);
+        } else {
+            chunks.back().data.reserve(std::max(CHUNK_SIZE, size));
+        }
+    }
+
+    auto &chunk = chunks.back().data;
+    size_t old_size = chunk.size();
+    chunk.resize(old_size + size);
+    pending += size;
+    return &chunk[old_size];
+}
+
+void TCP_Send_Queue::append(const Wire_Buffer &body)
+{
+    if (body->empty()) return;
+
+    chunks.emplace_back();
+    chunks.back().shared = body;
+    pending += body->size();
+}
+
+void TCP_Send_Queue::consume(size_t size)
+{
+    pending -= size;
+    while (size) {
+        size_t left = chunks.front().size() - offset;
+        if (size < left) {
+            offset += size;
+            return;
+        }
+
+        size -= left;
+        auto &data = chunks.front().data;
+        if (data.capacity() <= CHUNK_SIZE && data.capacity() > spare.capacity()) {
+            data.clear();
+            spare.swap(data);
+        }
+
+        chunks.pop_front();
+        offset = 0;
+    }
+}
+
+bool TCP_Send_Queue::empty() const
+{
+    return pending == 0;
+}
+
+const char *TCP_Recv_Buffer::begin() const
+{
+    return data.data() + offset;
+}
+
+size_t TCP_Recv_Buffer::size() const
+{
+    return data.size() - offset;
+}
+
+char *TCP_Recv_Buffer::prepare(size_t size)
+{
+    // moves at most as many bytes as were consumed since the last time
+    if (offset && offset >= (data.size() / 2)) {
+        data.erase(data.begin(), data.begin() + offset);
+        offset = 0;
+    }
+
+    size_t old_size = data.size();
+    data.resize(old_size + size);
+    return data.data() + old_size;
+}
+
+void TCP_Recv_Buffer::commit(size_t prepared, size_t written)
+{
+    data.resize(data.size() - prepared + written);
+}
+
+void TCP_Recv_Buffer::consume(size_t size)
+{
+    offset += size;
+    if (offset >= data.size()) {
+        data.clear();
+        offset = 0;
+    }
+}
+
 static void send_tcp_pending(struct TCP_Socket &socket)
 {
-    size_t buf_size = socket.send_buffer.size();
-    if (buf_size == 0) return;
+    // gather as many queued chunks as possible in a single syscall
+    constexpr const static size_t MAX_SEND_BUFFERS = 64;
+    TCP_Send_Queue &queue = socket.send_buffer;
+
+    while (!queue.empty()) {
+#if defined(STEAM_WIN32)
+        WSABUF buffers[MAX_SEND_BUFFERS];
+#else
+        struct iovec buffers[MAX_SEND_BUFFERS];
+#endif
+        size_t count = 0, requested = 0, offset = queue.offset;
+        for (auto &chunk : queue.chunks) {
+            if (count >= MAX_SEND_BUFFERS) break;
+
+#if defined(STEAM_WIN32)
+            buffers[count].buf = (CHAR *)(chunk.bytes() + offset);
+            buffers[count].len = (ULONG)(chunk.size() - offset);
+#else
+            buffers[count].iov_base = (void *)(chunk.bytes() + offset);
+            buffers[count].iov_len = chunk.size() - offset;
+#endif
+            requested += chunk.size() - offset;
+            offset = 0;
+            ++count;
+        }
 
-    int len = send(socket.sock, &(socket.send_buffer[0]), buf_size, MSG_NOSIGNAL);
-    if (len <= 0) return;
+#if defined(STEAM_WIN32)
+        DWORD len = 0;
+        if (WSASend(socket.sock, buffers, (DWORD)count, &len, 0, NULL, NULL) != 0 || len == 0) return;
+#else
+        struct msghdr hdr{};
+        hdr.msg_iov = buffers;
+        hdr.msg_iovlen = count;
+        ssize_t len = sendmsg(socket.sock, &hdr, MSG_NOSIGNAL);
+        if (len <= 0) return;
+#endif
 
-    socket.send_buffer.erase(socket.send_buffer.begin(), socket.send_buffer.begin() + len);
+        queue.consume((size_t)len);
+        // the socket buffer is full, try again on the next run
+        if ((size_t)len < requested) return;
+    }
 }
 
 static void send_buffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
 {
-    uint32 size = msg->ByteSizeLong(), old_size = socket.send_buffer.size();
-    socket.send_buffer.resize(old_size + sizeof(uint32) + size);
-    memcpy(&(socket.send_buffer[old_size]), &size, sizeof(size));
-    msg->SerializeToArray(&(socket.send_buffer[old_size + sizeof(uint32)]), size);
+    uint32 size = msg->ByteSizeLong();
+    char *frame = socket.send_buffer.append(sizeof(uint32) + size);
+    memcpy(frame, &size, sizeof(size));
+    msg->SerializeToArray(frame + sizeof(uint32), size);
+
+    send_tcp_pending(socket);
+}
+
+static size_t encode_varint(char *out, uint64 value)
+{
+    size_t size = 0;
+    do {
+        uint8 byte = value & 0x7F;
+        value >>= 7;
+        if (value) byte |= 0x80;
+        out[size++] = (char)byte;
+    } while (value);
+
+    return size;
+}
+
+// protobuf fields can be in any order on the wire and a field can be appended
+// to an already serialized message, the result parses like the full message
+static size_t encode_varint_field(char *out, uint32 field, uint64 value)
+{
+    size_t size = encode_varint(out, (uint64)field << 3); // varint wire type
+    return size + encode_varint(out + size, value);
+}
+
+static size_t encode_dest_id(char (&header)[DEST_ID_HEADER_MAX_SIZE], uint64 dest_id)
+{
+    return encode_varint_field(header, Common_Message::kDestIdFieldNumber, dest_id);
+}
+
+static Wire_Buffer serialize_for_fan_out(Common_Message *msg)
+{
+    msg->clear_dest_id();
+    return std::make_shared<const std::string>(msg->SerializeAsString());
+}
+
+static void send_serialized_tcp(struct TCP_Socket &socket, const std::string &serialized)
+{
+    uint32 size = serialized.size();
+    char *frame = socket.send_buffer.append(sizeof(uint32) + size);
+    memcpy(frame, &size, sizeof(size));
+    memcpy(frame + sizeof(uint32), serialized.data(), size);
+
+    send_tcp_pending(socket);
+}
+
+// the socket the messages to a connection are sent on, the one which received data from it
+static struct TCP_Socket *tcp_send_socket(Connection &conn)
+{
+    if (conn.tcp_socket_incoming.received_data) return &conn.tcp_socket_incoming;
+    if (conn.tcp_socket_outgoing.received_data) return &conn.tcp_socket_outgoing;
+    return nullptr;
+}
+
+// bodies smaller than this are copied in the send queue, a shared reference isn't worth it
+#define MIN_SHARED_BODY_SIZE 512
+
+// 'header' holds the encoded dest_id field of this destination
+static void send_wire_tcp(struct TCP_Socket &socket, const char *header, size_t header_size, const Wire_Buffer &body)
+{
+    uint32 size = header_size + body->size();
+    if (body->size() < MIN_SHARED_BODY_SIZE) {
+        char *frame = socket.send_buffer.append(sizeof(uint32) + size);
+        memcpy(frame, &size, sizeof(size));
+        memcpy(frame + sizeof(uint32), header, header_size);
+        memcpy(frame + sizeof(uint32) + header_size, body->data(), body->size());
+    } else {
+        char *frame = socket.send_buffer.append(sizeof(uint32) + header_size);
+        memcpy(frame, &size, sizeof(size));
+        memcpy(frame + sizeof(uint32), header, header_size);
+        socket.send_buffer.append(body);
+    }
 
     send_tcp_pending(socket);
 }
@@ -443,7 +824,7 @@ static unsigned long peek_buffer_tcp(struct TCP_Socket &socket)
     uint32 length;
     if (socket.recv_buffer.size() < sizeof(length)) return 0;
 
-    memcpy(&length, &(socket.recv_buffer[0]), sizeof(length));
+    memcpy(&length, socket.recv_buffer.begin(), sizeof(length));
     if (sizeof(length) + length > socket.recv_buffer.size()) return 0;
 
     return length;
@@ -456,11 +837,11 @@ static bool unbuffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
         return false;
     }
 
-    if (msg->ParseFromArray(&(socket.recv_buffer[sizeof(uint32)]), l)) {
-        socket.recv_buffer.erase(socket.recv_buffer.begin(), socket.recv_buffer.begin() + sizeof(l) + l);
+    if (msg->ParseFromArray(socket.recv_buffer.begin() + sizeof(uint32), l)) {
+        socket.recv_buffer.consume(sizeof(l) + l);
         return true;
     } else {
-        PRINT_DEBUG("BAD TCP DATA %u %zu %zu %hhu", l, socket.recv_buffer.size(), sizeof(uint32), *((char *)&(socket.recv_buffer[sizeof(uint32)])));
+        PRINT_DEBUG("BAD TCP DATA %u %zu %zu %hhu", l, socket.recv_buffer.size(), sizeof(uint32), *(socket.recv_buffer.begin() + sizeof(uint32)));
         kill_tcp_socket(socket);
     }
 
@@ -470,11 +851,11 @@ static bool unbuffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
 static bool recv_tcp(struct TCP_Socket &socket)
 {
     if (is_socket_valid(socket.sock)) {
-        unsigned int size = receive_buffer_amount(socket.sock), old_size = socket.recv_buffer.size();
-        int len;
-        socket.recv_buffer.resize(old_size + size);
+        unsigned int size = receive_buffer_amount(socket.sock);
         if (size > 0) {
-            len = recv(socket.sock, &(socket.recv_buffer[old_size]), size, MSG_NOSIGNAL);
+            char *data = socket.recv_buffer.prepare(size);
+            int len = recv(socket.sock, data, size, MSG_NOSIGNAL);
+            socket.recv_buffer.commit(size, len > 0 ? len : 0);
             socket.received_data = true;
             return true;
         }
@@ -485,6 +866,9 @@ static bool recv_tcp(struct TCP_Socket &socket)
 
 static void socket_timeouts(struct TCP_Socket &socket, double extra_time)
 {
+    // nothing to time out, and resetting it every run would allocate a new send queue
+    if (!is_socket_valid(socket.sock)) return;
+
     if (check_timedout(socket.last_heartbeat_sent, HEARTBEAT_TIMEOUT / 2.0)) {
         Common_Message msg;
         msg.set_allocated_low_level(new Low_Level());
@@ -499,6 +883,124 @@ static void socket_timeouts(struct TCP_Socket &socket, double extra_time)
     }
 }
 
+// timestamps of the round trip time pings, only ever compared with our own clock
+static uint64 ping_clock_us()
+{
+    return (uint64)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#if defined(__linux__)
+// epoll user data: the socket in the low bits, the serial of the connection owning it above (0 = none)
+static uint64 poll_data(sock_t sock, uint64 owner)
+{
+    return (owner << 32) | (uint32)sock;
+}
+#endif
+
+void Networking::poll_add(sock_t sock)
+{
+#if defined(__linux__)
+    if (epoll_fd < 0 || !is_socket_valid(sock)) return;
+
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = poll_data(sock, 0);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) != 0) {
+        PRINT_DEBUG("epoll_ctl failed for socket %i, error %i", sock, errno);
+    }
+#endif
+}
+
+void Networking::poll_writable(Connection &conn, struct TCP_Socket &socket)
+{
+#if defined(__linux__)
+    bool writable = !socket.send_buffer.empty();
+    if (epoll_fd < 0 || !is_socket_valid(socket.sock) || (socket.poll_out == writable && socket.poll_owner == conn.serial)) return;
+
+    // the events of the socket also tell which connection to visit
+    struct epoll_event ev{};
+    ev.events = writable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.u64 = poll_data(socket.sock, conn.serial);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket.sock, &ev) != 0) {
+        PRINT_DEBUG("epoll_ctl failed for socket %i, error %i", socket.sock, errno);
+        return;
+    }
+
+    socket.poll_out = writable;
+    socket.poll_owner = conn.serial;
+#endif
+}
+
+void Networking::poll_sockets(int timeout_ms)
+{
+#if defined(__linux__)
+    readable_socks.clear();
+    writable_socks.clear();
+    ready_connections.clear();
+    if (epoll_fd < 0) {
+        if (timeout_ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return;
+    }
+
+    // level triggered, anything we don't fully read now is reported again next time
+    constexpr const static int MAX_EPOLL_EVENTS = 256;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int count, total = 0;
+    do {
+        count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, total ? 0 : timeout_ms);
+        for (int i = 0; i < count; ++i) {
+            sock_t sock = (sock_t)(uint32)events[i].data.u64;
+            uint64 owner = events[i].data.u64 >> 32;
+            if (sock == wake_fd) {
+                uint64_t ignored;
+                if (read(wake_fd, &ignored, sizeof(ignored)) < 0) { }
+                continue;
+            }
+
+            // the errors are reported to both sides, whichever syscall comes next gets them
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) readable_socks.push_back(sock);
+            if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) writable_socks.push_back(sock);
+            if (owner) ready_connections.push_back(owner);
+        }
+
+        total += std::max(count, 0);
+    } while (count == MAX_EPOLL_EVENTS && total < MAX_EPOLL_EVENTS * 4);
+
+    std::sort(readable_socks.begin(), readable_socks.end());
+    std::sort(writable_socks.begin(), writable_socks.end());
+#else
+    // no poller, the I/O thread just tries every socket every 1ms
+    if (timeout_ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+}
+
+bool Networking::is_readable(sock_t sock) const
+{
+    if (!is_socket_valid(sock)) return false;
+
+#if defined(__linux__)
+    if (epoll_fd >= 0) {
+        return std::binary_search(readable_socks.begin(), readable_socks.end(), sock);
+    }
+#endif
+
+    // no poller available, try every socket
+    return true;
+}
+
+bool Networking::is_writable(sock_t sock) const
+{
+    if (!is_socket_valid(sock)) return false;
+
+#if defined(__linux__)
+    if (epoll_fd >= 0) {
+        return std::binary_search(writable_socks.begin(), writable_socks.end(), sock);
+    }
+#endif
+
+    return true;
+}
+
 std::set<IP_PORT> Networking::resolve_ip(std::string dns)
 {
     run_at_startup();
@@ -532,68 +1034,38 @@ std::set<IP_PORT> Networking::resolve_ip(std::string dns)
     return ips;
 }
 
-void Networking::do_callbacks_message(Common_Message *msg)
-{
-    if (msg->has_network() || msg->has_network_old()) {
-        PRINT_DEBUG("has_network");
-        run_callbacks(CALLBACK_ID_NETWORKING, msg);
-    }
-
-    if (msg->has_lobby()) {
-        PRINT_DEBUG("has_lobby");
-        run_callbacks(CALLBACK_ID_LOBBY, msg);
-    }
-
-    if (msg->has_lobby_messages()) {
-        PRINT_DEBUG("has_lobby_messages");
-        run_callbacks(CALLBACK_ID_LOBBY, msg);
-    }
-
-    if (msg->has_gameserver()) {
-        PRINT_DEBUG("has_gameserver");
-        run_callbacks(CALLBACK_ID_GAMESERVER, msg);
-    }
-
-    if (msg->has_friend_()) {
-        PRINT_DEBUG("has_friend_");
-        run_callbacks(CALLBACK_ID_FRIEND, msg);
-    }
-
-    if (msg->has_auth_ticket()) {
-        PRINT_DEBUG("has_auth_ticket");
-        run_callbacks(CALLBACK_ID_AUTH_TICKET, msg);
-    }
-
-    if (msg->has_friend_messages()) {
-        PRINT_DEBUG("has_friend_messages");
-        run_callbacks(CALLBACK_ID_FRIEND_MESSAGES, msg);
-    }
-
-    if (msg->has_networking_sockets()) {
-        PRINT_DEBUG("has_networking_sockets");
-        run_callbacks(CALLBACK_ID_NETWORKING_SOCKETS, msg);
-    }
+static_assert(Common_Message::kCompressed < Network_Counters::MESSAGE_TYPES, "Network_Counters::MESSAGE_TYPES is too small");
 
-    if (msg->has_steam_messages()) {
-        PRINT_DEBUG("has_steam_messages");
-        run_callbacks(CALLBACK_ID_STEAM_MESSAGES, msg);
-    }
+// Common_Message oneof case -> the callbacks which get it, CALLBACK_IDS_MAX for the
+// messages handled by the networking itself (announces, fragments, acks, ...)
+static std::vector<Callback_Ids> build_dispatch_table()
+{
+    std::vector<Callback_Ids> table(Network_Counters::MESSAGE_TYPES, CALLBACK_IDS_MAX);
+    table[Common_Message::kNetwork] = CALLBACK_ID_NETWORKING;
+    table[Common_Message::kNetworkOld] = CALLBACK_ID_NETWORKING;
+    table[Common_Message::kLobby] = CALLBACK_ID_LOBBY;
+    table[Common_Message::kLobbyMessages] = CALLBACK_ID_LOBBY;
+    table[Common_Message::kGameserver] = CALLBACK_ID_GAMESERVER;
+    table[Common_Message::kFriend] = CALLBACK_ID_FRIEND;
+    table[Common_Message::kAuthTicket] = CALLBACK_ID_AUTH_TICKET;
+    table[Common_Message::kFriendMessages] = CALLBACK_ID_FRIEND_MESSAGES;
+    table[Common_Message::kNetworkingSockets] = CALLBACK_ID_NETWORKING_SOCKETS;
+    table[Common_Message::kSteamMessages] = CALLBACK_ID_STEAM_MESSAGES;
+    table[Common_Message::kNetworkingMessages] = CALLBACK_ID_NETWORKING_MESSAGES;
+    table[Common_Message::kGameserverStatsMessages] = CALLBACK_ID_GAMESERVER_STATS;
+    table[Common_Message::kLeaderboardsMessages] = CALLBACK_ID_LEADERBOARDS_STATS;
+    return table;
+}
 
-    if (msg->has_networking_messages()) {
-        PRINT_DEBUG("has_networking_messages");
-        run_callbacks(CALLBACK_ID_NETWORKING_MESSAGES, msg);
-    }
+static const std::vector<Callback_Ids> dispatch_table = build_dispatch_table();
 
-    if (msg->has_gameserver_stats_messages()) {
-        PRINT_DEBUG("has_gameserver_stats");
-        run_callbacks(CALLBACK_ID_GAMESERVER_STATS, msg);
-    }
-    
-    if (msg->has_leaderboards_messages()) {
-        PRINT_DEBUG("has_leaderboards_messages");
-        run_callbacks(CALLBACK_ID_LEADERBOARDS_STATS, msg);
+void Networking::do_callbacks_message(Common_Message *msg)
+{
+    Callback_Ids id = dispatch_table[msg->messages_case()];
+    PRINT_DEBUG("message case %i, callback id %i", (int)msg->messages_case(), (int)id);
+    if (id != CALLBACK_IDS_MAX) {
+        run_callbacks(id, msg);
     }
-    
 }
 
 bool Networking::handle_tcp(Common_Message *msg, struct TCP_Socket &socket)
@@ -608,28 +1080,50 @@ bool Networking::handle_tcp(Common_Message *msg, struct TCP_Socket &socket)
                 //socket.last_heartbeat_received = std::chrono::high_resolution_clock::now();
                 break;
         }
+
+        if (msg->low_level().shm_barrier()) {
+            handle_shm_barrier(msg);
+            return true;
+        }
+    }
+
+    size_t size = msg->ByteSizeLong();
+    if (msg->has_compressed() && !decompress_message(msg)) return true;
+    if (!msg->has_low_level()) count_received(msg, size);
+
+    // reliable UDP messages which were sent through TCP instead still need to be ordered
+    if (msg->reliable_seq()) {
+        handle_reliable(msg);
+    } else {
+        deliver_message(msg);
     }
 
-    do_callbacks_message(msg);
     return true;
 }
 
-struct Connection *Networking::find_connection(CSteamID search_id, uint32 appid)
+template<typename Key>
+static void unindex_connection(std::unordered_map<Key, std::vector<struct Connection *>> &index, Key key, struct Connection *connection)
 {
-    auto conn = std::find_if(connections.begin(), connections.end(), [&search_id, appid](struct Connection const& conn) { 
-        if (appid && (conn.appid != appid)) return false;
+    auto entry = index.find(key);
+    if (entry == index.end()) return;
 
-        for (const auto &id: conn.ids) {
-            if (search_id == id) return true;
-        }
+    auto &list = entry->second;
+    list.erase(std::remove(list.begin(), list.end(), connection), list.end());
+    if (list.empty()) index.erase(entry);
+}
 
-        return false;
-    });
+struct Connection *Networking::find_connection(CSteamID search_id, uint32 appid)
+{
+    auto entry = connections_by_id.find(search_id.ConvertToUint64());
+    if (entry == connections_by_id.end()) return nullptr;
 
-    if (connections.end() != conn)
-        return &(*conn);
+    struct Connection *found = nullptr;
+    for (struct Connection *conn : entry->second) {
+        if (appid && (conn->appid != appid)) continue;
+        if (!found || conn->serial < found->serial) found = conn;
+    }
 
-    return nullptr;
+    return found;
 }
 
 bool Networking::add_id_connection(struct Connection *connection, CSteamID steam_id)
@@ -642,6 +1136,7 @@ bool Networking::add_id_connection(struct Connection *connection, CSteamID steam
 
     PRINT_DEBUG("ADDED ID %llu", (uint64)steam_id.ConvertToUint64());
     connection->ids.push_back(steam_id);
+    connections_by_id[steam_id.ConvertToUint64()].push_back(connection);
     if (connection->connected) {
         run_callback_user(steam_id, true, connection->appid);
     }
@@ -659,9 +1154,51 @@ struct Connection *Networking::new_connection(CSteamID search_id, uint32 appid)
     connection.appid = appid;
     connection.last_received = std::chrono::high_resolution_clock::now();
 
+    connection.serial = next_connection_serial++;
+
     PRINT_DEBUG("ADDED ID %llu", (uint64)search_id.ConvertToUint64());
     connections.push_back(connection);
-    return &(connections[connections.size() - 1]);
+    conn = &connections.back();
+    connections_by_id[search_id.ConvertToUint64()].push_back(conn);
+    connections_by_ip[conn->tcp_ip_port.ip].push_back(conn);
+    connections_by_serial[conn->serial] = std::prev(connections.end());
+    schedule_connection_timer(*conn);
+    schedule_connection_timer(*conn, conn->stats_timer, TIMER_STATS, connection.last_received);
+    // opens its outgoing socket
+    connections_to_visit.push_back(conn->serial);
+    return conn;
+}
+
+void Networking::remove_id_connection(struct Connection *connection, std::vector<CSteamID>::iterator id)
+{
+    unindex_connection(connections_by_id, id->ConvertToUint64(), connection);
+    connection->ids.erase(id);
+}
+
+void Networking::set_connection_ip(struct Connection *connection, IP_PORT ip_port)
+{
+    if (connection->tcp_ip_port.ip != ip_port.ip) {
+        unindex_connection(connections_by_ip, connection->tcp_ip_port.ip, connection);
+        connections_by_ip[ip_port.ip].push_back(connection);
+    }
+
+    connection->tcp_ip_port = ip_port;
+}
+
+std::list<struct Connection>::iterator Networking::remove_connection(std::list<struct Connection>::iterator connection)
+{
+    shm_disconnect(*connection);
+    tcp_delayed_messages -= connection->tcp_delayed.size() + connection->tcp_delayed_sends.size();
+    for (auto &id : connection->ids) {
+        unindex_connection(connections_by_id, id.ConvertToUint64(), &(*connection));
+    }
+
+    if (connection->ids.size() && !connections_by_id.count(connection->ids[0].ConvertToUint64())) global_impairments.erase(connection->ids[0].ConvertToUint64());
+    unindex_connection(connections_by_ip, connection->tcp_ip_port.ip, &(*connection));
+    auto compact = connections_by_compact_id.find(connection->peer_compact_id);
+    if (compact != connections_by_compact_id.end() && compact->second == &(*connection)) connections_by_compact_id.erase(compact);
+    connections_by_serial.erase(connection->serial);
+    return connections.erase(connection);
 }
 
 bool Networking::handle_announce(Common_Message *msg, IP_PORT ip_port)
@@ -674,14 +1211,42 @@ bool Networking::handle_announce(Common_Message *msg, IP_PORT ip_port)
     }
 
     PRINT_DEBUG("Handle Announce: %u, " "%" PRIu64 ", %u, %u", conn->appid, msg->source_id(), msg->announce().appid(), msg->announce().type());
-    conn->tcp_ip_port = ip_port;
-    conn->tcp_ip_port.port = htons(msg->announce().tcp_port());
+    IP_PORT tcp_ip_port = ip_port;
+    tcp_ip_port.port = htons(msg->announce().tcp_port());
+    // the source of a PING is its UDP socket too, used to announce ourselves to it until it answers
+    if (!conn->udp_pinged) conn->udp_ip_port = ip_port;
+    set_connection_ip(conn, tcp_ip_port);
     conn->appid = msg->announce().appid();
+    conn->capabilities = msg->announce().capabilities();
+
+    const Announce &announce = msg->announce();
+    if (shm_id && (announce.capabilities() & Announce::SHARED_MEMORY) && announce.host_id() == host_id &&
+        announce.shm_id() && announce.shm_id() != shm_id && announce.shm_id() != conn->shm_id) {
+        shm_connect(conn, announce.shm_id());
+    }
 
     for (int i = 0; i < msg->announce().ids_size(); ++i) {
         add_id_connection(conn, (uint64) msg->announce().ids(i));
     }
 
+    conn->peer_ids.assign(announce.ids().begin(), announce.ids().end());
+    uint32 peer_compact_id = (announce.capabilities() & Announce::COMPACT_DATA) ? announce.compact_id() : 0;
+    if (peer_compact_id != conn->peer_compact_id) {
+        // a new id when the peer restarted
+        auto compact = connections_by_compact_id.find(conn->peer_compact_id);
+        if (compact != connections_by_compact_id.end() && compact->second == conn) connections_by_compact_id.erase(compact);
+        if (conn->peer_compact_id) {
+            // its reliable UDP sequences start over, ours too, what was sent to the old instance is lost with it
+            PRINT_DEBUG("user %llu restarted, resetting reliable udp", (uint64)msg->source_id());
+            conn->reliable_udp = Reliable_UDP{};
+        }
+
+        conn->peer_compact_id = peer_compact_id;
+        if (peer_compact_id) connections_by_compact_id[peer_compact_id] = conn;
+    }
+
+    // the same ping is sent to every unknown peer, serialize it once
+    bool ping_serialized = false;
     for (int i = 0; i < msg->announce().peers_size(); ++i) {
         CSteamID search_id((uint64)msg->announce().peers(i).id());
         auto id_temp = std::find(ids.begin(), ids.end(), search_id);
@@ -692,41 +1257,48 @@ bool Networking::handle_announce(Common_Message *msg, IP_PORT ip_port)
         Connection *conn = find_connection((uint64)msg->announce().peers(i).id(), msg->announce().peers(i).appid());
         PRINT_DEBUG("%p %u %u " "%" PRIu64 "", conn, conn ? conn->appid : (uint32)0, msg->announce().peers(i).appid(), msg->announce().peers(i).id());
         if (!conn || conn->appid != msg->announce().peers(i).appid()) {
-            Common_Message msg_ = create_announce(true);
-
-            size_t size = msg_.ByteSizeLong();
-            char *buffer = new char[size];
-            msg_.SerializeToArray(buffer, size);
             IP_PORT ipp;
             ipp.ip = msg->announce().peers(i).ip();
             ipp.port = htons(msg->announce().peers(i).udp_port());
-            send_packet_to(udp_socket, ipp, buffer, size);
-            delete[] buffer;
+            if (ping_serialized) {
+                udp_batch.add_again(ipp);
+            } else {
+                Common_Message msg_ = create_announce(true);
+                std::string buffer = msg_.SerializeAsString();
+                udp_batch.add(ipp, buffer.data(), buffer.size());
+                ping_serialized = true;
+            }
         }
     }
 
     conn->last_received = std::chrono::high_resolution_clock::now();
 
     if (msg->announce().type() == Announce::PING) {
-        Common_Message msg = create_announce(false);
-        size_t size = msg.ByteSizeLong(); 
-        char *buffer = new char[size];
-        msg.SerializeToArray(buffer, size);
-        send_packet_to(udp_socket, ip_port, buffer, size);
-        delete[] buffer;
+        Common_Message pong = create_announce(false, conn, &msg->announce());
+        std::string buffer = pong.SerializeAsString();
+        udp_batch.add(ip_port, buffer.data(), buffer.size());
+        ++counters.pongs_sent;
 
         //send ping packet if not pinged
         if (!conn->udp_pinged) {
             Common_Message msg = create_announce(true);
-            size_t size = msg.ByteSizeLong(); 
-            char *buffer = new char[size];
-            msg.SerializeToArray(buffer, size);
-            send_packet_to(udp_socket, ip_port, buffer, size);
-            delete[] buffer;
+            std::string buffer = msg.SerializeAsString();
+            udp_batch.add(ip_port, buffer.data(), buffer.size());
         }
     } else if (msg->announce().type() == Announce::PONG) {
+        if (!conn->udp_pinged) {
+            conn->gossip_generation = ++gossip_generation;
+            // start the RTT pings if its stats are already read
+            schedule_connection_timer(*conn, conn->stats_timer, TIMER_STATS, std::chrono::high_resolution_clock::now());
+        }
+
         conn->udp_ip_port = ip_port;
         conn->udp_pinged = true;
+        // it answers over UDP again, the next reliable messages try UDP again with the same sequences
+        if (conn->reliable_udp.failed) {
+            PRINT_DEBUG("reliable udp available again for user %llu", (uint64)msg->source_id());
+            conn->reliable_udp.failed = false;
+        }
     }
 
     return true;
@@ -744,7 +1316,25 @@ bool Networking::handle_low_level_udp(Common_Message *msg, IP_PORT ip_port)
             
             break;
         case Low_Level::HEARTBEAT:
-            
+            // keeps the peer alive without announces, see send_legacy_announces()
+            connection->last_received = std::chrono::high_resolution_clock::now();
+            if (msg->low_level().ping_time()) {
+                Common_Message pong;
+                pong.set_source_id(ids.front().ConvertToUint64());
+                pong.mutable_low_level()->set_type(Low_Level::HEARTBEAT);
+                pong.mutable_low_level()->set_pong_time(msg->low_level().ping_time());
+                std::string buffer = pong.SerializeAsString();
+                udp_batch.add(ip_port, buffer.data(), buffer.size());
+            }
+
+            if (msg->low_level().pong_time()) {
+                uint64 now = ping_clock_us();
+                uint64 sent = msg->low_level().pong_time();
+                // an answer to one of our pings, anything else is bogus
+                if (sent <= now && (now - sent) < (uint64)(USER_TIMEOUT * 1000000)) {
+                    connection->stats.rtt_sample((now - sent) / 1000.0);
+                }
+            }
             break;
     }
 
@@ -760,6 +1350,14 @@ Networking::Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT>
     last_run = std::chrono::high_resolution_clock::now();
     this->appid = appid;
 
+    parse_arena_block.reset(new char[PARSE_ARENA_BLOCK_SIZE]);
+    google::protobuf::ArenaOptions arena_options{};
+    arena_options.initial_block = parse_arena_block.get();
+    arena_options.initial_block_size = PARSE_ARENA_BLOCK_SIZE;
+    arena_options.max_block_size = PARSE_ARENA_MAX_BLOCK_SIZE;
+    parse_arena.reset(new google::protobuf::Arena(arena_options));
+    while (!compact_id) compact_id = std::random_device{}();
+
     if (disable_sockets) {
         enabled = false;
         udp_socket = -1;
@@ -776,6 +1374,13 @@ Networking::Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT>
     }
 
     run_at_startup();
+#if defined(__linux__)
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        PRINT_DEBUG("epoll_create1 failed %i, falling back to polling every socket", errno);
+    }
+#endif
+
     sock_t sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     PRINT_DEBUG("UDP socket: %u", sock);
     if (is_socket_valid(sock) && set_socket_nonblocking(sock)) {
@@ -847,21 +1452,40 @@ Networking::Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT>
     if (is_socket_valid(udp_socket) && is_socket_valid(tcp_socket)) {
         PRINT_DEBUG("Networking initialized successfully on udp: %u tcp: %u", udp_port, tcp_port);
         enabled = true;
+        poll_add(udp_socket);
+        poll_add(tcp_socket);
+
+#if defined(__linux__)
+        udp_recv_batch.buffers.resize((size_t)UDP_Recv_Batch::SIZE * MAX_UDP_SIZE);
+        for (unsigned int i = 0; i < UDP_Recv_Batch::SIZE; ++i) {
+            udp_recv_batch.iovs[i].iov_base = &udp_recv_batch.buffers[(size_t)i * MAX_UDP_SIZE];
+            udp_recv_batch.iovs[i].iov_len = MAX_UDP_SIZE;
+            udp_recv_batch.msgs[i].msg_hdr.msg_name = &udp_recv_batch.addrs[i];
+            udp_recv_batch.msgs[i].msg_hdr.msg_iov = &udp_recv_batch.iovs[i];
+            udp_recv_batch.msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+#endif
     }
 
     PRINT_DEBUG("ADDED ID %llu", (uint64)id.ConvertToUint64());
     ids.push_back(id);
+    schedule_timer(broadcast_timer, TIMER_BROADCAST, last_run);
 
     reset_last_error();
 }
 
 Networking::~Networking()
 {
+    stopIOThread();
+
     for (auto &c : connections) {
         kill_tcp_socket(c.tcp_socket_incoming);
         kill_tcp_socket(c.tcp_socket_outgoing);
+        shm_disconnect(c);
     }
 
+    shm_doorbell_close(shm_doorbell);
+
     for (auto &c : accepted) {
         kill_tcp_socket(c);
     }
@@ -869,15 +1493,105 @@ Networking::~Networking()
     kill_socket(udp_socket);
     kill_socket(tcp_socket);
 
+#if defined(__linux__)
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+#endif
+
     curl_global_cleanup();
 }
 
-Common_Message Networking::create_announce(bool request)
+static uint64 gossip_hash(uint64 id, uint64 salt)
 {
-    Announce *announce = new Announce();
+    // splitmix64 finalizer
+    uint64 x = id ^ (salt * 0x9E3779B97F4A7C15ULL);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+void Networking::peers_digest(uint64 &digest, uint32 &count)
+{
+    // order independent, two peers which reached the same peers have the same digest
+    digest = gossip_hash(ids[0].ConvertToUint64(), appid);
+    count = 1;
+    for (auto &conn : connections) {
+        if (!conn.udp_pinged) continue;
+        digest ^= gossip_hash(conn.ids[0].ConvertToUint64(), conn.appid);
+        ++count;
+    }
+}
+
+void Networking::add_gossip_peers(Announce *announce, Connection *requester, const Announce &ping)
+{
+    uint64 digest;
+    uint32 count;
+    peers_digest(digest, count);
+    if (ping.peers_digest() == digest) {
+        ++counters.pongs_without_peers;
+        return;
+    }
+
+    if (requester->gossip_generation_sent >= gossip_generation) {
+        // nothing new since the last list, either it got lost or the requester knows peers we don't
+        if (ping.peers_count() > count) {
+            ++counters.pongs_without_peers;
+            return;
+        }
+
+        requester->gossip_generation_sent = 0;
+    }
+
+    std::vector<const Connection *> peers{};
+    for (auto &conn : connections) {
+        if (conn.udp_pinged && conn.gossip_generation > requester->gossip_generation_sent && &conn != requester) {
+            peers.push_back(&conn);
+        }
+    }
+
+    std::sort(peers.begin(), peers.end(), [](const Connection *a, const Connection *b) { return a->gossip_generation < b->gossip_generation; });
+    if (peers.size() > GOSSIP_MAX_PEERS_PER_PONG) {
+        peers.resize(GOSSIP_MAX_PEERS_PER_PONG);
+        requester->gossip_generation_sent = peers.back()->gossip_generation;
+    } else {
+        requester->gossip_generation_sent = gossip_generation;
+    }
+
+    for (auto conn : peers) {
+        Announce_Other_Peers *peer = announce->add_peers();
+        peer->set_id(conn->ids[0].ConvertToUint64());
+        peer->set_ip(conn->udp_ip_port.ip);
+        peer->set_udp_port(ntohs(conn->udp_ip_port.port));
+        peer->set_appid(conn->appid);
+    }
+
+    counters.gossip_peers_sent += peers.size();
+    if (peers.empty()) ++counters.pongs_without_peers;
+}
+
+Common_Message Networking::create_announce(bool request, Connection *requester, const Announce *ping)
+{
+    Announce *announce = new Announce();
     PRINT_DEBUG("ids length %zu", ids.size());
     if (request) {
         announce->set_type(Announce::PING);
+        if (gossip_discovery) {
+            uint64 digest;
+            uint32 count;
+            peers_digest(digest, count);
+            announce->set_peers_digest(digest);
+            announce->set_peers_count(count);
+        }
+    } else if (gossip_discovery && requester && ping && (ping->capabilities() & Announce::GOSSIP)) {
+        announce->set_type(Announce::PONG);
+        add_gossip_peers(announce, requester, *ping);
     } else {
         announce->set_type(Announce::PONG);
         for (auto &conn: connections) {
@@ -892,99 +1606,1943 @@ Common_Message Networking::create_announce(bool request)
         }
     }
 
-    announce->set_tcp_port(tcp_port);
-    announce->set_appid(this->appid);
-    for (auto &id : ids) announce->add_ids(id.ConvertToUint64());
-    Common_Message msg;
-    msg.set_allocated_announce(announce);
-    msg.set_source_id(ids[0].ConvertToUint64());
-    return msg;
+    announce->set_tcp_port(tcp_port);
+    announce->set_appid(this->appid);
+    announce->set_capabilities(Announce::FRAGMENTS | Announce::BATCHES | Announce::COMPRESSION | Announce::COMPACT_DATA | (reliable_udp_enabled ? Announce::RELIABLE_UDP : 0) | (gossip_discovery ? Announce::GOSSIP : 0) | (shm_id ? Announce::SHARED_MEMORY : 0));
+    if (shm_id) {
+        announce->set_host_id(host_id);
+        announce->set_shm_id(shm_id);
+    }
+    announce->set_compact_id(compact_id);
+    for (auto &id : ids) announce->add_ids(id.ConvertToUint64());
+    Common_Message msg;
+    msg.set_allocated_announce(announce);
+    msg.set_source_id(ids[0].ConvertToUint64());
+    return msg;
+}
+
+void Networking::send_announce_broadcasts()
+{
+    Common_Message msg = create_announce(true);
+
+    size_t size = msg.ByteSizeLong(); 
+    std::vector<char> buffer(size);
+    msg.SerializeToArray(&buffer[0], size);
+    send_broadcasts(broadcast_interfaces, udp_batch, htons(DEFAULT_PORT), &buffer[0], size, &this->custom_broadcasts);
+    if (udp_port != DEFAULT_PORT) {
+        send_broadcasts(broadcast_interfaces, udp_batch, htons(udp_port), &buffer[0], size, &this->custom_broadcasts);
+    }
+
+    flush_udp_batch();
+
+    ++counters.announce_broadcasts;
+    last_broadcast = std::chrono::high_resolution_clock::now();
+    if (gossip_discovery) {
+        // newcomers broadcast themselves, so the others can wait longer and longer while the peers are stable,
+        // +-10% to spread the broadcasts of instances started together
+        double jitter = (double)(gossip_hash(ids[0].ConvertToUint64(), counters.announce_broadcasts) % 201) / 1000.0 - 0.1;
+        broadcast_interval = std::min(broadcast_interval * 2.0, GOSSIP_MAX_BROADCAST_INTERVAL) * (1.0 + jitter);
+    }
+
+    schedule_timer(broadcast_timer, TIMER_BROADCAST, last_broadcast + timer_duration(gossip_discovery ? broadcast_interval : BROADCAST_INTERVAL));
+    PRINT_DEBUG("sent broadcasts, next in %f seconds", broadcast_interval);
+}
+
+void Networking::send_legacy_announces()
+{
+    // the peers without gossip discovery time us out if they don't hear our announces,
+    // the others hear our heartbeats once they're reached over UDP
+    if (!gossip_discovery) return;
+    schedule_timer(legacy_announces_timer, TIMER_LEGACY_ANNOUNCES, std::chrono::high_resolution_clock::now() + timer_duration(BROADCAST_INTERVAL));
+
+    bool serialized = false;
+    for (auto &conn : connections) {
+        if (((conn.capabilities & Announce::GOSSIP) && conn.udp_pinged) || !conn.udp_ip_port.ip) continue;
+        if (serialized) {
+            udp_batch.add_again(conn.udp_ip_port);
+        } else {
+            Common_Message msg = create_announce(true);
+            std::string buffer = msg.SerializeAsString();
+            udp_batch.add(conn.udp_ip_port, buffer.data(), buffer.size());
+            serialized = true;
+        }
+    }
+}
+
+void Networking::run_source_query()
+{
+    // the gameserver isn't thread safe, this always runs on the caller of Run()
+    bool readable = io_thread_active ? is_socket_valid(query_socket) : is_readable(query_socket);
+    if (!query_alive || !readable) return;
+
+    IP_PORT ip_port;
+    char data[MAX_UDP_SIZE];
+    int len;
+
+    PRINT_DEBUG("RECV Source Query");
+    Steam_Client* client = get_steam_client();
+    sockaddr_in addr;
+    addr.sin_family = AF_INET;
+
+    while ((len = receive_packet(query_socket, &ip_port, data, sizeof(data))) >= 0) {
+        PRINT_DEBUG("requesting Source Query server info from Steam_GameServer");
+        client->steam_gameserver->HandleIncomingPacket(data, len, htonl(ip_port.ip), htons(ip_port.port));
+        len = client->steam_gameserver->GetNextOutgoingPacket(data, sizeof(data), &ip_port.ip, &ip_port.port);
+
+        PRINT_DEBUG("sending Source Query server info");
+        addr.sin_addr.s_addr = htonl(ip_port.ip);
+        addr.sin_port        = htons(ip_port.port);
+        sendto(query_socket, data, len, 0, (sockaddr*)&addr, sizeof(addr));
+    }
+}
+
+void Networking::handle_udp_packet(const char *data, int len, IP_PORT ip_port)
+{
+    PRINT_DEBUG("recv %i %hhu.%hhu.%hhu.%hhu:%hu", len,
+        ((unsigned char *)&ip_port.ip)[0], ((unsigned char *)&ip_port.ip)[1], ((unsigned char *)&ip_port.ip)[2], ((unsigned char *)&ip_port.ip)[3], htons(ip_port.port));
+    if (len > 0 && (data[0] & 7) == 7) {
+        handle_compact(data, (size_t)len, ip_port);
+        return;
+    }
+
+    Common_Message *msg = parsed_message();
+    if (msg->ParseFromArray(data, len)) {
+        if (msg->source_id()) {
+            if (msg->has_announce()) {
+                handle_announce(msg, ip_port);
+            } else if (msg->has_low_level()) {
+                handle_low_level_udp(msg, ip_port);
+            } else if (msg->has_fragment()) {
+                handle_fragment(msg, ip_port);
+            } else if (msg->has_batch()) {
+                handle_batch(msg, ip_port);
+            } else {
+                receive_message(msg, ip_port);
+            }
+        }
+    }
+}
+
+void Networking::receive_udp()
+{
+#if defined(__linux__)
+    // pull up to UDP_Recv_Batch::SIZE datagrams per syscall into the preallocated buffers
+    struct UDP_Recv_Batch &batch = udp_recv_batch;
+    while (is_readable(udp_socket)) {
+        for (unsigned int i = 0; i < UDP_Recv_Batch::SIZE; ++i) {
+            batch.msgs[i].msg_hdr.msg_namelen = sizeof(batch.addrs[i]);
+            batch.msgs[i].msg_hdr.msg_flags = 0;
+            batch.msgs[i].msg_len = 0;
+        }
+
+        int received = recvmmsg(udp_socket, batch.msgs, UDP_Recv_Batch::SIZE, MSG_DONTWAIT, nullptr);
+        if (received <= 0) break;
+
+        ++counters.udp_recv_calls;
+        counters.udp_recv_datagrams += received;
+        count_batch(counters.udp_recv_batch_sizes, received);
+
+        for (int i = 0; i < received; ++i) {
+            IP_PORT ip_port;
+            ip_port.ip = batch.addrs[i].sin_addr.s_addr;
+            ip_port.port = batch.addrs[i].sin_port;
+            if (impairment_enabled) {
+                impair_received(&batch.buffers[(size_t)i * MAX_UDP_SIZE], (int)batch.msgs[i].msg_len, ip_port);
+            } else {
+                handle_udp_packet(&batch.buffers[(size_t)i * MAX_UDP_SIZE], (int)batch.msgs[i].msg_len, ip_port);
+            }
+        }
+
+        reset_parse_arena();
+        // a short batch means the socket was drained
+        if ((unsigned int)received < UDP_Recv_Batch::SIZE) break;
+    }
+#else
+    IP_PORT ip_port;
+    char data[MAX_UDP_SIZE];
+    int len;
+
+    while(is_readable(udp_socket) && (len = receive_packet(udp_socket, &ip_port, data, sizeof(data))) >= 0) {
+        ++counters.udp_recv_calls;
+        ++counters.udp_recv_datagrams;
+        count_batch(counters.udp_recv_batch_sizes, 1);
+        if (impairment_enabled) {
+            impair_received(data, len, ip_port);
+        } else {
+            handle_udp_packet(data, len, ip_port);
+        }
+    }
+#endif
+
+    release_delayed_receives();
+    reset_parse_arena();
+
+    // replies to announces are queued while handling them
+    flush_udp_batch();
+}
+
+void Networking::flush_udp_batch()
+{
+    if (udp_batch.empty() && delayed_sends.empty()) return;
+
+    if (impairment_enabled || !delayed_sends.empty()) {
+        impair_udp_batch();
+        if (udp_batch.empty()) return;
+    }
+
+    PRINT_DEBUG("sending %zu datagrams", udp_batch.entries.size());
+#if defined(__linux__)
+    constexpr const static size_t CHUNK = 64;
+    struct mmsghdr msgs[CHUNK];
+    struct iovec iovs[CHUNK][2];
+    struct sockaddr_in addrs[CHUNK];
+
+    size_t done = 0;
+    while (done < udp_batch.entries.size()) {
+        size_t count = std::min(CHUNK, udp_batch.entries.size() - done);
+        for (size_t i = 0; i < count; ++i) {
+            const auto &entry = udp_batch.entries[done + i];
+            addrs[i] = {};
+            addrs[i].sin_family = AF_INET;
+            addrs[i].sin_addr.s_addr = entry.ip_port.ip;
+            addrs[i].sin_port = entry.ip_port.port;
+            iovs[i][0].iov_base = &udp_batch.data[entry.offset];
+            iovs[i][0].iov_len = entry.size;
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            if (entry.body) {
+                iovs[i][1].iov_base = (void *)entry.body->data();
+                iovs[i][1].iov_len = entry.body->size();
+                msgs[i].msg_hdr.msg_iovlen = 2;
+            }
+        }
+
+        int sent = sendmmsg(udp_socket, msgs, (unsigned int)count, MSG_NOSIGNAL);
+        ++counters.udp_send_calls;
+        if (sent <= 0) {
+            // the first datagram failed, drop it like a failed sendto() and keep going
+            done += 1;
+            continue;
+        }
+
+        counters.udp_send_datagrams += sent;
+        count_batch(counters.udp_send_batch_sizes, sent);
+        done += sent;
+    }
+#else
+    for (auto &entry : udp_batch.entries) {
+        if (entry.body) {
+            send_packet_parts_to(udp_socket, entry.ip_port, &udp_batch.data[entry.offset], entry.size, entry.body->data(), entry.body->size());
+        } else {
+            send_packet_to(udp_socket, entry.ip_port, &udp_batch.data[entry.offset], entry.size);
+        }
+        ++counters.udp_send_calls;
+        ++counters.udp_send_datagrams;
+        count_batch(counters.udp_send_batch_sizes, 1);
+    }
+#endif
+
+    udp_batch.clear();
+}
+
+void Networking::dump_counters()
+{
+    constexpr const static double COUNTERS_DUMP_INTERVAL = 60.0;
+    if (!check_timedout(last_counters_dump, COUNTERS_DUMP_INTERVAL)) return;
+    last_counters_dump = std::chrono::high_resolution_clock::now();
+
+    PRINT_DEBUG("udp recv: %llu calls, %llu datagrams, batches [%llu %llu %llu %llu %llu %llu %llu %llu]",
+        counters.udp_recv_calls, counters.udp_recv_datagrams,
+        counters.udp_recv_batch_sizes[0], counters.udp_recv_batch_sizes[1], counters.udp_recv_batch_sizes[2], counters.udp_recv_batch_sizes[3],
+        counters.udp_recv_batch_sizes[4], counters.udp_recv_batch_sizes[5], counters.udp_recv_batch_sizes[6], counters.udp_recv_batch_sizes[7]);
+    PRINT_DEBUG("udp send: %llu calls, %llu datagrams, batches [%llu %llu %llu %llu %llu %llu %llu %llu]",
+        counters.udp_send_calls, counters.udp_send_datagrams,
+        counters.udp_send_batch_sizes[0], counters.udp_send_batch_sizes[1], counters.udp_send_batch_sizes[2], counters.udp_send_batch_sizes[3],
+        counters.udp_send_batch_sizes[4], counters.udp_send_batch_sizes[5], counters.udp_send_batch_sizes[6], counters.udp_send_batch_sizes[7]);
+    PRINT_DEBUG("fragments: sent %llu messages in %llu fragments, received %llu fragments, reassembled %llu messages, dropped %llu fragments, %llu incomplete messages",
+        counters.fragmented_messages_sent, counters.fragments_sent, counters.fragments_received,
+        counters.fragmented_messages_received, counters.fragments_dropped, counters.fragmented_messages_incomplete);
+    PRINT_DEBUG("reliable udp: sent %llu, retransmits %llu, fast retransmits %llu, duplicates %llu, fallbacks %llu, acks sent %llu",
+        counters.reliable_sent, counters.reliable_retransmits, counters.reliable_fast_retransmits,
+        counters.reliable_duplicates, counters.reliable_fallbacks, counters.acks_sent);
+    PRINT_DEBUG("coalescing: sent %llu messages in %llu batches, received %llu batches",
+        counters.coalesced_messages_sent, counters.coalesced_batches_sent, counters.coalesced_batches_received);
+    PRINT_DEBUG("compression: compressed %llu messages, %llu uncompressible, decompressed %llu, %llu errors",
+        counters.compressed_messages, counters.uncompressible_messages, counters.decompressed_messages, counters.decompression_errors);
+    PRINT_DEBUG("discovery: %llu broadcasts, %llu pongs, %llu without peers, %llu peers listed",
+        counters.announce_broadcasts, counters.pongs_sent, counters.pongs_without_peers, counters.gossip_peers_sent);
+    PRINT_DEBUG("shared memory: sent %llu, received %llu, ring full %llu times",
+        counters.shm_messages_sent, counters.shm_messages_received, counters.shm_ring_full);
+    PRINT_DEBUG("impairment: dropped %llu, delayed %llu, duplicated %llu",
+        counters.impaired_dropped, counters.impaired_delayed, counters.impaired_duplicated);
+    PRINT_DEBUG("parse arena: %llu resets, %llu overflows, peak %llu bytes",
+        counters.parse_arena_resets, counters.parse_arena_overflows, counters.parse_arena_peak);
+    PRINT_DEBUG("compact data packets: sent %llu, received %llu, dropped %llu",
+        counters.compact_sent, counters.compact_received, counters.compact_dropped);
+    PRINT_DEBUG("timers: %llu expired, %zu scheduled, %llu connections visited",
+        counters.timers_expired, timers.size(), counters.connections_visited);
+
+    // oneof field number of the message type (see net.proto) = sent/received
+    std::string messages{};
+    for (unsigned i = 0; i < Network_Counters::MESSAGE_TYPES; ++i) {
+        if (!counters.messages_sent[i] && !counters.messages_received[i]) continue;
+        messages += " " + std::to_string(i) + "=" + std::to_string(counters.messages_sent[i]) + "/" + std::to_string(counters.messages_received[i]);
+        if (counters.compression_bytes_in[i]) {
+            messages += " (compressed to " + std::to_string(counters.compression_bytes_out[i] * 100 / counters.compression_bytes_in[i]) + "%)";
+        }
+    }
+
+    PRINT_DEBUG("messages sent/received per type:%s", messages.c_str());
+}
+
+struct Network_Counters Networking::getCounters()
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return counters;
+}
+
+bool Networking::use_fragments(size_t size, const Connection *conn) const
+{
+    return size > FRAGMENT_MTU && size <= MAX_FRAGMENTED_SIZE && (conn->capabilities & Announce::FRAGMENTS);
+}
+
+void Networking::send_fragmented(const std::string &serialized, Connection *conn)
+{
+    uint32 count = (uint32)((serialized.size() + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE);
+    // the receiver only needs a source id to find the connection, all our ids belong to the same one
+    Common_Message msg;
+    msg.set_source_id(ids.front().ConvertToUint64());
+    Fragment *fragment = msg.mutable_fragment();
+    fragment->set_message_id(++next_fragment_id);
+    fragment->set_count(count);
+
+    std::string buffer{};
+    for (uint32 i = 0; i < count; ++i) {
+        size_t offset = (size_t)i * FRAGMENT_DATA_SIZE;
+        fragment->set_index(i);
+        fragment->set_data(serialized.data() + offset, std::min((size_t)FRAGMENT_DATA_SIZE, serialized.size() - offset));
+        msg.SerializeToString(&buffer);
+        udp_batch.add(conn->udp_ip_port, buffer.data(), buffer.size());
+    }
+
+    PRINT_DEBUG("sent message %u of %zu bytes in %u fragments", fragment->message_id(), serialized.size(), count);
+    ++counters.fragmented_messages_sent;
+    counters.fragments_sent += count;
+}
+
+void Networking::handle_fragment(Common_Message *msg, IP_PORT ip_port)
+{
+    ++counters.fragments_received;
+
+    const Fragment &fragment = msg->fragment();
+    Connection *conn = find_connection((uint64)msg->source_id());
+    size_t reserve = (size_t)fragment.count() * FRAGMENT_DATA_SIZE;
+    if (!conn || !fragment.count() || fragment.index() >= fragment.count() || fragment.data().empty() || reserve > (MAX_FRAGMENTED_SIZE + FRAGMENT_DATA_SIZE)) {
+        ++counters.fragments_dropped;
+        return;
+    }
+
+    auto it = conn->fragments.find(fragment.message_id());
+    if (it == conn->fragments.end()) {
+        // ids only go up, the first one is the oldest
+        while (!conn->fragments.empty() &&
+            (conn->fragments.size() >= MAX_PENDING_FRAGMENTED || conn->fragments_reserved + reserve > MAX_FRAGMENTS_RESERVED)) {
+            auto oldest = conn->fragments.begin();
+            conn->fragments_reserved -= oldest->second.reserved;
+            conn->fragments.erase(oldest);
+            ++counters.fragmented_messages_incomplete;
+        }
+
+        struct Fragmented_Message pending{};
+        pending.parts.resize(fragment.count());
+        pending.reserved = reserve;
+        pending.first_received = std::chrono::high_resolution_clock::now();
+        conn->fragments_reserved += reserve;
+        schedule_connection_timer(*conn, conn->fragments_timer, TIMER_FRAGMENTS, pending.first_received + timer_duration(FRAGMENTS_TIMEOUT));
+        it = conn->fragments.emplace(fragment.message_id(), std::move(pending)).first;
+    }
+
+    struct Fragmented_Message &pending = it->second;
+    if (pending.parts.size() != fragment.count() || !pending.parts[fragment.index()].empty()) {
+        ++counters.fragments_dropped;
+        return;
+    }
+
+    pending.parts[fragment.index()] = fragment.data();
+    if (++pending.received < pending.parts.size()) return;
+
+    std::string serialized{};
+    serialized.reserve(pending.reserved);
+    for (auto &part : pending.parts) serialized += part;
+    conn->fragments_reserved -= pending.reserved;
+    conn->fragments.erase(it);
+
+    Common_Message *reassembled = parsed_message();
+    if (!reassembled->ParseFromString(serialized) || !reassembled->source_id() ||
+        reassembled->has_fragment() || reassembled->has_announce() || reassembled->has_low_level()) {
+        ++counters.fragments_dropped;
+        return;
+    }
+
+    ++counters.fragmented_messages_received;
+    receive_message(reassembled, ip_port);
+}
+
+void Networking::expire_fragments(Connection &conn)
+{
+    auto next = std::chrono::high_resolution_clock::time_point::max();
+    auto it = conn.fragments.begin();
+    while (it != conn.fragments.end()) {
+        if (check_timedout(it->second.first_received, FRAGMENTS_TIMEOUT)) {
+            PRINT_DEBUG("fragmented message %u timed out, got %u/%zu fragments", it->first, it->second.received, it->second.parts.size());
+            conn.fragments_reserved -= it->second.reserved;
+            it = conn.fragments.erase(it);
+            ++counters.fragmented_messages_incomplete;
+        } else {
+            next = std::min(next, it->second.first_received);
+            ++it;
+        }
+    }
+
+    if (next != std::chrono::high_resolution_clock::time_point::max()) {
+        schedule_connection_timer(conn, conn.fragments_timer, TIMER_FRAGMENTS, next + timer_duration(FRAGMENTS_TIMEOUT));
+    }
+}
+
+void Networking::receive_message(Common_Message *msg, IP_PORT ip_port)
+{
+    size_t size = msg->ByteSizeLong();
+    if (msg->has_compressed() && !decompress_message(msg)) return;
+    count_received(msg, size);
+
+    msg->set_source_ip(ntohl(ip_port.ip));
+    msg->set_source_port(ntohs(ip_port.port));
+    if (msg->has_ack()) {
+        handle_ack(msg);
+    } else if (msg->reliable_seq()) {
+        handle_reliable(msg);
+    } else {
+        deliver_message(msg);
+    }
+}
+
+/*
+ * Reliable UDP
+ *
+ * Reliable messages normally go through the TCP sockets of the connection, where a single lost
+ * segment stalls everything sent to that peer. When enabled and supported by the peer, they are
+ * sent over UDP instead with a sequence number per Common_Message oneof case (channel), so a
+ * stalled lobby update can't hold back game packets.
+ * The receiver delivers every channel in order and acknowledges the received messages
+ * (cumulative + selective ranges) once per run. Lost messages are retransmitted after the
+ * retransmission timeout (RFC 6298) or after 3 acks which acknowledged later messages.
+ * Sending is limited by an AIMD congestion window and paced over the round trip time.
+ * Messages too big to be fragmented and the unacknowledged messages of a peer which stopped
+ * answering are sent over TCP with their sequence number, the receiver still orders them.
+ */
+
+static void reliable_rtt_sample(struct Reliable_UDP &state, double rtt)
+{
+    constexpr const static double CLOCK_GRANULARITY = 0.001;
+    if (!state.rtt_sampled) {
+        state.srtt = rtt;
+        state.rttvar = rtt / 2;
+        state.rtt_sampled = true;
+    } else {
+        state.rttvar = 0.75 * state.rttvar + 0.25 * std::abs(state.srtt - rtt);
+        state.srtt = 0.875 * state.srtt + 0.125 * rtt;
+    }
+
+    state.rto = std::min(RELIABLE_MAX_RTO, std::max(RELIABLE_MIN_RTO, state.srtt + std::max(CLOCK_GRANULARITY, 4 * state.rttvar)));
+}
+
+bool Networking::use_reliable_udp(const Connection *conn) const
+{
+    constexpr const static uint32 needed = Announce::FRAGMENTS | Announce::RELIABLE_UDP;
+    return reliable_udp_enabled && conn->udp_pinged && !conn->reliable_udp.failed && (conn->capabilities & needed) == needed;
+}
+
+void Networking::send_reliable(std::string &&serialized, int channel, Connection *conn)
+{
+    struct Reliable_Send_Channel &send = conn->reliable_udp.send[channel];
+    struct Reliable_Packet packet{};
+    packet.seq = send.next_seq++;
+
+    char seq_field[16];
+    serialized.append(seq_field, encode_varint_field(seq_field, Common_Message::kReliableSeqFieldNumber, packet.seq));
+    packet.serialized = std::move(serialized);
+    ++counters.reliable_sent;
+
+    if (packet.serialized.size() > MAX_FRAGMENTED_SIZE) {
+        send_reliable_tcp(packet, conn);
+        return;
+    }
+
+    send.waiting.push_back(std::move(packet));
+    send_reliable_waiting(*conn);
+}
+
+void Networking::send_reliable_packet(struct Reliable_Packet &packet, Connection *conn)
+{
+    packet.sent = std::chrono::high_resolution_clock::now();
+    packet.missing_reports = 0;
+    ++packet.transmissions;
+    schedule_connection_timer(*conn, conn->reliable_timer, TIMER_RELIABLE, packet.sent + timer_duration(conn->reliable_udp.rto));
+
+    if (use_fragments(packet.serialized.size(), conn)) {
+        send_fragmented(packet.serialized, conn);
+    } else {
+        udp_batch.add(conn->udp_ip_port, packet.serialized.data(), packet.serialized.size());
+    }
+}
+
+void Networking::send_reliable_tcp(const struct Reliable_Packet &packet, Connection *conn)
+{
+    send_tcp(*conn, packet.serialized);
+}
+
+// false when the connection has no TCP socket to send on
+bool Networking::send_tcp(Connection &conn, const std::string &serialized)
+{
+    if (impaired_tcp_send(conn)) return delay_tcp_send(conn, std::string(serialized));
+
+    struct TCP_Socket *socket = tcp_send_socket(conn);
+    if (!socket) return false;
+
+    send_serialized_tcp(*socket, serialized);
+    poll_writable(conn, *socket);
+    return true;
+}
+
+void Networking::send_reliable_waiting(Connection &conn)
+{
+    struct Reliable_UDP &state = conn.reliable_udp;
+    auto now = std::chrono::high_resolution_clock::now();
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(now - state.last_pacing).count();
+    state.last_pacing = now;
+
+    // spread a window of packets over a round trip, bursts are limited to half a window
+    double rtt = std::max(0.001, state.rtt_sampled ? state.srtt : state.rto);
+    double burst = std::max(RELIABLE_INITIAL_CWND, state.cwnd / 2);
+    state.pacing_tokens = std::min(burst, state.pacing_tokens + elapsed * (state.cwnd / rtt));
+
+    // one packet per channel at a time, a busy channel can't starve the others
+    bool sent = true;
+    while (sent) {
+        sent = false;
+        for (auto &channel : state.send) {
+            struct Reliable_Send_Channel &send = channel.second;
+            if (send.waiting.empty()) continue;
+            if (state.in_flight >= state.cwnd) return;
+            if (state.pacing_tokens < 1.0) {
+                // come back once the next token is there, a full window is released by the acks
+                schedule_connection_timer(conn, conn.reliable_timer, TIMER_RELIABLE, now + timer_duration((1.0 - state.pacing_tokens) * rtt / state.cwnd));
+                return;
+            }
+
+            uint32 seq = send.waiting.front().seq;
+            struct Reliable_Packet &packet = send.unacked.emplace(seq, std::move(send.waiting.front())).first->second;
+            send.waiting.pop_front();
+            send_reliable_packet(packet, &conn);
+            ++state.in_flight;
+            state.pacing_tokens -= 1.0;
+            sent = true;
+        }
+    }
+}
+
+void Networking::send_acks()
+{
+    // the ones which can't be sent yet wait for the next run
+    size_t kept = 0;
+    for (uint64 serial : acks_pending) {
+        auto found = connections_by_serial.find(serial);
+        if (found == connections_by_serial.end()) continue;
+
+        Connection &conn = *found->second;
+        struct Reliable_UDP &state = conn.reliable_udp;
+        if (!state.ack_pending) continue;
+        if (!conn.udp_pinged) {
+            acks_pending[kept++] = serial;
+            continue;
+        }
+
+        Common_Message msg;
+        msg.set_source_id(ids.front().ConvertToUint64());
+        Ack *ack = msg.mutable_ack();
+        for (auto &channel : state.recv) {
+            struct Reliable_Recv_Channel &recv = channel.second;
+            if (!recv.ack_pending) continue;
+
+            Ack_Channel *ack_channel = ack->add_channels();
+            ack_channel->set_channel(channel.first);
+            ack_channel->set_cumulative(recv.next_seq - 1);
+
+            unsigned int ranges = 0;
+            auto it = recv.out_of_order.begin();
+            while (it != recv.out_of_order.end() && ranges < RELIABLE_MAX_SACK_RANGES) {
+                uint32 start = it->first, end = it->first;
+                while (++it != recv.out_of_order.end() && it->first == end + 1) ++end;
+                ack_channel->add_sack(start);
+                ack_channel->add_sack(end);
+                ++ranges;
+            }
+
+            recv.ack_pending = false;
+        }
+
+        std::string buffer = msg.SerializeAsString();
+        udp_batch.add(conn.udp_ip_port, buffer.data(), buffer.size());
+        state.ack_pending = false;
+        ++counters.acks_sent;
+    }
+
+    acks_pending.resize(kept);
+}
+
+void Networking::run_reliable_udp(Connection &conn)
+{
+    struct Reliable_UDP &state = conn.reliable_udp;
+    if (state.failed) return;
+
+    auto now = std::chrono::high_resolution_clock::now();
+    bool timed_out = false;
+    for (auto &channel : state.send) {
+        for (auto &unacked : channel.second.unacked) {
+            struct Reliable_Packet &packet = unacked.second;
+            if (std::chrono::duration_cast<std::chrono::duration<double>>(now - packet.sent).count() < state.rto) continue;
+
+            if (packet.transmissions >= RELIABLE_MAX_TRANSMISSIONS) {
+                // the peer stopped answering on UDP, hand everything over to TCP in order
+                PRINT_DEBUG("reliable udp failed for user %llu, falling back to TCP", conn.ids.size() ? conn.ids[0].ConvertToUint64() : 0ULL);
+                for (auto &channel : state.send) {
+                    for (auto &unacked : channel.second.unacked) send_reliable_tcp(unacked.second, &conn);
+                    for (auto &waiting : channel.second.waiting) send_reliable_tcp(waiting, &conn);
+                }
+
+                state.send.clear();
+                state.in_flight = 0;
+                state.failed = true;
+                ++counters.reliable_fallbacks;
+                return;
+            }
+
+            send_reliable_packet(packet, &conn);
+            ++counters.reliable_retransmits;
+            timed_out = true;
+        }
+    }
+
+    if (timed_out) {
+        state.rto = std::min(RELIABLE_MAX_RTO, state.rto * 2);
+        state.ssthresh = std::max(2.0, state.cwnd / 2);
+        state.cwnd = 1.0;
+        state.recovery_end = now + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::duration<double>(state.rto));
+    }
+
+    // the next retransmission, the rto might have changed since the packets were sent
+    auto next = std::chrono::high_resolution_clock::time_point::max();
+    for (auto &channel : state.send) {
+        for (auto &unacked : channel.second.unacked) next = std::min(next, unacked.second.sent);
+    }
+
+    if (next != std::chrono::high_resolution_clock::time_point::max()) {
+        schedule_timer(conn.reliable_timer, (conn.serial << TIMER_KIND_BITS) | TIMER_RELIABLE, next + timer_duration(state.rto));
+    }
+
+    send_reliable_waiting(conn);
+}
+
+void Networking::handle_ack(Common_Message *msg)
+{
+    Connection *conn = find_connection((uint64)msg->source_id());
+    if (!conn) return;
+
+    struct Reliable_UDP &state = conn->reliable_udp;
+    auto now = std::chrono::high_resolution_clock::now();
+    bool lost = false;
+
+    auto acknowledged = [&](std::map<uint32, struct Reliable_Packet> &unacked, std::map<uint32, struct Reliable_Packet>::iterator it) {
+        // Karn's algorithm: the rtt of a retransmitted packet is ambiguous
+        if (it->second.transmissions == 1) {
+            reliable_rtt_sample(state, std::chrono::duration_cast<std::chrono::duration<double>>(now - it->second.sent).count());
+        }
+
+        if (state.in_flight) --state.in_flight;
+        if (state.cwnd < state.ssthresh) {
+            state.cwnd += 1.0;
+        } else {
+            state.cwnd += 1.0 / state.cwnd;
+        }
+
+        state.cwnd = std::min(state.cwnd, (double)RELIABLE_RECV_WINDOW);
+        return unacked.erase(it);
+    };
+
+    for (auto &ack_channel : msg->ack().channels()) {
+        auto channel = state.send.find(ack_channel.channel());
+        if (channel == state.send.end()) continue;
+
+        auto &unacked = channel->second.unacked;
+        auto it = unacked.begin();
+        while (it != unacked.end() && it->first <= ack_channel.cumulative()) {
+            it = acknowledged(unacked, it);
+        }
+
+        uint32 highest = ack_channel.cumulative();
+        for (int i = 0; i + 1 < ack_channel.sack_size(); i += 2) {
+            uint32 start = ack_channel.sack(i), end = ack_channel.sack(i + 1);
+            it = unacked.lower_bound(start);
+            while (it != unacked.end() && it->first <= end) {
+                it = acknowledged(unacked, it);
+            }
+
+            highest = std::max(highest, end);
+        }
+
+        // later packets made it, these ones were probably lost
+        for (auto &unacked_packet : unacked) {
+            if (unacked_packet.first >= highest) break;
+            if (++unacked_packet.second.missing_reports == RELIABLE_FAST_RETRANSMIT_REPORTS) {
+                send_reliable_packet(unacked_packet.second, conn);
+                ++counters.reliable_fast_retransmits;
+                lost = true;
+            }
+        }
+    }
+
+    if (lost && now >= state.recovery_end) {
+        state.ssthresh = std::max(2.0, state.cwnd / 2);
+        state.cwnd = state.ssthresh;
+        state.recovery_end = now + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::duration<double>(state.srtt));
+    }
+
+    send_reliable_waiting(*conn);
+}
+
+void Networking::handle_reliable(Common_Message *msg)
+{
+    Connection *conn = find_connection((uint64)msg->source_id());
+    if (!conn) return;
+
+    struct Reliable_Recv_Channel &recv = conn->reliable_udp.recv[msg->messages_case()];
+    uint32 seq = msg->reliable_seq();
+    recv.ack_pending = true;
+    if (!conn->reliable_udp.ack_pending) acks_pending.push_back(conn->serial);
+    conn->reliable_udp.ack_pending = true;
+
+    if (seq < recv.next_seq) {
+        ++counters.reliable_duplicates;
+        return;
+    }
+
+    // too far ahead, the sender will retransmit it
+    if (seq - recv.next_seq >= RELIABLE_RECV_WINDOW) return;
+
+    if (seq > recv.next_seq) {
+        if (!recv.out_of_order.emplace(seq, std::move(*msg)).second) ++counters.reliable_duplicates;
+        return;
+    }
+
+    deliver_message(msg);
+    ++recv.next_seq;
+
+    auto it = recv.out_of_order.begin();
+    while (it != recv.out_of_order.end() && it->first == recv.next_seq) {
+        deliver_message(&it->second);
+        ++recv.next_seq;
+        it = recv.out_of_order.erase(it);
+    }
+}
+
+bool Networking::use_coalescing(size_t size, const Connection *conn) const
+{
+    return coalesce_delay_ms && (conn->capabilities & Announce::BATCHES) && (BATCH_OVERHEAD + BATCH_ENTRY_OVERHEAD + size) <= FRAGMENT_MTU;
+}
+
+void Networking::coalesce(std::string &&serialized, Connection *conn, bool flush)
+{
+    size_t entry_size = serialized.size() + BATCH_ENTRY_OVERHEAD;
+    if (conn->coalesced.messages_size() && (BATCH_OVERHEAD + conn->coalesced_size + entry_size) > FRAGMENT_MTU) {
+        flush_coalesced(*conn);
+    }
+
+    if (!conn->coalesced.messages_size()) {
+        conn->coalesced_since = std::chrono::high_resolution_clock::now();
+        schedule_connection_timer(*conn, conn->coalesce_timer, TIMER_COALESCE, conn->coalesced_since + std::chrono::milliseconds(coalesce_delay_ms));
+    }
+
+    conn->coalesced.add_messages(std::move(serialized));
+    conn->coalesced_size += entry_size;
+    if (flush) flush_coalesced(*conn);
+}
+
+void Networking::flush_coalesced(Connection &conn)
+{
+    int count = conn.coalesced.messages_size();
+    if (!count) return;
+
+    if (count == 1) {
+        // nothing to pack it with, send it as is
+        const std::string &serialized = conn.coalesced.messages(0);
+        udp_batch.add(conn.udp_ip_port, serialized.data(), serialized.size());
+    } else {
+        Common_Message msg;
+        msg.set_source_id(ids.front().ConvertToUint64());
+        msg.mutable_batch()->Swap(&conn.coalesced);
+        std::string buffer = msg.SerializeAsString();
+        udp_batch.add(conn.udp_ip_port, buffer.data(), buffer.size());
+        ++counters.coalesced_batches_sent;
+        counters.coalesced_messages_sent += count;
+    }
+
+    conn.coalesced.Clear();
+    conn.coalesced_size = 0;
+}
+
+void Networking::flush_coalesced_timer(Connection &conn)
+{
+    if (!conn.coalesced.messages_size()) return;
+
+    // the batch was flushed and a new one started since the timer was set
+    if (!check_timedout(conn.coalesced_since, coalesce_delay_ms / 1000.0)) {
+        schedule_connection_timer(conn, conn.coalesce_timer, TIMER_COALESCE, conn.coalesced_since + std::chrono::milliseconds(coalesce_delay_ms));
+        return;
+    }
+
+    flush_coalesced(conn);
+}
+
+void Networking::handle_batch(Common_Message *msg, IP_PORT ip_port)
+{
+    ++counters.coalesced_batches_received;
+    for (auto &serialized : msg->batch().messages()) {
+        if (!serialized.empty() && (serialized[0] & 7) == 7) {
+            handle_compact(serialized.data(), serialized.size(), ip_port);
+            continue;
+        }
+
+        Common_Message *unpacked = parsed_message();
+        if (!unpacked->ParseFromString(serialized) || !unpacked->source_id()) continue;
+        if (unpacked->has_announce() || unpacked->has_low_level() || unpacked->has_batch()) continue;
+
+        if (unpacked->has_fragment()) {
+            handle_fragment(unpacked, ip_port);
+        } else {
+            receive_message(unpacked, ip_port);
+        }
+    }
+}
+
+/*
+ * Compact data packets
+ *
+ * The game data, Network_pb, Networking_Sockets and Networking_Messages DATA, sent unreliably over
+ * UDP (alone or in a Batch) to a peer which advertised Announce::COMPACT_DATA skips the protobuf
+ * envelope and uses a fixed header instead, little endian:
+ *   COMPACT_MAGIC (1 byte) | Compact_Kind (1) | compact_id of the sender (4) | source index (1) | dest index (1)
+ *   COMPACT_NETWORK:  channel (4)
+ *   COMPACT_SOCKETS:  connection_id (4) | connection_id_from (4) | message_number (8)
+ *   COMPACT_MESSAGES: channel (4) | id_from (4)
+ * followed by the payload up to the end of the datagram or Batch entry.
+ * The magic is the version with the protobuf wire type 7, which doesn't exist, in the low bits,
+ * a compact packet is never mistaken for a Common_Message. The receiver finds the connection with
+ * the compact_id the sender put in its announces, and the steam ids with the indexes in the
+ * Announce.ids lists of the sender (source) and of the receiver (dest).
+ * The virtual and real ports of Networking_Sockets DATA aren't sent, they're only used to open
+ * the connection.
+ *
+ * Per packet overhead, for individual account steam ids, a payload under 128 bytes, small
+ * connection ids and channels, and a P2P Networking_Sockets connection (real_port -1):
+ *   Network_pb          24 bytes of protobuf -> 12 bytes
+ *   Networking_Sockets  44 bytes of protobuf -> 24 bytes
+ *   Networking_Messages 28 bytes of protobuf -> 16 bytes
+ * The reliable messages, the ones compressed, fragmented or sent through shared memory and all
+ * the control traffic still use protobuf.
+ */
+
+enum Compact_Kind {
+    COMPACT_NETWORK = 1,
+    COMPACT_SOCKETS = 2,
+    COMPACT_MESSAGES = 3,
+};
+
+static size_t put_le(char *out, uint64 value, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; ++i) {
+        out[i] = (char)(value >> (i * 8));
+    }
+
+    return bytes;
+}
+
+static uint64 get_le(const char *in, unsigned bytes)
+{
+    uint64 value = 0;
+    for (unsigned i = 0; i < bytes; ++i) {
+        value |= (uint64)(uint8)in[i] << (i * 8);
+    }
+
+    return value;
+}
+
+bool Networking::encode_compact(Common_Message *msg, const Connection *conn, std::string &out)
+{
+    if (!(conn->capabilities & Announce::COMPACT_DATA) || msg->reliable_seq()) return false;
+
+    auto source = std::find(ids.begin(), ids.end(), CSteamID((uint64)msg->source_id()));
+    auto dest = std::find(conn->peer_ids.begin(), conn->peer_ids.end(), (uint64)msg->dest_id());
+    if (source == ids.end() || dest == conn->peer_ids.end()) return false;
+
+    size_t source_index = source - ids.begin();
+    size_t dest_index = dest - conn->peer_ids.begin();
+    if (source_index > 0xFF || dest_index > 0xFF) return false;
+
+    char header[COMPACT_MAX_HEADER_SIZE];
+    size_t header_size = COMPACT_HEADER_SIZE;
+    const std::string *data = nullptr;
+    switch (msg->messages_case()) {
+    case Common_Message::kNetwork:
+        if (msg->network().type() != Network_pb::DATA) return false;
+        header[1] = COMPACT_NETWORK;
+        header_size += put_le(header + header_size, msg->network().channel(), 4);
+        data = &msg->network().data();
+        break;
+
+    case Common_Message::kNetworkingSockets: {
+        const Networking_Sockets &sockets = msg->networking_sockets();
+        if (sockets.type() != Networking_Sockets::DATA) return false;
+        if (sockets.connection_id() > UINT32_MAX || sockets.connection_id_from() > UINT32_MAX) return false;
+        header[1] = COMPACT_SOCKETS;
+        header_size += put_le(header + header_size, sockets.connection_id(), 4);
+        header_size += put_le(header + header_size, sockets.connection_id_from(), 4);
+        header_size += put_le(header + header_size, sockets.message_number(), 8);
+        data = &sockets.data();
+        break;
+    }
+
+    case Common_Message::kNetworkingMessages:
+        if (msg->networking_messages().type() != Networking_Messages::DATA) return false;
+        header[1] = COMPACT_MESSAGES;
+        header_size += put_le(header + header_size, msg->networking_messages().channel(), 4);
+        header_size += put_le(header + header_size, msg->networking_messages().id_from(), 4);
+        data = &msg->networking_messages().data();
+        break;
+
+    default:
+        return false;
+    }
+
+    header[0] = COMPACT_MAGIC;
+    put_le(header + 2, compact_id, 4);
+    header[6] = (char)source_index;
+    header[7] = (char)dest_index;
+
+    out.reserve(header_size + data->size());
+    out.assign(header, header_size);
+    out.append(*data);
+    ++counters.compact_sent;
+    return true;
+}
+
+std::string Networking::serialize_unreliable(Common_Message *msg, const Connection *conn)
+{
+    std::string serialized;
+    if (!encode_compact(msg, conn, serialized)) msg->SerializeToString(&serialized);
+    return serialized;
+}
+
+void Networking::handle_compact(const char *data, size_t len, IP_PORT ip_port)
+{
+    if (len < COMPACT_HEADER_SIZE || (uint8)data[0] != COMPACT_MAGIC) {
+        PRINT_DEBUG("unsupported compact packet, version %u", (unsigned)((uint8)data[0] >> 3));
+        ++counters.compact_dropped;
+        return;
+    }
+
+    // the peer's address is checked too, ids are random and could be the same
+    auto entry = connections_by_compact_id.find((uint32)get_le(data + 2, 4));
+    if (entry == connections_by_compact_id.end() || entry->second->udp_ip_port.ip != ip_port.ip || entry->second->udp_ip_port.port != ip_port.port) {
+        ++counters.compact_dropped;
+        return;
+    }
+
+    Connection *conn = entry->second;
+    uint8 source_index = (uint8)data[6], dest_index = (uint8)data[7];
+    if (source_index >= conn->peer_ids.size() || dest_index >= ids.size()) {
+        // announces with the new ids not received yet
+        ++counters.compact_dropped;
+        return;
+    }
+
+    Common_Message *msg = parsed_message();
+    msg->set_source_id(conn->peer_ids[source_index]);
+    msg->set_dest_id(ids[dest_index].ConvertToUint64());
+    const char *fields = data + COMPACT_HEADER_SIZE;
+    size_t fields_size = 0;
+    switch (data[1]) {
+    case COMPACT_NETWORK:
+        fields_size = 4;
+        if (len < COMPACT_HEADER_SIZE + fields_size) break;
+        msg->mutable_network()->set_type(Network_pb::DATA);
+        msg->mutable_network()->set_channel((uint32)get_le(fields, 4));
+        msg->mutable_network()->set_data(fields + fields_size, len - COMPACT_HEADER_SIZE - fields_size);
+        break;
+
+    case COMPACT_SOCKETS:
+        fields_size = 16;
+        if (len < COMPACT_HEADER_SIZE + fields_size) break;
+        msg->mutable_networking_sockets()->set_type(Networking_Sockets::DATA);
+        msg->mutable_networking_sockets()->set_connection_id(get_le(fields, 4));
+        msg->mutable_networking_sockets()->set_connection_id_from(get_le(fields + 4, 4));
+        msg->mutable_networking_sockets()->set_message_number(get_le(fields + 8, 8));
+        msg->mutable_networking_sockets()->set_data(fields + fields_size, len - COMPACT_HEADER_SIZE - fields_size);
+        break;
+
+    case COMPACT_MESSAGES:
+        fields_size = 8;
+        if (len < COMPACT_HEADER_SIZE + fields_size) break;
+        msg->mutable_networking_messages()->set_type(Networking_Messages::DATA);
+        msg->mutable_networking_messages()->set_channel((uint32)get_le(fields, 4));
+        msg->mutable_networking_messages()->set_id_from((uint32)get_le(fields + 4, 4));
+        msg->mutable_networking_messages()->set_data(fields + fields_size, len - COMPACT_HEADER_SIZE - fields_size);
+        break;
+    }
+
+    if (msg->messages_case() == Common_Message::MESSAGES_NOT_SET) {
+        ++counters.compact_dropped;
+        return;
+    }
+
+    ++counters.compact_received;
+    conn->stats.received(msg->messages_case(), len);
+    msg->set_source_ip(ntohl(ip_port.ip));
+    msg->set_source_port(ntohs(ip_port.port));
+    deliver_message(msg);
+}
+
+void Connection_Stats::sent(int type, size_t size)
+{
+    ++packets_sent;
+    bytes_sent += size;
+    ++packets_sent_by_type[type];
+    bytes_sent_by_type[type] += size;
+}
+
+void Connection_Stats::received(int type, size_t size)
+{
+    ++packets_received;
+    bytes_received += size;
+    ++packets_received_by_type[type];
+    bytes_received_by_type[type] += size;
+}
+
+void Connection_Stats::rtt_sample(double rtt)
+{
+    if (!rtt_sampled) {
+        rtt_ms = rtt;
+        rtt_sampled = true;
+    } else {
+        jitter_ms += (std::abs(rtt - last_rtt_ms) - jitter_ms) / 16.0;
+        rtt_ms = 0.875 * rtt_ms + 0.125 * rtt;
+    }
+
+    last_rtt_ms = rtt;
+}
+
+void Connection_Stats::update_rates(double elapsed)
+{
+    out_packets_per_sec = (packets_sent - rates_packets_sent) / elapsed;
+    out_bytes_per_sec = (bytes_sent - rates_bytes_sent) / elapsed;
+    in_packets_per_sec = (packets_received - rates_packets_received) / elapsed;
+    in_bytes_per_sec = (bytes_received - rates_bytes_received) / elapsed;
+    rates_packets_sent = packets_sent;
+    rates_bytes_sent = bytes_sent;
+    rates_packets_received = packets_received;
+    rates_bytes_received = bytes_received;
+}
+
+void Networking::run_stats(Connection &conn)
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    bool pinging = conn.udp_pinged && !check_timedout(conn.stats_wanted, STATS_WANTED_TIMEOUT);
+    if (pinging && check_timedout(conn.last_ping_sent, PING_INTERVAL)) {
+        Common_Message msg;
+        msg.set_source_id(ids.front().ConvertToUint64());
+        msg.mutable_low_level()->set_type(Low_Level::HEARTBEAT);
+        msg.mutable_low_level()->set_ping_time(ping_clock_us());
+        std::string buffer = msg.SerializeAsString();
+        udp_batch.add(conn.udp_ip_port, buffer.data(), buffer.size());
+        conn.last_ping_sent = now;
+    }
+
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(now - conn.rates_updated).count();
+    if (elapsed >= RATES_INTERVAL) {
+        // the first interval starts when the connection is created
+        if (conn.rates_updated.time_since_epoch().count()) conn.stats.update_rates(elapsed);
+        conn.rates_updated = now;
+    }
+
+    auto next = conn.rates_updated + timer_duration(RATES_INTERVAL);
+    if (pinging) next = std::min(next, conn.last_ping_sent + timer_duration(PING_INTERVAL));
+    schedule_timer(conn.stats_timer, (conn.serial << TIMER_KIND_BITS) | TIMER_STATS, next);
+}
+
+/*
+ * Shared memory transport
+ *
+ * The instances on the same host (same boot id) which enabled it send each other their messages
+ * through shared memory instead of the sockets. When an announce tells that a peer is local,
+ * we create the ring it writes to us, and it opens it once it learned about us the same way.
+ * The records are the same bytes as a UDP datagram, reliable and unreliable messages alike,
+ * the ring is ordered and doesn't lose anything. Announces, heartbeats and acks still use UDP.
+ * A sender only makes a syscall to wake up the receiver when its I/O thread is waiting.
+ *
+ * The reliable messages to a peer keep a single order: once the ring is open they all wait in
+ * shm_pending, the big ones are pushed in chunks, and they only go through the sockets again,
+ * in order, when the impairment is active and the peer read everything from the ring, or when
+ * it closed its ring. Before the ring is used again after reliable messages went through the
+ * sockets, a barrier is pushed in the ring and sent over TCP, the peer stops reading the ring
+ * at the barrier until the TCP one arrived, so it handled everything sent over TCP before.
+ */
+
+void Networking::shm_connect(Connection *conn, uint64 peer_shm_id)
+{
+    // a new peer or a restarted one
+    shm_disconnect(*conn);
+    if (!shm_ring_create(conn->shm_in, shm_ring_name(shm_id, peer_shm_id), SHM_RING_CAPACITY)) {
+        PRINT_DEBUG("failed to create the shared memory ring of %llx, error %i", peer_shm_id, errno);
+        return;
+    }
+
+    conn->shm_id = peer_shm_id;
+    conn->shm_barrier_received = conn->shm_barrier_wait = 0;
+    conn->shm_partial.clear();
+    shm_connections.push_back(conn);
+    schedule_connection_timer(*conn, conn->shm_timer, TIMER_SHM, std::chrono::high_resolution_clock::now());
+    PRINT_DEBUG("peer %llu is on this host, shared memory id %llx", conn->ids[0].ConvertToUint64(), peer_shm_id);
+}
+
+void Networking::shm_disconnect(Connection &conn)
+{
+    shm_ring_close(conn.shm_in);
+    shm_ring_close(conn.shm_out);
+    shm_doorbell_close(conn.shm_out_doorbell);
+    conn.shm_pending.clear();
+    conn.shm_pending_offset = 0;
+    if (conn.shm_id) shm_connections.erase(std::find(shm_connections.begin(), shm_connections.end(), &conn));
+    conn.shm_id = 0;
+}
+
+void Networking::shm_open_out(Connection &conn)
+{
+    if (!conn.shm_id || shm_ring_is_open(conn.shm_out)) return;
+
+    if (!shm_ring_open(conn.shm_out, shm_ring_name(conn.shm_id, shm_id))) {
+        // the peer didn't learn about us yet
+        schedule_connection_timer(conn, conn.shm_timer, TIMER_SHM, std::chrono::high_resolution_clock::now() + timer_duration(SHM_OPEN_RETRY_INTERVAL));
+        return;
+    }
+
+    shm_doorbell_open(conn.shm_out_doorbell, shm_doorbell_name(conn.shm_id));
+    PRINT_DEBUG("sending to %llu through shared memory", conn.ids[0].ConvertToUint64());
+}
+
+bool Networking::shm_send(Connection *conn, const char *prefix, size_t prefix_size, const std::string &data, bool reliable)
+{
+    size_t size = prefix_size + data.size();
+    // the impairment only applies to the sockets
+    if (!reliable && (impairment_enabled || size > SHM_MAX_MESSAGE_SIZE || conn->shm_pending.size())) return false;
+    if (reliable && impairment_enabled && conn->shm_pending.empty() && shm_ring_empty(conn->shm_out)) return false;
+
+    if (!impairment_enabled && !conn->shm_off_ring && conn->shm_pending.empty() && size <= SHM_MAX_MESSAGE_SIZE) {
+        if (shm_ring_push(conn->shm_out, prefix, prefix_size, data)) {
+            ++counters.shm_messages_sent;
+            shm_doorbell_ring(conn->shm_out_doorbell);
+            return true;
+        }
+
+        ++counters.shm_ring_full;
+        if (!reliable) return false;
+    }
+
+    // sending it over TCP could overtake the ones already waiting
+    conn->shm_pending.push_back(std::string(prefix, prefix_size) + data);
+    shm_flush(*conn);
+    return true;
+}
+
+void Networking::shm_flush(Connection &conn)
+{
+    bool pushed = false;
+    while (conn.shm_pending.size()) {
+        // a message already partly in the ring is finished there
+        if (impairment_enabled && !conn.shm_pending_offset) {
+            // after the ones the peer didn't read yet
+            if (shm_ring_is_open(conn.shm_out) && !shm_ring_empty(conn.shm_out)) break;
+            send_tcp(conn, conn.shm_pending.front());
+            conn.shm_pending.pop_front();
+            conn.shm_off_ring = true;
+            continue;
+        }
+
+        if (!shm_ring_is_open(conn.shm_out)) break;
+        if (conn.shm_off_ring && !shm_push_barrier(conn)) break;
+        if (!shm_push_front(conn)) break;
+        pushed = true;
+    }
+
+    if (pushed) shm_doorbell_ring(conn.shm_out_doorbell);
+}
+
+// false when the ring is full, the rest of the message is pushed by the next call
+bool Networking::shm_push_front(Connection &conn)
+{
+    const std::string &message = conn.shm_pending.front();
+    if (message.size() <= SHM_MAX_MESSAGE_SIZE) {
+        if (!shm_ring_push(conn.shm_out, nullptr, 0, message)) return false;
+    } else {
+        std::string piece{};
+        while (conn.shm_pending_offset < message.size()) {
+            size_t piece_size = std::min(message.size() - conn.shm_pending_offset, (size_t)SHM_MAX_MESSAGE_SIZE);
+            char header[SHM_CHUNK_HEADER_SIZE] = {(char)SHM_CHUNK_MAGIC, (char)(conn.shm_pending_offset + piece_size < message.size())};
+            piece.assign(message, conn.shm_pending_offset, piece_size);
+            if (!shm_ring_push(conn.shm_out, header, sizeof(header), piece)) return false;
+
+            conn.shm_pending_offset += piece_size;
+        }
+
+        conn.shm_pending_offset = 0;
+    }
+
+    conn.shm_pending.pop_front();
+    ++counters.shm_messages_sent;
+    return true;
+}
+
+// false while the barrier can't be sent yet
+bool Networking::shm_push_barrier(Connection &conn)
+{
+    // the reliable UDP packets can still be retransmitted, the barrier follows them once they're acknowledged
+    for (auto &channel : conn.reliable_udp.send) {
+        if (channel.second.unacked.size() || channel.second.waiting.size()) return false;
+    }
+
+    // the messages sent over TCP were lost with the sockets
+    if (!tcp_send_socket(conn)) {
+        conn.shm_off_ring = false;
+        return true;
+    }
+
+    uint64 barrier = conn.shm_barrier_sent + 1;
+    char record[1 + sizeof(barrier)];
+    record[0] = (char)SHM_BARRIER_MAGIC;
+    memcpy(record + 1, &barrier, sizeof(barrier));
+    if (!shm_ring_push(conn.shm_out, record, sizeof(record), std::string())) return false;
+
+    Common_Message msg;
+    msg.set_source_id(ids.front().ConvertToUint64());
+    msg.mutable_low_level()->set_type(Low_Level::HEARTBEAT);
+    msg.mutable_low_level()->set_shm_barrier(barrier);
+    send_tcp(conn, msg.SerializeAsString());
+    conn.shm_barrier_sent = barrier;
+    conn.shm_off_ring = false;
+    return true;
+}
+
+void Networking::handle_shm_barrier(Common_Message *msg)
+{
+    Connection *conn = find_connection((uint64)msg->source_id());
+    if (!conn) return;
+
+    conn->shm_barrier_received = std::max(conn->shm_barrier_received, (uint64)msg->low_level().shm_barrier());
+}
+
+// the ring waits for the TCP messages sent before its barrier, not forever if they were lost with the sockets
+static bool shm_barrier_blocked(const Connection &conn)
+{
+    return conn.shm_barrier_wait > conn.shm_barrier_received && !check_timedout(conn.shm_barrier_since, HEARTBEAT_TIMEOUT);
+}
+
+void Networking::run_shm(Connection &conn)
+{
+    if (!conn.shm_id) return;
+
+    if (shm_ring_closed_by_peer(conn.shm_out)) {
+        PRINT_DEBUG("shared memory ring closed by %llx", conn.shm_id);
+        shm_ring_close(conn.shm_out);
+        shm_doorbell_close(conn.shm_out_doorbell);
+        // the waiting messages go through the sockets in order, a partly pushed one entirely
+        for (auto &message : conn.shm_pending) send_tcp(conn, message);
+        if (conn.shm_pending.size()) conn.shm_off_ring = true;
+        conn.shm_pending.clear();
+        conn.shm_pending_offset = 0;
+        schedule_connection_timer(conn, conn.shm_timer, TIMER_SHM, std::chrono::high_resolution_clock::now() + timer_duration(SHM_OPEN_RETRY_INTERVAL));
+    }
+
+    shm_flush(conn);
+
+    IP_PORT ip_port = conn.udp_pinged ? conn.udp_ip_port : conn.tcp_ip_port;
+    std::string data{};
+    // stops if handling a message closed the ring
+    while (shm_ring_is_open(conn.shm_in) && !shm_barrier_blocked(conn) && shm_ring_pop(conn.shm_in, data)) {
+        conn.shm_barrier_wait = 0;
+        uint8 kind = data.size() ? (uint8)data[0] : 0;
+        if (kind == SHM_BARRIER_MAGIC) {
+            if (data.size() < 1 + sizeof(conn.shm_barrier_wait)) continue;
+            memcpy(&conn.shm_barrier_wait, data.data() + 1, sizeof(conn.shm_barrier_wait));
+            conn.shm_barrier_since = std::chrono::high_resolution_clock::now();
+            continue;
+        }
+
+        if (kind == SHM_CHUNK_MAGIC) {
+            if (data.size() < SHM_CHUNK_HEADER_SIZE) continue;
+            conn.shm_partial.append(data, SHM_CHUNK_HEADER_SIZE, std::string::npos);
+            if (data[1]) continue;
+            data.swap(conn.shm_partial);
+            conn.shm_partial.clear();
+        }
+
+        ++counters.shm_messages_received;
+        handle_udp_packet(data.data(), (int)data.size(), ip_port);
+    }
+}
+
+int Networking::shm_wait_ms(int wait_ms)
+{
+    // don't wait if something was written to us, and retry soon when a peer didn't read its ring fast enough
+    for (auto conn : shm_connections) {
+        if (!shm_ring_empty(conn->shm_in) && !shm_barrier_blocked(*conn)) return 0;
+        if (conn->shm_pending.size()) wait_ms = std::min(wait_ms, 1);
+    }
+
+    return wait_ms;
+}
+
+void Networking::count_received(Common_Message *msg, size_t size)
+{
+    Connection *conn = find_connection((uint64)msg->source_id());
+    if (conn) conn->stats.received(msg->messages_case(), size);
+}
+
+bool Networking::getConnectionStats(CSteamID id, struct Connection_Stats &stats)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    Connection *conn = find_connection(id, this->appid);
+    if (!conn) return false;
+
+    // keeps pinging the peer, or starts again
+    conn->stats_wanted = std::chrono::high_resolution_clock::now();
+    schedule_connection_timer(*conn, conn->stats_timer, TIMER_STATS, conn->stats_wanted);
+
+    stats = conn->stats;
+    stats.reliable_unacked_bytes = 0;
+    for (auto &channel : conn->reliable_udp.send) {
+        for (auto &packet : channel.second.unacked) {
+            stats.reliable_unacked_bytes += (uint32)packet.second.serialized.size();
+        }
+    }
+
+    return true;
+}
+
+void Networking::update_impairment_enabled()
+{
+    impairment_enabled = impairment.config.active();
+    for (auto &peer : peer_impairments) {
+        if (peer.second.config.active()) impairment_enabled = true;
+    }
+}
+
+// the global one for the datagrams of unknown peers
+struct Impairment &Networking::impairment_for(IP_PORT ip_port)
+{
+    auto by_ip = connections_by_ip.find(ip_port.ip);
+    if (by_ip == connections_by_ip.end()) return impairment;
+
+    for (auto conn : by_ip->second) {
+        if (conn->udp_ip_port.ip == ip_port.ip && conn->udp_ip_port.port == ip_port.port) return impairment_for(*conn);
+    }
+
+    return impairment;
+}
+
+struct Impairment &Networking::impairment_for(const Connection &conn)
+{
+    for (auto &id : conn.ids) {
+        auto peer = peer_impairments.find(id.ConvertToUint64());
+        if (peer != peer_impairments.end()) return peer->second;
+    }
+
+    if (conn.ids.empty()) return impairment;
+
+    // the global config, but the random numbers of this peer don't depend on the traffic of the others
+    uint64 peer_id = conn.ids[0].ConvertToUint64();
+    auto peer = global_impairments.find(peer_id);
+    if (peer == global_impairments.end()) {
+        peer = global_impairments.emplace(peer_id, Impairment()).first;
+        peer->second.seed(impairment_seed, peer_id);
+        peer->second.config = impairment.config;
+    }
+
+    return peer->second;
+}
+
+void Networking::delay_datagram(Delayed_Datagrams &queue, std::chrono::high_resolution_clock::time_point due, IP_PORT ip_port, std::string &&data)
+{
+    struct Delayed_Datagram delayed{};
+    delayed.due = due;
+    delayed.order = next_delayed_order++;
+    delayed.ip_port = ip_port;
+    delayed.data = std::move(data);
+    queue.push(std::move(delayed));
+}
+
+void Networking::impair_udp_batch()
+{
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    if (impairment_enabled) {
+        size_t kept = 0;
+        for (size_t i = 0; i < udp_batch.entries.size(); ++i) {
+            const auto &entry = udp_batch.entries[i];
+            size_t size = entry.size + (entry.body ? entry.body->size() : 0);
+            struct Impairment &impaired = impairment_for(entry.ip_port);
+            Impairment_Verdict verdict = impaired.send.impair(impaired.config.send, impaired.config, size, false, now);
+            if (verdict.drop) {
+                ++counters.impaired_dropped;
+                continue;
+            }
+
+            if (verdict.duplicate || verdict.delay_ms) {
+                std::string data(&udp_batch.data[entry.offset], entry.size);
+                if (entry.body) data += *entry.body;
+
+                if (verdict.duplicate) {
+                    ++counters.impaired_duplicated;
+                    delay_datagram(delayed_sends, now + std::chrono::milliseconds(verdict.duplicate_delay_ms), entry.ip_port, std::string(data));
+                }
+
+                if (verdict.delay_ms) {
+                    ++counters.impaired_delayed;
+                    delay_datagram(delayed_sends, now + std::chrono::milliseconds(verdict.delay_ms), entry.ip_port, std::move(data));
+                    continue;
+                }
+            }
+
+            if (kept != i) udp_batch.entries[kept] = entry;
+            ++kept;
+        }
+
+        udp_batch.entries.resize(kept);
+    }
+
+    // the ones held back are sent as they are, they were already impaired
+    while (!delayed_sends.empty() && delayed_sends.top().due <= now) {
+        const struct Delayed_Datagram &delayed = delayed_sends.top();
+        udp_batch.add(delayed.ip_port, delayed.data.data(), delayed.data.size());
+        delayed_sends.pop();
+    }
+}
+
+void Networking::impair_received(const char *data, int len, IP_PORT ip_port)
+{
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    struct Impairment &impaired = impairment_for(ip_port);
+    Impairment_Verdict verdict = impaired.recv.impair(impaired.config.recv, impaired.config, (size_t)len, false, now);
+    if (verdict.drop) {
+        ++counters.impaired_dropped;
+        return;
+    }
+
+    if (verdict.duplicate) {
+        ++counters.impaired_duplicated;
+        delay_datagram(delayed_receives, now + std::chrono::milliseconds(verdict.duplicate_delay_ms), ip_port, std::string(data, len));
+    }
+
+    if (verdict.delay_ms) {
+        ++counters.impaired_delayed;
+        delay_datagram(delayed_receives, now + std::chrono::milliseconds(verdict.delay_ms), ip_port, std::string(data, len));
+        return;
+    }
+
+    handle_udp_packet(data, len, ip_port);
+}
+
+void Networking::release_delayed_receives()
+{
+    if (delayed_receives.empty()) return;
+
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    while (!delayed_receives.empty() && delayed_receives.top().due <= now) {
+        // handling it can queue more
+        struct Delayed_Datagram delayed = std::move(const_cast<struct Delayed_Datagram &>(delayed_receives.top()));
+        delayed_receives.pop();
+        handle_udp_packet(delayed.data.data(), (int)delayed.data.size(), delayed.ip_port);
+    }
+}
+
+bool Networking::delay_tcp(Connection &conn, Common_Message *msg, bool incoming)
+{
+    if (!impairment_enabled && conn.tcp_delayed.empty()) return false;
+
+    // TCP is reliable and ordered, it only gets the lag, the jitter and the rate limit
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    struct Impairment &impaired = impairment_for(conn);
+    Impairment_Verdict verdict = impaired.recv.impair(impaired.config.recv, impaired.config, msg->ByteSizeLong(), true, now);
+    std::chrono::high_resolution_clock::time_point due = now + std::chrono::milliseconds(verdict.delay_ms);
+    if (!conn.tcp_delayed.empty()) {
+        due = std::max(due, conn.tcp_delayed.back().due);
+    } else if (!verdict.delay_ms) {
+        return false;
+    }
+
+    ++counters.impaired_delayed;
+    struct Delayed_TCP_Message delayed{};
+    delayed.due = due;
+    delayed.msg = std::move(*msg);
+    delayed.incoming = incoming;
+    conn.tcp_delayed.push_back(std::move(delayed));
+    ++tcp_delayed_messages;
+    schedule_connection_timer(conn, conn.delayed_tcp_timer, TIMER_DELAYED_TCP, due);
+    return true;
+}
+
+void Networking::release_delayed_tcp(Connection &conn)
+{
+    if (conn.tcp_delayed.empty() && conn.tcp_delayed_sends.empty()) return;
+
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    while (!conn.tcp_delayed_sends.empty() && conn.tcp_delayed_sends.front().due <= now) {
+        struct Delayed_TCP_Message delayed = std::move(conn.tcp_delayed_sends.front());
+        conn.tcp_delayed_sends.pop_front();
+        --tcp_delayed_messages;
+        // dropped like the rest of a send queue if the sockets were lost meanwhile
+        struct TCP_Socket *socket = tcp_send_socket(conn);
+        if (socket) {
+            send_serialized_tcp(*socket, delayed.serialized);
+            poll_writable(conn, *socket);
+        }
+    }
+
+    while (!conn.tcp_delayed.empty() && conn.tcp_delayed.front().due <= now) {
+        struct Delayed_TCP_Message delayed = std::move(conn.tcp_delayed.front());
+        conn.tcp_delayed.pop_front();
+        --tcp_delayed_messages;
+        handle_tcp(&delayed.msg, delayed.incoming ? conn.tcp_socket_incoming : conn.tcp_socket_outgoing);
+    }
+
+    if (!conn.tcp_delayed_sends.empty()) schedule_connection_timer(conn, conn.delayed_tcp_timer, TIMER_DELAYED_TCP, conn.tcp_delayed_sends.front().due);
+    if (!conn.tcp_delayed.empty()) schedule_connection_timer(conn, conn.delayed_tcp_timer, TIMER_DELAYED_TCP, conn.tcp_delayed.front().due);
+}
+
+bool Networking::impaired_tcp_send(const Connection &conn) const
+{
+    return impairment_enabled || !conn.tcp_delayed_sends.empty();
+}
+
+bool Networking::delay_tcp_send(Connection &conn, std::string &&serialized)
+{
+    struct TCP_Socket *socket = tcp_send_socket(conn);
+    if (!socket) return false;
+
+    // same as delay_tcp() with the send side of the impairment
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    struct Impairment &impaired = impairment_for(conn);
+    Impairment_Verdict verdict = impaired.send.impair(impaired.config.send, impaired.config, serialized.size(), true, now);
+    std::chrono::high_resolution_clock::time_point due = now + std::chrono::milliseconds(verdict.delay_ms);
+    if (!conn.tcp_delayed_sends.empty()) {
+        due = std::max(due, conn.tcp_delayed_sends.back().due);
+    } else if (!verdict.delay_ms) {
+        send_serialized_tcp(*socket, serialized);
+        poll_writable(conn, *socket);
+        return true;
+    }
+
+    ++counters.impaired_delayed;
+    struct Delayed_TCP_Message delayed{};
+    delayed.due = due;
+    delayed.serialized = std::move(serialized);
+    conn.tcp_delayed_sends.push_back(std::move(delayed));
+    ++tcp_delayed_messages;
+    schedule_connection_timer(conn, conn.delayed_tcp_timer, TIMER_DELAYED_TCP, due);
+    return true;
+}
+
+int Networking::impairment_wait_ms(int wait_ms)
+{
+    std::chrono::high_resolution_clock::time_point due = std::chrono::high_resolution_clock::time_point::max();
+    if (!delayed_sends.empty()) due = std::min(due, delayed_sends.top().due);
+    if (!delayed_receives.empty()) due = std::min(due, delayed_receives.top().due);
+    if (due == std::chrono::high_resolution_clock::time_point::max()) return wait_ms;
+
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::high_resolution_clock::now()).count();
+    return (int)std::max((decltype(remaining))1, std::min((decltype(remaining))wait_ms, remaining));
+}
+
+int Networking::timers_wait_ms(int wait_ms)
+{
+    // the wheel can't expire any of its timers before this
+    std::chrono::high_resolution_clock::time_point due = timers.next_deadline();
+    if (due == std::chrono::high_resolution_clock::time_point::max()) return wait_ms;
+
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::high_resolution_clock::now()).count();
+    return (int)std::max((decltype(remaining))1, std::min((decltype(remaining))wait_ms, remaining));
+}
+
+bool Networking::use_compression(size_t size, const Connection *conn) const
+{
+    return size >= COMPRESSION_MIN_SIZE && (conn->capabilities & Announce::COMPRESSION);
+}
+
+// returns the serialized Compressed message (without dest_id), or nothing when it doesn't shrink
+Wire_Buffer Networking::compress_message(const std::string &serialized, int type)
+{
+    std::string compressed(lz_compress_bound(serialized.size()), '\0');
+    size_t size = lz_compress(serialized.data(), serialized.size(), &compressed[0], compressed.size());
+    // source_id + Compressed field headers
+    if (!size || size + 24 >= serialized.size()) {
+        ++counters.uncompressible_messages;
+        return Wire_Buffer{};
+    }
+
+    compressed.resize(size);
+    Common_Message msg;
+    msg.set_source_id(ids.front().ConvertToUint64());
+    msg.mutable_compressed()->set_size((uint32)serialized.size());
+    msg.mutable_compressed()->set_data(std::move(compressed));
+    Wire_Buffer wire = std::make_shared<const std::string>(msg.SerializeAsString());
+
+    ++counters.compressed_messages;
+    counters.compression_bytes_in[type] += serialized.size();
+    counters.compression_bytes_out[type] += wire->size();
+    return wire;
+}
+
+// the fields of the outer message (dest_id, reliable_seq) are kept
+bool Networking::decompress_message(Common_Message *msg)
+{
+    const Compressed &compressed = msg->compressed();
+    if (compressed.size() > MAX_DECOMPRESSED_SIZE || compressed.size() > compressed.data().size() * MAX_COMPRESSION_RATIO) {
+        ++counters.decompression_errors;
+        return false;
+    }
+
+    decompressed.resize(compressed.size());
+    if (!lz_decompress(compressed.data().data(), compressed.data().size(), &decompressed[0], decompressed.size())) {
+        PRINT_DEBUG("bad compressed message from %llu", (unsigned long long)msg->source_id());
+        ++counters.decompression_errors;
+        return false;
+    }
+
+    msg->clear_compressed();
+    if (!msg->MergeFromString(decompressed) || msg->has_compressed()) {
+        ++counters.decompression_errors;
+        return false;
+    }
+
+    ++counters.decompressed_messages;
+    return true;
+}
+
+void Networking::flushMessages(CSteamID id)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    Connection *conn = find_connection(id, this->appid);
+    if (!conn) return;
+
+    flush_coalesced(*conn);
+    flush_udp_batch();
+}
+
+void Networking::deliver_message(Common_Message *msg)
+{
+    ++counters.messages_received[msg->messages_case()];
+    if (capture.is_open()) capture.write(CAPTURE_RECEIVED, false, msg->SerializeAsString());
+    if (io_thread_active) {
+        // a copy when msg is in the parse arena
+        Received_Message item{};
+        item.msg = std::move(*msg);
+        received.push(std::move(item));
+    } else {
+        do_callbacks_message(msg);
+    }
+}
+
+void Networking::Run()
+{
+    if (io_thread_active) {
+        Received_Message item{};
+        while (received.pop(item)) {
+            if (item.user_status) {
+                run_callbacks(CALLBACK_ID_USER_STATUS, &item.msg);
+            } else {
+                do_callbacks_message(&item.msg);
+            }
+        }
+    } else {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        poll_sockets();
+        run_io();
+    }
+
+    if (!enabled) return;
+
+    run_source_query();
+
+    std::vector<Common_Message> local_send_copy{};
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        local_send_copy.swap(local_send);
+    }
+
+    PRINT_DEBUG("RECV LOCAL %zu", local_send_copy.size());
+    for (auto & m: local_send_copy) {
+        m.set_source_ip(ntohl(own_ip));
+        m.set_source_port(ntohs(udp_port));
+        do_callbacks_message(&m);
+    }
+
+    reset_last_error();
 }
 
-void Networking::send_announce_broadcasts()
+void Networking::startIOThread()
 {
-    Common_Message msg = create_announce(true);
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (!enabled || io_thread_active) return;
 
-    size_t size = msg.ByteSizeLong(); 
-    std::vector<char> buffer(size);
-    msg.SerializeToArray(&buffer[0], size);
-    send_broadcasts(udp_socket, htons(DEFAULT_PORT), &buffer[0], size, &this->custom_broadcasts);
-    if (udp_port != DEFAULT_PORT) {
-        send_broadcasts(udp_socket, htons(udp_port), &buffer[0], size, &this->custom_broadcasts);
+#if defined(__linux__)
+    if (epoll_fd >= 0 && wake_fd < 0) {
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        poll_add(wake_fd);
     }
 
-    last_broadcast = std::chrono::high_resolution_clock::now();
-    PRINT_DEBUG("sent broadcasts");
+    // the source query socket is serviced by Run(), don't let it wake up the I/O thread
+    if (epoll_fd >= 0 && query_alive && is_socket_valid(query_socket)) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, query_socket, nullptr);
+    }
+#endif
+
+    io_thread_kill = false;
+    io_thread_active = true;
+    io_thread = std::thread(&Networking::io_thread_run, this);
+    PRINT_DEBUG("spawned networking I/O thread");
+
+#if defined(__linux__)
+    if (shm_id && wake_fd >= 0) {
+        shm_waiter_kill = false;
+        shm_waiter = std::thread(&Networking::shm_waiter_run, this);
+    }
+#endif
 }
 
-void Networking::Run()
+void Networking::setReliableUDP(bool enable)
 {
-    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
-    double time_extra = std::chrono::duration_cast<std::chrono::duration<double>>(now - last_run).count();
-    last_run = now;
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    reliable_udp_enabled = enable;
+}
 
-    if (!enabled || ids.size() == 0) {
+void Networking::setCoalesceDelay(unsigned delay_ms)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    coalesce_delay_ms = delay_ms;
+}
+
+void Networking::setGossipDiscovery(bool enable)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    gossip_discovery = enable;
+    broadcast_interval = BROADCAST_INTERVAL;
+    if (enable) schedule_timer(legacy_announces_timer, TIMER_LEGACY_ANNOUNCES, std::chrono::high_resolution_clock::now());
+}
+
+void Networking::setSharedMemoryTransport(bool enable)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (!enabled || !enable || shm_id || io_thread_active) return;
+
+    shm_cleanup_stale();
+    uint64 id = shm_new_instance_id();
+    host_id = shm_host_id();
+    if (!id || !host_id || !shm_doorbell_create(shm_doorbell, shm_doorbell_name(id))) {
+        PRINT_DEBUG("shared memory transport not available");
         return;
     }
 
-    //PRINT_DEBUG("%lf", time_extra);
-    // PRINT_DEBUG_ENTRY();
-    if (check_timedout(last_broadcast, BROADCAST_INTERVAL)) {
-        send_announce_broadcasts();
+    shm_id = id;
+    PRINT_DEBUG("shared memory transport enabled, id %llx", shm_id);
+}
+
+void Networking::setImpairmentSeed(uint64 seed)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    impairment_seed = seed;
+    impairment.seed(seed, 0);
+    for (auto &peer : peer_impairments) peer.second.seed(seed, peer.first);
+    for (auto &peer : global_impairments) peer.second.seed(seed, peer.first);
+}
+
+void Networking::setImpairment(const struct Impairment_Config &config, uint64 peer_id)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (peer_id) {
+        auto peer = peer_impairments.find(peer_id);
+        if (peer == peer_impairments.end()) {
+            peer = peer_impairments.emplace(peer_id, Impairment()).first;
+            peer->second.seed(impairment_seed, peer_id);
+        }
+
+        peer->second.config = config;
+    } else {
+        impairment.config = config;
+        for (auto &peer : global_impairments) peer.second.config = config;
     }
 
-    IP_PORT ip_port;
-    char data[MAX_UDP_SIZE];
-    int len;
+    update_impairment_enabled();
+    PRINT_DEBUG("network impairment for %llu: loss %f/%f%%, lag %i/%i ms, jitter %i/%i ms, reorder %f/%f%%, dup %f/%f%%, rate %i/%i bytes/s",
+        peer_id, config.send.loss_pct, config.recv.loss_pct, config.send.lag_ms, config.recv.lag_ms, config.send.jitter_ms, config.recv.jitter_ms,
+        config.send.reorder_pct, config.recv.reorder_pct, config.send.dup_pct, config.recv.dup_pct, config.send.rate, config.recv.rate);
+}
 
-    if (query_alive && is_socket_valid(query_socket)) {
-        PRINT_DEBUG("RECV Source Query");
-        Steam_Client* client = get_steam_client();
-        sockaddr_in addr;
-        addr.sin_family = AF_INET;
+bool Networking::startCapture(const std::string &path)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return capture.open(path, ids.front().ConvertToUint64());
+}
 
-        while ((len = receive_packet(query_socket, &ip_port, data, sizeof(data))) >= 0) {
-            PRINT_DEBUG("requesting Source Query server info from Steam_GameServer");
-            client->steam_gameserver->HandleIncomingPacket(data, len, htonl(ip_port.ip), htons(ip_port.port));
-            len = client->steam_gameserver->GetNextOutgoingPacket(data, sizeof(data), &ip_port.ip, &ip_port.port);
+void Networking::replayMessage(Common_Message *msg, bool user_status)
+{
+    // the I/O thread delivers to the same callbacks
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (user_status) {
+        run_callbacks(CALLBACK_ID_USER_STATUS, msg);
+    } else {
+        ++counters.messages_received[msg->messages_case()];
+        do_callbacks_message(msg);
+    }
+}
 
-            PRINT_DEBUG("sending Source Query server info");
-            addr.sin_addr.s_addr = htonl(ip_port.ip);
-            addr.sin_port        = htons(ip_port.port);
-            sendto(query_socket, data, len, 0, (sockaddr*)&addr, sizeof(addr));
-        }
+Common_Message *Networking::parsed_message()
+{
+    return google::protobuf::Arena::CreateMessage<Common_Message>(parse_arena.get());
+}
+
+void Networking::reset_parse_arena()
+{
+    // nothing to free when it's still empty
+    uint64 used = parse_arena->SpaceUsed();
+    if (!used) return;
+
+    uint64 allocated = parse_arena->Reset();
+    ++counters.parse_arena_resets;
+    if (allocated > PARSE_ARENA_BLOCK_SIZE) ++counters.parse_arena_overflows;
+    counters.parse_arena_peak = std::max(counters.parse_arena_peak, used);
+}
+
+void Networking::capture_sent(Common_Message *msg, bool reliable)
+{
+    if (capture.is_open()) capture.write(CAPTURE_SENT, reliable, msg->SerializeAsString());
+}
+
+void Networking::stopIOThread()
+{
+    if (!io_thread.joinable()) return;
+
+    io_thread_kill = true;
+#if defined(__linux__)
+    if (wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) { }
     }
+#endif
 
-    PRINT_DEBUG("RECV UDP");
-    while((len = receive_packet(udp_socket, &ip_port, data, sizeof(data))) >= 0) {
-        PRINT_DEBUG("recv %i %hhu.%hhu.%hhu.%hhu:%hu", len,
-            ((unsigned char *)&ip_port.ip)[0], ((unsigned char *)&ip_port.ip)[1], ((unsigned char *)&ip_port.ip)[2], ((unsigned char *)&ip_port.ip)[3], htons(ip_port.port));
-        Common_Message msg;
-        if (msg.ParseFromArray(data, len)) {
-            if (msg.source_id()) {
-                if (msg.has_announce()) {
-                    handle_announce(&msg, ip_port);
-                } else if (msg.has_low_level()) {
-                    handle_low_level_udp(&msg, ip_port);
-                } else {
-                    msg.set_source_ip(ntohl(ip_port.ip));
-                    msg.set_source_port(ntohs(ip_port.port));
-                    do_callbacks_message(&msg);
-                }
-            }
+    io_thread.join();
+    io_thread_active = false;
+    PRINT_DEBUG("networking I/O thread stopped");
+
+    if (shm_waiter.joinable()) {
+        shm_waiter_kill = true;
+        shm_doorbell_set_waiting(shm_doorbell, false);
+        shm_doorbell_wake(shm_doorbell);
+        shm_waiter.join();
+    }
+}
+
+void Networking::io_thread_run()
+{
+    // sockets are non blocking, wait for any of them to be readable,
+    // but wake up regularly anyway for the heartbeats, broadcasts and timeouts
+    constexpr const static int IO_THREAD_WAIT_MS = 100;
+
+    int wait_ms = IO_THREAD_WAIT_MS;
+    while (!io_thread_kill) {
+        poll_sockets(wait_ms);
+        if (io_thread_kill) break;
+
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        if (shm_waiter.joinable()) shm_doorbell_set_waiting(shm_doorbell, false);
+        run_io();
+        reset_last_error();
+
+        // coalesced messages must not wait longer than the configured delay
+        wait_ms = coalesce_delay_ms ? std::min(IO_THREAD_WAIT_MS, (int)std::max(1u, coalesce_delay_ms)) : IO_THREAD_WAIT_MS;
+        // and the ones held back by the network impairment must go out on time
+        wait_ms = impairment_wait_ms(wait_ms);
+        // like the retransmissions, pacing, fragments timeouts, pings and everything else on the timer wheel
+        wait_ms = timers_wait_ms(wait_ms);
+
+        // the peers on this host ring the doorbell when they write while we wait,
+        // what they wrote before that is read right away
+        if (shm_waiter.joinable()) {
+            shm_doorbell_set_waiting(shm_doorbell, true);
+            wait_ms = shm_wait_ms(wait_ms);
         }
     }
+}
+
+void Networking::shm_waiter_run()
+{
+    // turns the doorbell rings into wake ups of the I/O thread waiting in poll_sockets()
+    constexpr const static int SHM_WAITER_TIMEOUT_MS = 1000;
+
+    uint32 seq = shm_doorbell_seq(shm_doorbell);
+    while (!shm_waiter_kill) {
+        shm_doorbell_wait(shm_doorbell, seq, SHM_WAITER_TIMEOUT_MS);
+        uint32 current = shm_doorbell_seq(shm_doorbell);
+        if (current == seq || shm_waiter_kill) continue;
+
+        seq = current;
+#if defined(__linux__)
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) { }
+#endif
+    }
+}
+
+void Networking::run_io()
+{
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    double time_extra = std::chrono::duration_cast<std::chrono::duration<double>>(now - last_run).count();
+    last_run = now;
 
-    PRINT_DEBUG("RECV LOCAL %zu", local_send.size());
-    std::vector<Common_Message> local_send_copy = local_send;
-    local_send.clear();
+    if (!enabled || ids.size() == 0) {
+        return;
+    }
 
-    for (auto & m: local_send_copy) {
-        m.set_source_ip(ntohl(own_ip));
-        m.set_source_port(ntohs(udp_port));
-        do_callbacks_message(&m);
+    //PRINT_DEBUG("%lf", time_extra);
+    // PRINT_DEBUG_ENTRY();
+    if (gossip_discovery && connections.empty() && broadcast_interval > BROADCAST_INTERVAL) {
+        broadcast_interval = BROADCAST_INTERVAL;
+        schedule_timer(broadcast_timer, TIMER_BROADCAST, last_broadcast + timer_duration(BROADCAST_INTERVAL));
     }
 
+    PRINT_DEBUG("RECV UDP");
+    receive_udp();
+
+    IP_PORT ip_port;
+
     struct sockaddr_storage addr;
 #if defined(STEAM_WIN32)
     int addrlen = sizeof(addr);
@@ -993,7 +3551,7 @@ void Networking::Run()
 #endif
     sock_t sock;
     PRINT_DEBUG("ACCEPTING");
-    while (is_socket_valid(sock = accept(tcp_socket, (struct sockaddr *)&addr, &addrlen))) {
+    while (is_readable(tcp_socket) && is_socket_valid(sock = accept(tcp_socket, (struct sockaddr *)&addr, &addrlen))) {
         PRINT_DEBUG("ACCEPT SOCKET %u", sock);
         struct sockaddr_storage addr;
     #if defined(STEAM_WIN32)
@@ -1012,6 +3570,10 @@ void Networking::Run()
             socket.received_data = true;
             socket.last_heartbeat_received = std::chrono::high_resolution_clock::now();
             accepted.push_back(socket);
+            poll_add(sock);
+            if (!accepted_timer.pending) {
+                schedule_timer(accepted_timer, TIMER_ACCEPTED, socket.last_heartbeat_received + timer_duration(HEARTBEAT_TIMEOUT));
+            }
             PRINT_DEBUG("TCP ACCEPTED %u", sock);
         }
     }
@@ -1020,14 +3582,18 @@ void Networking::Run()
     auto conn = std::begin(accepted);
     while (conn != std::end(accepted)) {
         bool deleted = false;
-        recv_tcp(*conn);
-        Common_Message msg;
-        if (unbuffer_tcp(*conn, &msg)) {
-            if (msg.source_id()) {
-                Connection *connection = find_connection((uint64)msg.source_id());
+        if (is_readable(conn->sock)) recv_tcp(*conn);
+        Common_Message *msg = parsed_message();
+        if (unbuffer_tcp(*conn, msg)) {
+            if (msg->source_id()) {
+                Connection *connection = find_connection((uint64)msg->source_id());
                 if (connection) {
                     kill_tcp_socket(connection->tcp_socket_incoming);
                     connection->tcp_socket_incoming = *conn;
+                    // its events belong to the connection now, which parses the rest of what it got
+                    poll_writable(*connection, connection->tcp_socket_incoming);
+                    connections_to_visit.push_back(connection->serial);
+                    schedule_connection_timer(*connection);
                     conn = accepted.erase(conn);
                     deleted = true;
                     PRINT_DEBUG("TCP REPLACED");
@@ -1043,115 +3609,284 @@ void Networking::Run()
             }
         }
 
-        if (!deleted && check_timedout(conn->last_heartbeat_received, HEARTBEAT_TIMEOUT + time_extra)) {
-            kill_tcp_socket(*conn);
-            conn = accepted.erase(conn);
-            deleted = true;
-            PRINT_DEBUG("TCP TIMEOUT");
-        }
-        
         if (!deleted){
             ++conn;
         }
     }
 
-    PRINT_DEBUG("CONNECTIONS %zu", connections.size());
-    for (auto &conn: connections) {
-        if (!is_tcp_socket_valid(conn.tcp_socket_outgoing)) {
-            sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-            if (is_socket_valid(sock) && set_socket_nonblocking(sock)) {
-                PRINT_DEBUG("NEW SOCKET %u %u", sock, conn.tcp_socket_outgoing.sock);
-                disable_nagle(sock);
-                connect_socket(sock, conn.tcp_ip_port);
-                conn.tcp_socket_outgoing.sock = sock;
-                conn.tcp_socket_outgoing.last_heartbeat_received = std::chrono::high_resolution_clock::now();
-                Common_Message msg;
-                msg.set_source_id(ids[0].ConvertToUint64());
-                send_buffer_tcp(conn.tcp_socket_outgoing, &msg);
-            }
+    // the connections with socket events and the ones which asked for it, the others only have
+    // something to do when their timers expire
+    visiting.swap(connections_to_visit);
+#if defined(__linux__)
+    bool polled = epoll_fd >= 0;
+#else
+    bool polled = false;
+#endif
+    if (polled) {
+        visiting.insert(visiting.end(), ready_connections.begin(), ready_connections.end());
+        // in creation order, like the list
+        std::sort(visiting.begin(), visiting.end());
+        visiting.erase(std::unique(visiting.begin(), visiting.end()), visiting.end());
+    } else {
+        // no poller, try every socket
+        visiting.clear();
+        for (auto &conn : connections) visiting.push_back(conn.serial);
+    }
+
+    PRINT_DEBUG("CONNECTIONS %zu, VISITING %zu", connections.size(), visiting.size());
+    counters.connections_visited += visiting.size();
+    for (uint64 serial : visiting) {
+        auto conn = connections_by_serial.find(serial);
+        if (conn != connections_by_serial.end()) visit_connection(*conn->second);
+    }
+
+    visiting.clear();
+
+    // by index, handling a message can close a ring
+    for (size_t i = 0; i < shm_connections.size(); ++i) {
+        run_shm(*shm_connections[i]);
+    }
+
+    reset_parse_arena();
+    run_timers(time_extra);
+    send_acks();
+
+    reset_parse_arena();
+    flush_udp_batch();
+    dump_counters();
+    capture.flush_due();
+    reset_last_error();
+}
+
+void Networking::visit_connection(Connection &conn)
+{
+    if (!is_tcp_socket_valid(conn.tcp_socket_outgoing)) {
+        sock_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (is_socket_valid(sock) && set_socket_nonblocking(sock)) {
+            PRINT_DEBUG("NEW SOCKET %u %u", sock, conn.tcp_socket_outgoing.sock);
+            disable_nagle(sock);
+            connect_socket(sock, conn.tcp_ip_port);
+            conn.tcp_socket_outgoing.sock = sock;
+            poll_add(sock);
+            conn.tcp_socket_outgoing.last_heartbeat_received = std::chrono::high_resolution_clock::now();
+            Common_Message msg;
+            msg.set_source_id(ids[0].ConvertToUint64());
+            send_buffer_tcp(conn.tcp_socket_outgoing, &msg);
+            poll_writable(conn, conn.tcp_socket_outgoing);
+            schedule_connection_timer(conn);
         }
+    }
 
-        PRINT_DEBUG("RUN SOCKET1 %u %u", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
-        recv_tcp(conn.tcp_socket_outgoing);
-        recv_tcp(conn.tcp_socket_incoming);
-
-        if (conn.tcp_socket_incoming.received_data || conn.tcp_socket_outgoing.received_data) {
-            if (!conn.connected) {
-                //reconnect the connection if it has the right appid
-                if (conn.appid == this->appid || conn.appid == LOBBY_CONNECT_APPID) {
-                    for (auto &c: connections) {
-                        if (&c == &conn) continue;
-                        if (c.appid != this->appid) continue;
-                        for (auto &steam_id : conn.ids) {
-                            auto i = std::find(c.ids.begin(), c.ids.end(), steam_id);
-                            if (i != c.ids.end()) {
-                                c.ids.erase(i);
-                                run_callback_user(steam_id, false, c.appid);
-                                PRINT_DEBUG("REMOVE OLD CONNECTION ID");
-                            }
+    PRINT_DEBUG("RUN SOCKET1 %u %u", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
+    if (is_readable(conn.tcp_socket_outgoing.sock)) recv_tcp(conn.tcp_socket_outgoing);
+    if (is_readable(conn.tcp_socket_incoming.sock)) recv_tcp(conn.tcp_socket_incoming);
+
+    if (conn.tcp_socket_incoming.received_data || conn.tcp_socket_outgoing.received_data) {
+        if (!conn.connected) {
+            //reconnect the connection if it has the right appid
+            if (conn.appid == this->appid || conn.appid == LOBBY_CONNECT_APPID) {
+                for (auto &c: connections) {
+                    if (&c == &conn) continue;
+                    if (c.appid != this->appid) continue;
+                    for (auto &steam_id : conn.ids) {
+                        auto i = std::find(c.ids.begin(), c.ids.end(), steam_id);
+                        if (i != c.ids.end()) {
+                            remove_id_connection(&c, i);
+                            run_callback_user(steam_id, false, c.appid);
+                            PRINT_DEBUG("REMOVE OLD CONNECTION ID");
                         }
                     }
-
-                    for (auto &steam_id : conn.ids) run_callback_user(steam_id, true, conn.appid);
                 }
 
-                conn.connected = true;
+                for (auto &steam_id : conn.ids) run_callback_user(steam_id, true, conn.appid);
             }
+
+            conn.connected = true;
         }
+    }
 
-        PRINT_DEBUG("RUN SOCKET2 %u %u", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
-        send_tcp_pending(conn.tcp_socket_outgoing);
-        send_tcp_pending(conn.tcp_socket_incoming);
+    PRINT_DEBUG("RUN SOCKET2 %u %u", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
+    for (struct TCP_Socket *socket : {&conn.tcp_socket_outgoing, &conn.tcp_socket_incoming}) {
+        if (!is_writable(socket->sock)) continue;
+        send_tcp_pending(*socket);
+        poll_writable(conn, *socket);
+    }
 
-        PRINT_DEBUG("RUN SOCKET3 %u %u", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
-        Common_Message msg;
-        while (unbuffer_tcp(conn.tcp_socket_outgoing, &msg)) {
-            PRINT_DEBUG("UNBUFFER SOCKET");
-            msg.set_source_ip(ntohl(conn.tcp_ip_port.ip)); //TODO: get from tcp socket
-            handle_tcp(&msg, conn.tcp_socket_outgoing);
-            conn.last_received = std::chrono::high_resolution_clock::now();
-        }
+    PRINT_DEBUG("RUN SOCKET3 %u %u", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
+    for (Common_Message *msg = parsed_message(); unbuffer_tcp(conn.tcp_socket_outgoing, msg); msg = parsed_message()) {
+        PRINT_DEBUG("UNBUFFER SOCKET");
+        msg->set_source_ip(ntohl(conn.tcp_ip_port.ip)); //TODO: get from tcp socket
+        if (!delay_tcp(conn, msg, false)) handle_tcp(msg, conn.tcp_socket_outgoing);
+        conn.last_received = std::chrono::high_resolution_clock::now();
+    }
 
-        while (unbuffer_tcp(conn.tcp_socket_incoming, &msg)) {
-            PRINT_DEBUG("UNBUFFER SOCKET");
-            msg.set_source_ip(ntohl(conn.tcp_ip_port.ip)); //TODO: get from tcp socket
-            handle_tcp(&msg, conn.tcp_socket_incoming);
-            conn.last_received = std::chrono::high_resolution_clock::now();
-        }
+    for (Common_Message *msg = parsed_message(); unbuffer_tcp(conn.tcp_socket_incoming, msg); msg = parsed_message()) {
+        PRINT_DEBUG("UNBUFFER SOCKET");
+        msg->set_source_ip(ntohl(conn.tcp_ip_port.ip)); //TODO: get from tcp socket
+        if (!delay_tcp(conn, msg, true)) handle_tcp(msg, conn.tcp_socket_incoming);
+        conn.last_received = std::chrono::high_resolution_clock::now();
+    }
+
+    reset_parse_arena();
+
+    // the outgoing socket couldn't be created or was killed by bad data, try again on the next run
+    if (!is_tcp_socket_valid(conn.tcp_socket_outgoing)) connections_to_visit.push_back(conn.serial);
+    check_connected(conn);
+}
+
+void Networking::check_connected(Connection &conn)
+{
+    // the users go offline once both sockets are lost
+    if (conn.tcp_socket_incoming.received_data || conn.tcp_socket_outgoing.received_data) return;
+
+    if (conn.connected) for (auto &steam_id : conn.ids) run_callback_user(steam_id, false, conn.appid);
+    conn.connected = false;
+}
+
+void Networking::schedule_timer(struct Scheduled_Timer &timer, uint64 key, std::chrono::high_resolution_clock::time_point deadline)
+{
+    uint64 tick = timers.tick_of(deadline);
+    if (timer.pending && timer.tick == tick) return;
 
-        PRINT_DEBUG("RUN SOCKET4 %u %u", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
-        socket_timeouts(conn.tcp_socket_outgoing, time_extra);
-        socket_timeouts(conn.tcp_socket_incoming, time_extra);
+    timer.tick = timers.schedule(key, deadline);
+    timer.pending = true;
+}
 
+void Networking::schedule_connection_timer(Connection &conn)
+{
+    // the heartbeats and last_received move all the time, they're only checked when the earliest
+    // deadline known when scheduling expires, then the timer is scheduled again for the next one
+    auto deadline = conn.last_received + timer_duration(USER_TIMEOUT);
+    for (struct TCP_Socket *socket : {&conn.tcp_socket_outgoing, &conn.tcp_socket_incoming}) {
+        if (!is_socket_valid(socket->sock)) continue;
+        deadline = std::min(deadline, socket->last_heartbeat_sent + timer_duration(HEARTBEAT_TIMEOUT / 2.0));
+        deadline = std::min(deadline, socket->last_heartbeat_received + timer_duration(HEARTBEAT_TIMEOUT));
     }
 
-    {
-        auto conn = std::begin(connections);
-        while (conn != std::end(connections)) {
-            if (check_timedout(conn->last_received, USER_TIMEOUT + time_extra)) {
-                if (conn->connected) for (auto &steam_id : conn->ids) run_callback_user(steam_id, false, conn->appid);
-                kill_tcp_socket(conn->tcp_socket_outgoing);
-                kill_tcp_socket(conn->tcp_socket_incoming);
-                conn = connections.erase(conn);
-                PRINT_DEBUG("USER TIMEOUT");
-            } else {
-                ++conn;
-            }
+    schedule_connection_timer(conn, conn.timer, TIMER_CONNECTION, deadline);
+}
+
+void Networking::schedule_connection_timer(Connection &conn, struct Scheduled_Timer &timer, uint64 kind, std::chrono::high_resolution_clock::time_point deadline)
+{
+    if (timer.pending && timers.tick_of(deadline) >= timer.tick) return;
+    schedule_timer(timer, (conn.serial << TIMER_KIND_BITS) | kind, deadline);
+}
+
+// an expired entry is only used if it's still the one of its timer
+static bool is_current_timer(struct Scheduled_Timer &timer, const struct Timer_Wheel_Entry &entry)
+{
+    if (!timer.pending || timer.tick != entry.tick) return false;
+    timer.pending = false;
+    return true;
+}
+
+void Networking::run_timers(double time_extra)
+{
+    expired_timers.clear();
+    timers.advance(std::chrono::high_resolution_clock::now(), expired_timers);
+    counters.timers_expired += expired_timers.size();
+
+    for (auto &entry : expired_timers) {
+        uint64 kind = entry.key & TIMER_KIND_MASK;
+        switch (kind) {
+        case TIMER_ACCEPTED:
+            if (is_current_timer(accepted_timer, entry)) accepted_timeouts(time_extra);
+            break;
+
+        case TIMER_BROADCAST:
+            if (is_current_timer(broadcast_timer, entry)) send_announce_broadcasts();
+            break;
+
+        case TIMER_LEGACY_ANNOUNCES:
+            if (is_current_timer(legacy_announces_timer, entry)) send_legacy_announces();
+            break;
+
+        default: {
+            // the other kinds belong to a connection
+            auto conn = connections_by_serial.find(entry.key >> TIMER_KIND_BITS);
+            if (conn != connections_by_serial.end()) run_connection_timer(*conn->second, kind, entry, time_extra);
+            break;
+        }
         }
     }
+}
 
-    for (auto &conn: connections) {
-        if (!(conn.tcp_socket_incoming.received_data || conn.tcp_socket_outgoing.received_data)) {
-            if (conn.connected) for (auto &steam_id : conn.ids) run_callback_user(steam_id, false, conn.appid);
-            conn.connected = false;
+void Networking::run_connection_timer(Connection &conn, uint64 kind, const struct Timer_Wheel_Entry &entry, double time_extra)
+{
+    switch (kind) {
+    case TIMER_CONNECTION:
+        if (is_current_timer(conn.timer, entry)) connection_timeouts(conn, time_extra);
+        break;
+
+    case TIMER_FRAGMENTS:
+        if (is_current_timer(conn.fragments_timer, entry)) expire_fragments(conn);
+        break;
+
+    case TIMER_RELIABLE:
+        if (is_current_timer(conn.reliable_timer, entry)) run_reliable_udp(conn);
+        break;
+
+    case TIMER_STATS:
+        if (is_current_timer(conn.stats_timer, entry)) run_stats(conn);
+        break;
+
+    case TIMER_COALESCE:
+        if (is_current_timer(conn.coalesce_timer, entry)) flush_coalesced_timer(conn);
+        break;
+
+    case TIMER_SHM:
+        if (is_current_timer(conn.shm_timer, entry)) shm_open_out(conn);
+        break;
+
+    case TIMER_DELAYED_TCP:
+        if (is_current_timer(conn.delayed_tcp_timer, entry)) release_delayed_tcp(conn);
+        break;
+    }
+}
+
+void Networking::connection_timeouts(Connection &conn, double time_extra)
+{
+    socket_timeouts(conn.tcp_socket_outgoing, time_extra);
+    socket_timeouts(conn.tcp_socket_incoming, time_extra);
+    poll_writable(conn, conn.tcp_socket_outgoing);
+    poll_writable(conn, conn.tcp_socket_incoming);
+    if (!check_timedout(conn.last_received, USER_TIMEOUT + time_extra)) {
+        // a socket which timed out is replaced on the next run
+        if (!is_tcp_socket_valid(conn.tcp_socket_outgoing)) connections_to_visit.push_back(conn.serial);
+        check_connected(conn);
+        schedule_connection_timer(conn);
+        return;
+    }
+
+    if (conn.connected) for (auto &steam_id : conn.ids) run_callback_user(steam_id, false, conn.appid);
+    kill_tcp_socket(conn.tcp_socket_outgoing);
+    kill_tcp_socket(conn.tcp_socket_incoming);
+    auto it = connections_by_serial.find(conn.serial);
+    if (it != connections_by_serial.end()) remove_connection(it->second);
+    PRINT_DEBUG("USER TIMEOUT");
+}
+
+void Networking::accepted_timeouts(double time_extra)
+{
+    auto next = std::chrono::high_resolution_clock::time_point::max();
+    auto conn = std::begin(accepted);
+    while (conn != std::end(accepted)) {
+        if (check_timedout(conn->last_heartbeat_received, HEARTBEAT_TIMEOUT + time_extra)) {
+            kill_tcp_socket(*conn);
+            conn = accepted.erase(conn);
+            PRINT_DEBUG("TCP TIMEOUT");
+        } else {
+            next = std::min(next, conn->last_heartbeat_received + timer_duration(HEARTBEAT_TIMEOUT));
+            ++conn;
         }
     }
 
-    reset_last_error();
+    if (!accepted.empty()) schedule_timer(accepted_timer, TIMER_ACCEPTED, next);
 }
 
 void Networking::addListenId(CSteamID id)
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
     if (!enabled) return;
     auto i = std::find(ids.begin(), ids.end(), id);
     if (i != ids.end()) {
@@ -1166,29 +3901,46 @@ void Networking::addListenId(CSteamID id)
 
 void Networking::setAppID(uint32 appid)
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
     this->appid = appid;
 }
 
 bool Networking::sendToIPPort(Common_Message *msg, uint32 ip, uint16 port, bool reliable)
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    ++counters.messages_sent[msg->messages_case()];
+    capture_sent(msg, reliable);
     bool is_local_ip = ((ip >> 24) == 0x7F);
     uint32_t local_ip = getIP(ids.front());
     PRINT_DEBUG("%X %u %X", ip, is_local_ip, local_ip);
     //TODO: actually send to ip/port
-    for (auto &conn: connections) {
-        if (ntohl(conn.tcp_ip_port.ip) == ip || (is_local_ip && ntohl(conn.tcp_ip_port.ip) == local_ip)) {
-            for (auto &steam_id : conn.ids) {
-                msg->set_dest_id(steam_id.ConvertToUint64());
-                sendTo(msg, reliable, &conn);
-            }
+    std::vector<struct Connection *> matching{};
+    auto entry = connections_by_ip.find(htonl(ip));
+    if (entry != connections_by_ip.end()) matching = entry->second;
+    if (is_local_ip && local_ip != ip) {
+        entry = connections_by_ip.find(htonl(local_ip));
+        if (entry != connections_by_ip.end()) matching.insert(matching.end(), entry->second.begin(), entry->second.end());
+    }
+
+    // keep the order of a scan of all the connections
+    std::sort(matching.begin(), matching.end(), [](const struct Connection *a, const struct Connection *b) { return a->serial < b->serial; });
+
+    Wire_Buffer body{};
+    Wire_Buffer compressed{};
+    for (auto conn: matching) {
+        if (!body) body = serialize_for_fan_out(msg);
+        for (auto &steam_id : conn->ids) {
+            queue_send(body, msg->messages_case(), steam_id.ConvertToUint64(), reliable, conn, &compressed);
         }
     }
 
+    flush_udp_batch();
     return true;
 }
 
 uint32 Networking::getIP(CSteamID id)
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
     Connection *conn = find_connection(id, this->appid);
     if (conn) {
         return ntohl(conn->tcp_ip_port.ip);
@@ -1197,12 +3949,21 @@ uint32 Networking::getIP(CSteamID id)
     return 0;
 }
 
-bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
+bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn, bool no_nagle)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    ++counters.messages_sent[msg->messages_case()];
+    capture_sent(msg, reliable);
+    bool ret = queue_send(msg, reliable, conn, no_nagle);
+    flush_udp_batch();
+    return ret;
+}
+
+bool Networking::queue_send(Common_Message *msg, bool reliable, Connection *conn, bool no_nagle)
 {
     if (!enabled) return false;
 
     size_t size = msg->ByteSizeLong();
-    if (size >= MAX_UDP_SIZE) reliable = true; //too big for UDP
 
     bool ret = false;
     CSteamID dest_id((uint64)msg->dest_id());
@@ -1210,6 +3971,7 @@ bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
         PRINT_DEBUG("sending to self");
         if (!conn) {
             PRINT_DEBUG("local send");
+            ++counters.messages_received[msg->messages_case()];
             local_send.push_back(*msg);
             ret = true;
         }
@@ -1219,21 +3981,120 @@ bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
         conn = find_connection(dest_id, this->appid);
     }
 
+    if (!ret && conn && shm_ring_is_open(conn->shm_out) && shm_send(conn, nullptr, 0, msg->SerializeAsString(), reliable)) {
+        conn->stats.sent(msg->messages_case(), size);
+        ret = true;
+    }
+
+    // see shm_flush()
+    if (!ret && conn && reliable) conn->shm_off_ring = true;
+
+    if (!ret && conn && use_compression(size, conn)) {
+        Wire_Buffer compressed = compress_message(msg->SerializeAsString(), msg->messages_case());
+        if (compressed) {
+            return queue_send(compressed, msg->messages_case(), msg->dest_id(), reliable, conn, NULL, no_nagle);
+        }
+    }
+
     if (!ret && conn) {
-        if (reliable || !conn->udp_pinged) {
-            if (conn->tcp_socket_incoming.received_data) {
+        conn->stats.sent(msg->messages_case(), size);
+        bool fragmented = use_fragments(size, conn);
+        if (size >= MAX_UDP_SIZE && !fragmented) reliable = true; //too big for UDP
+
+        if (reliable && use_reliable_udp(conn)) {
+            send_reliable(msg->SerializeAsString(), msg->messages_case(), conn);
+            ret = true;
+        } else if (reliable || !conn->udp_pinged) {
+            if (impaired_tcp_send(*conn)) {
+                ret = delay_tcp_send(*conn, msg->SerializeAsString());
+            } else if (conn->tcp_socket_incoming.received_data) {
                 send_buffer_tcp(conn->tcp_socket_incoming, msg);
+                poll_writable(*conn, conn->tcp_socket_incoming);
                 ret = true;
             } else if (conn->tcp_socket_outgoing.received_data) {
                 send_buffer_tcp(conn->tcp_socket_outgoing, msg);
+                poll_writable(*conn, conn->tcp_socket_outgoing);
                 ret = true;
             }
+        } else if (fragmented) {
+            send_fragmented(msg->SerializeAsString(), conn);
+            ret = true;
+        } else if (use_coalescing(size, conn)) {
+            coalesce(serialize_unreliable(msg, conn), conn, no_nagle);
+            ret = true;
         } else {
-            std::vector<char> buffer(size, 0);
-            msg->SerializeToArray(&buffer[0], size);
-            send_packet_to(udp_socket, conn->udp_ip_port, &buffer[0], size);
+            flush_coalesced(*conn);
+            std::string buffer = serialize_unreliable(msg, conn);
+            udp_batch.add(conn->udp_ip_port, buffer.data(), buffer.size());
+            ret = true;
+        }
+    }
+
+    reset_last_error();
+    return ret;
+}
+
+bool Networking::queue_send(const Wire_Buffer &body, int channel, uint64 dest_id, bool reliable, Connection *conn, Wire_Buffer *compressed_body, bool no_nagle)
+{
+    if (!enabled) return false;
+
+    if (shm_ring_is_open(conn->shm_out)) {
+        // nothing to gain from compressing on the same host
+        char header[DEST_ID_HEADER_MAX_SIZE];
+        size_t header_size = encode_dest_id(header, dest_id);
+        if (shm_send(conn, header, header_size, *body, reliable)) {
+            conn->stats.sent(channel, header_size + body->size());
+            return true;
+        }
+    }
+
+    // see shm_flush()
+    if (reliable) conn->shm_off_ring = true;
+
+    const Wire_Buffer *wire = &body;
+    if (compressed_body && use_compression(body->size(), conn)) {
+        // compressed once for the whole fan-out, the original is kept when it doesn't shrink
+        if (!*compressed_body) {
+            *compressed_body = compress_message(*body, channel);
+            if (!*compressed_body) *compressed_body = body;
+        }
+
+        wire = compressed_body;
+    }
+
+    char header[DEST_ID_HEADER_MAX_SIZE];
+    size_t header_size = encode_dest_id(header, dest_id);
+    size_t size = header_size + (*wire)->size();
+    conn->stats.sent(channel, size);
+    bool fragmented = use_fragments(size, conn);
+    if (size >= MAX_UDP_SIZE && !fragmented) reliable = true; //too big for UDP
+
+    bool ret = false;
+    if (reliable && use_reliable_udp(conn)) {
+        send_reliable(std::string(header, header_size) + **wire, channel, conn);
+        ret = true;
+    } else if (reliable || !conn->udp_pinged) {
+        if (impaired_tcp_send(*conn)) {
+            ret = delay_tcp_send(*conn, std::string(header, header_size) + **wire);
+        } else if (conn->tcp_socket_incoming.received_data) {
+            send_wire_tcp(conn->tcp_socket_incoming, header, header_size, *wire);
+            poll_writable(*conn, conn->tcp_socket_incoming);
+            ret = true;
+        } else if (conn->tcp_socket_outgoing.received_data) {
+            send_wire_tcp(conn->tcp_socket_outgoing, header, header_size, *wire);
+            poll_writable(*conn, conn->tcp_socket_outgoing);
             ret = true;
         }
+    } else if (fragmented) {
+        send_fragmented(std::string(header, header_size) + **wire, conn);
+        ret = true;
+    } else if (use_coalescing(size, conn)) {
+        coalesce(std::string(header, header_size) + **wire, conn, no_nagle);
+        ret = true;
+    } else {
+        flush_coalesced(*conn);
+        udp_batch.add(conn->udp_ip_port, header, header_size, *wire);
+        ret = true;
     }
 
     reset_last_error();
@@ -1242,55 +4103,83 @@ bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
 
 bool Networking::sendToAllIndividuals(Common_Message *msg, bool reliable)
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    ++counters.messages_sent[msg->messages_case()];
+    capture_sent(msg, reliable);
+    Wire_Buffer body = serialize_for_fan_out(msg);
+    Wire_Buffer compressed{};
     for (auto &conn: connections) {
         for (auto &steam_id : conn.ids) {
             if (steam_id.BIndividualAccount()) {
-                msg->set_dest_id(steam_id.ConvertToUint64());
-                sendTo(msg, reliable, &conn);
+                queue_send(body, msg->messages_case(), steam_id.ConvertToUint64(), reliable, &conn, &compressed);
             }
         }
     }
 
+    flush_udp_batch();
     return true;
 }
 
 bool Networking::sendToAllGameservers(Common_Message *msg, bool reliable)
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    ++counters.messages_sent[msg->messages_case()];
+    capture_sent(msg, reliable);
+    Wire_Buffer body = serialize_for_fan_out(msg);
+    Wire_Buffer compressed{};
     for (auto &conn: connections) {
         for (auto &steam_id : conn.ids) {
             if (steam_id.BGameServerAccount()) {
-                msg->set_dest_id(steam_id.ConvertToUint64());
-                sendTo(msg, reliable, &conn);
+                queue_send(body, msg->messages_case(), steam_id.ConvertToUint64(), reliable, &conn, &compressed);
             }
         }
     }
 
+    flush_udp_batch();
     return true;
 }
 
 bool Networking::sendToAll(Common_Message *msg, bool reliable)
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    ++counters.messages_sent[msg->messages_case()];
+    capture_sent(msg, reliable);
+    Wire_Buffer body = serialize_for_fan_out(msg);
+    Wire_Buffer compressed{};
     for (auto &conn: connections) {
         for (auto &steam_id : conn.ids) {
-            msg->set_dest_id(steam_id.ConvertToUint64());
-            sendTo(msg, reliable, &conn);
+            queue_send(body, msg->messages_case(), steam_id.ConvertToUint64(), reliable, &conn, &compressed);
         }
     }
 
+    flush_udp_batch();
     return true;
 }
 
 void Networking::run_callbacks(Callback_Ids id, Common_Message *msg)
 {
-    for (auto &cb : callbacks[id].callbacks) {
-        uint64 callback_allowed_steamid = cb.steam_id.ConvertToUint64();
-        uint64 message_destination_steamid = msg->dest_id();
-        if (callback_allowed_steamid == 0 || // callback wants to receive all messages (callback for broadcast)
-            message_destination_steamid == 0 || // message was broadcasted to all (broadcast message)
-            callback_allowed_steamid == message_destination_steamid) { // callback destination is the same as the message destination
-            cb.message_callback(cb.object, msg);
-        }
+    // a callback gets the messages sent to its steam id, and all of them if it was registered with id 0
+    const std::vector<struct Network_Callback> *targets = &callbacks[id].callbacks;
+    uint64 message_destination_steamid = msg->dest_id();
+    if (message_destination_steamid != 0) { // not a broadcast message
+        auto entry = callbacks[id].by_dest.find(message_destination_steamid);
+        targets = entry != callbacks[id].by_dest.end() ? &entry->second : &callbacks[id].broadcast;
+    }
+
+    if (dispatch_depth == dispatching.size()) dispatching.emplace_back();
+    std::vector<struct Network_Callback> &snapshot = dispatching[dispatch_depth++];
+    snapshot.assign(targets->begin(), targets->end());
+    for (auto &cb : snapshot) {
+        auto removed = std::find_if(removed_while_dispatching.begin(), removed_while_dispatching.end(), [&cb](const struct Network_Callback &item) {
+            return item.message_callback == cb.message_callback && item.object == cb.object && item.steam_id == cb.steam_id;
+        });
+        if (removed != removed_while_dispatching.end()) continue;
+
+        cb.message_callback(cb.object, msg);
     }
+
+    snapshot.clear();
+    if (!--dispatch_depth) removed_while_dispatching.clear();
 }
 
 void Networking::run_callback_user(CSteamID steam_id, bool online, uint32 appid)
@@ -1307,7 +4196,15 @@ void Networking::run_callback_user(CSteamID steam_id, bool online, uint32 appid)
         msg.mutable_low_level()->set_type(Low_Level::DISCONNECT);
     }
 
-    run_callbacks(CALLBACK_ID_USER_STATUS, &msg);
+    if (capture.is_open()) capture.write(CAPTURE_USER_STATUS, false, msg.SerializeAsString());
+    if (io_thread_active) {
+        Received_Message item{};
+        item.msg.Swap(&msg);
+        item.user_status = true;
+        received.push(std::move(item));
+    } else {
+        run_callbacks(CALLBACK_ID_USER_STATUS, &msg);
+    }
 }
 
 bool Networking::setCallback(Callback_Ids id, CSteamID steam_id, void (*message_callback)(void *object, Common_Message *msg), void *object)
@@ -1319,7 +4216,23 @@ bool Networking::setCallback(Callback_Ids id, CSteamID steam_id, void (*message_
     nc.object = object;
     nc.steam_id = steam_id;
 
-    callbacks[id].callbacks.push_back(nc);
+    auto &container = callbacks[id];
+    container.callbacks.push_back(nc);
+    uint64 dest = steam_id.ConvertToUint64();
+    if (dest == 0) {
+        container.broadcast.push_back(nc);
+        for (auto &entry : container.by_dest) {
+            entry.second.push_back(nc);
+        }
+    } else {
+        auto entry = container.by_dest.find(dest);
+        if (entry == container.by_dest.end()) {
+            entry = container.by_dest.emplace(dest, container.broadcast).first;
+        }
+
+        entry->second.push_back(nc);
+    }
+
     return true;
 }
 
@@ -1327,18 +4240,46 @@ void Networking::rmCallback(Callback_Ids id, CSteamID steam_id, void (*message_c
 {
     if (id >= CALLBACK_IDS_MAX) return;
 
-    auto &target_cb = callbacks[id].callbacks;
-    auto itrm = std::remove_if(
-        target_cb.begin(),
-        target_cb.end(),
-        [=, &steam_id](const struct Network_Callback &item) {
-            return item.message_callback == message_callback &&
-                   item.object == object &&
-                   item.steam_id == steam_id;
-        }
-    );
+    auto remove_from = [=, &steam_id](std::vector<struct Network_Callback> &target_cb) {
+        auto itrm = std::remove_if(
+            target_cb.begin(),
+            target_cb.end(),
+            [=, &steam_id](const struct Network_Callback &item) {
+                return item.message_callback == message_callback &&
+                       item.object == object &&
+                       item.steam_id == steam_id;
+            }
+        );
+
+        target_cb.erase(itrm, target_cb.end());
+    };
 
-    target_cb.erase(itrm, target_cb.end());
+    if (dispatch_depth) {
+        struct Network_Callback removed{};
+        removed.message_callback = message_callback;
+        removed.object = object;
+        removed.steam_id = steam_id;
+        removed_while_dispatching.push_back(removed);
+    }
+
+    auto &container = callbacks[id];
+    remove_from(container.callbacks);
+    uint64 dest = steam_id.ConvertToUint64();
+    if (dest == 0) {
+        remove_from(container.broadcast);
+        for (auto &entry : container.by_dest) {
+            remove_from(entry.second);
+        }
+    } else {
+        auto entry = container.by_dest.find(dest);
+        if (entry != container.by_dest.end()) {
+            remove_from(entry->second);
+            // nothing left for this id but the broadcast callbacks
+            if (entry->second.size() == container.broadcast.size()) {
+                container.by_dest.erase(entry);
+            }
+        }
+    }
 }
 
 uint32 Networking::getOwnIP()
@@ -1348,6 +4289,7 @@ uint32 Networking::getOwnIP()
 
 void Networking::startQuery(IP_PORT ip_port)
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
     if (ip_port.port <= 1024)
         return;
 
@@ -1398,6 +4340,8 @@ void Networking::startQuery(IP_PORT ip_port)
             }
         }
 
+        if (!io_thread_active) poll_add(query_socket);
+
         char str_ip[16]{};
         inet_ntop(AF_INET, &(addr.sin_addr), str_ip, 16);
 
@@ -1408,6 +4352,7 @@ void Networking::startQuery(IP_PORT ip_port)
 
 void Networking::shutDownQuery()
 {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
     query_alive = false;
     kill_socket(query_socket);
 }
@@ -1192,6 +1192,57 @@ static void parse_ip_country(class Local_Storage *local_storage, class Settings
     }
 }
 
+static void parse_impairment_section(const char *section, Impairment_Config &config)
+{
+    config.send.loss_pct = (float)ini.GetDoubleValue(section, "loss_send", config.send.loss_pct);
+    config.recv.loss_pct = (float)ini.GetDoubleValue(section, "loss_recv", config.recv.loss_pct);
+    config.send.lag_ms = (int32)ini.GetLongValue(section, "lag_send", config.send.lag_ms);
+    config.recv.lag_ms = (int32)ini.GetLongValue(section, "lag_recv", config.recv.lag_ms);
+    config.send.jitter_ms = (int32)ini.GetLongValue(section, "jitter_send", config.send.jitter_ms);
+    config.recv.jitter_ms = (int32)ini.GetLongValue(section, "jitter_recv", config.recv.jitter_ms);
+    config.send.reorder_pct = (float)ini.GetDoubleValue(section, "reorder_send", config.send.reorder_pct);
+    config.recv.reorder_pct = (float)ini.GetDoubleValue(section, "reorder_recv", config.recv.reorder_pct);
+    config.reorder_time_ms = (int32)ini.GetLongValue(section, "reorder_time", config.reorder_time_ms);
+    config.send.dup_pct = (float)ini.GetDoubleValue(section, "dup_send", config.send.dup_pct);
+    config.recv.dup_pct = (float)ini.GetDoubleValue(section, "dup_recv", config.recv.dup_pct);
+    config.dup_time_max_ms = (int32)ini.GetLongValue(section, "dup_time_max", config.dup_time_max_ms);
+    config.send.rate = (int32)ini.GetLongValue(section, "rate_send", config.send.rate);
+    config.send.burst = (int32)ini.GetLongValue(section, "burst_send", config.send.burst);
+    config.recv.rate = (int32)ini.GetLongValue(section, "rate_recv", config.recv.rate);
+    config.recv.burst = (int32)ini.GetLongValue(section, "burst_recv", config.recv.burst);
+}
+
+// main::network_impairment and main::network_impairment::<steam id>
+static void parse_network_impairment(class Settings *settings_client, class Settings *settings_server)
+{
+    constexpr const static char IMPAIRMENT_SECTION[] = "main::network_impairment";
+
+    Impairment_Config config{};
+    parse_impairment_section(IMPAIRMENT_SECTION, config);
+    uint64 seed = std::strtoull(ini.GetValue(IMPAIRMENT_SECTION, "seed", "0"), nullptr, 10);
+    settings_client->network_impairment = settings_server->network_impairment = config;
+    settings_client->network_impairment_seed = settings_server->network_impairment_seed = seed;
+    if (config.active()) PRINT_DEBUG("network impairment enabled, seed %llu", seed);
+
+    // the peers' own sections start from the values above
+    const std::string peer_prefix = std::string(IMPAIRMENT_SECTION) + "::";
+    std::list<CSimpleIniA::Entry> sections{};
+    ini.GetAllSections(sections);
+    for (auto const &sec : sections) {
+        std::string name(sec.pItem);
+        if (name.rfind(peer_prefix, 0) != 0) continue;
+
+        uint64 peer_id = std::strtoull(name.c_str() + peer_prefix.size(), nullptr, 10);
+        if (!peer_id) continue;
+
+        Impairment_Config peer_config = config;
+        parse_impairment_section(sec.pItem, peer_config);
+        settings_client->network_impairment_peers[peer_id] = peer_config;
+        settings_server->network_impairment_peers[peer_id] = peer_config;
+        PRINT_DEBUG("network impairment for user %llu", peer_id);
+    }
+}
+
 // overlay::general
 static void parse_overlay_general_config(class Settings *settings_client, class Settings *settings_server)
 {
@@ -1274,11 +1325,50 @@ static void parse_simple_features(class Settings *settings_client, class Setting
     settings_client->matchmaking_server_list_always_lan_type = ini.GetBoolValue("main::general", "matchmaking_server_list_actual_type", settings_client->matchmaking_server_list_always_lan_type);
     settings_server->matchmaking_server_list_always_lan_type = ini.GetBoolValue("main::general", "matchmaking_server_list_actual_type", settings_server->matchmaking_server_list_always_lan_type);
 
+    {
+        auto val = ini.GetLongValue("main::general", "callbacks_time_budget_us", -1);
+        if (val >= 0) {
+            settings_client->callbacks_time_budget_us = (unsigned)val;
+            settings_server->callbacks_time_budget_us = (unsigned)val;
+            PRINT_DEBUG("Setting the callbacks time budget to %u us", (unsigned)val);
+        }
+    }
+
 
     // [main::connectivity]
     settings_client->disable_networking = ini.GetBoolValue("main::connectivity", "disable_networking", settings_client->disable_networking);
     settings_server->disable_networking = ini.GetBoolValue("main::connectivity", "disable_networking", settings_server->disable_networking);
 
+    settings_client->network_io_thread = ini.GetBoolValue("main::connectivity", "network_io_thread", settings_client->network_io_thread);
+    settings_server->network_io_thread = ini.GetBoolValue("main::connectivity", "network_io_thread", settings_server->network_io_thread);
+
+    settings_client->reliable_udp = ini.GetBoolValue("main::connectivity", "reliable_udp", settings_client->reliable_udp);
+    settings_server->reliable_udp = ini.GetBoolValue("main::connectivity", "reliable_udp", settings_server->reliable_udp);
+
+    settings_client->gossip_discovery = ini.GetBoolValue("main::connectivity", "gossip_discovery", settings_client->gossip_discovery);
+    settings_server->gossip_discovery = ini.GetBoolValue("main::connectivity", "gossip_discovery", settings_server->gossip_discovery);
+
+    settings_client->shared_memory_transport = ini.GetBoolValue("main::connectivity", "shared_memory_transport", settings_client->shared_memory_transport);
+    settings_server->shared_memory_transport = ini.GetBoolValue("main::connectivity", "shared_memory_transport", settings_server->shared_memory_transport);
+
+    {
+        auto ptr = ini.GetValue("main::connectivity", "network_capture");
+        if (ptr && ptr[0]) {
+            std::string path = common_helpers::to_absolute(common_helpers::string_strip(ptr), Local_Storage::get_program_path());
+            settings_client->network_capture = path;
+            settings_server->network_capture = path;
+        }
+    }
+
+    {
+        auto val = ini.GetLongValue("main::connectivity", "udp_coalesce_delay_ms", -1);
+        if (val >= 0) {
+            settings_client->udp_coalesce_delay_ms = (unsigned)val;
+            settings_server->udp_coalesce_delay_ms = (unsigned)val;
+            PRINT_DEBUG("Setting UDP coalescing delay to %u ms", (unsigned)val);
+        }
+    }
+
     settings_client->disable_sharing_stats_with_gameserver = ini.GetBoolValue("main::connectivity", "disable_sharing_stats_with_gameserver", settings_client->disable_sharing_stats_with_gameserver);
     settings_server->disable_sharing_stats_with_gameserver = ini.GetBoolValue("main::connectivity", "disable_sharing_stats_with_gameserver", settings_server->disable_sharing_stats_with_gameserver);
     
@@ -1580,6 +1670,7 @@ uint32 create_localstorage_settings(Settings **settings_client_out, Settings **s
     load_gamecontroller_settings(settings_client);
     parse_auto_accept_invite(settings_client, settings_server);
     parse_ip_country(local_storage, settings_client, settings_server);
+    parse_network_impairment(settings_client, settings_server);
 
     parse_overlay_general_config(settings_client, settings_server);
     load_overlay_appearance(settings_client, settings_server, local_storage);
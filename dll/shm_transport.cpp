@@ -0,0 +1,358 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "dll/shm_transport.h"
+#include "dll/common_includes.h"
+
+#include <random>
+
+#define SHM_NAME_PREFIX "gbe-"
+#define SHM_RING_MAGIC 0x47424552 // GBER
+#define SHM_DOORBELL_MAGIC 0x47424544 // GBED
+// record size marking the unused end of the buffer, the next record starts at the beginning
+#define SHM_RING_WRAP 0xFFFFFFFF
+#define SHM_RECORD_HEADER_SIZE 8
+
+// the positions only ever grow, the capacity is a power of 2 so they wrap around the buffer with a mask
+struct Shm_Ring_Header {
+    std::atomic<uint32> magic; // set last by the creator
+    uint32 capacity;
+    std::atomic<uint32> closed; // set by the receiver before removing the name
+    alignas(64) std::atomic<uint64> head; // written by the receiver only
+    alignas(64) std::atomic<uint64> tail; // written by the sender only
+    alignas(64) char data[1];
+};
+
+struct Shm_Doorbell_Header {
+    std::atomic<uint32> magic;
+    std::atomic<uint32> seq; // futex word
+    std::atomic<uint32> waiting;
+};
+
+static_assert(std::atomic<uint64>::is_always_lock_free && std::atomic<uint32>::is_always_lock_free, "the atomics in shared memory must be lock free");
+static_assert(sizeof(std::atomic<uint32>) == sizeof(uint32), "futex word");
+
+static size_t ring_size(uint32 capacity)
+{
+    return offsetof(struct Shm_Ring_Header, data) + capacity;
+}
+
+static size_t record_size(size_t size)
+{
+    return SHM_RECORD_HEADER_SIZE + ((size + 7) & ~(size_t)7);
+}
+
+#if defined(__linux__)
+
+static void *shm_map(const std::string &name, size_t size, bool create)
+{
+    int fd = shm_open(name.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+    if (fd < 0) return nullptr;
+
+    struct stat st{};
+    if (create ? ftruncate(fd, (off_t)size) != 0 : (fstat(fd, &st) != 0 || (size_t)st.st_size < size)) {
+        close(fd);
+        if (create) shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        if (create) shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    return mapped;
+}
+
+uint64 shm_new_instance_id()
+{
+    // the pid tells shm_cleanup_stale() whether the owner is still running
+    std::random_device rd;
+    return ((uint64)(uint32)getpid() << 32) | (uint32)rd();
+}
+
+uint64 shm_host_id()
+{
+    // same for every process and container of this boot, the segments of other containers
+    // usually can't be opened anyway and the peers fall back to the sockets
+    std::ifstream file("/proc/sys/kernel/random/boot_id");
+    std::string boot_id{};
+    if (!std::getline(file, boot_id) || boot_id.empty()) return 0;
+
+    // FNV-1a, must be the same in 32 and 64 bit builds
+    uint64 hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : boot_id) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+void shm_cleanup_stale()
+{
+    DIR *dir = opendir("/dev/shm");
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strncmp(entry->d_name, SHM_NAME_PREFIX, sizeof(SHM_NAME_PREFIX) - 1)) continue;
+        // the name starts with the id of the owner (receiver of a ring)
+        uint64 owner = strtoull(entry->d_name + sizeof(SHM_NAME_PREFIX) - 1, nullptr, 16);
+        pid_t pid = (pid_t)(owner >> 32);
+        if (pid > 0 && kill(pid, 0) != 0 && errno == ESRCH) {
+            PRINT_DEBUG("removing stale shared memory %s", entry->d_name);
+            shm_unlink((std::string("/") + entry->d_name).c_str());
+        }
+    }
+
+    closedir(dir);
+}
+
+bool shm_ring_create(struct Shm_Ring &ring, const std::string &name, uint32 capacity)
+{
+    if (!capacity || (capacity & (capacity - 1)) || capacity < 64) return false;
+
+    size_t size = ring_size(capacity);
+    struct Shm_Ring_Header *header = (struct Shm_Ring_Header *)shm_map(name, size, true);
+    if (!header) return false;
+
+    // ftruncate() zeroed it
+    header->capacity = capacity;
+    header->magic.store(SHM_RING_MAGIC, std::memory_order_release);
+    ring.header = header;
+    ring.mapped_size = size;
+    ring.owned_name = name;
+    return true;
+}
+
+bool shm_ring_open(struct Shm_Ring &ring, const std::string &name)
+{
+    struct Shm_Ring_Header *header = (struct Shm_Ring_Header *)shm_map(name, sizeof(struct Shm_Ring_Header), false);
+    if (!header) return false;
+
+    uint32 capacity = header->capacity;
+    bool valid = header->magic.load(std::memory_order_acquire) == SHM_RING_MAGIC && capacity >= 64 && !(capacity & (capacity - 1));
+    munmap(header, sizeof(struct Shm_Ring_Header));
+    if (!valid) return false;
+
+    size_t size = ring_size(capacity);
+    header = (struct Shm_Ring_Header *)shm_map(name, size, false);
+    if (!header) return false;
+
+    ring.header = header;
+    ring.mapped_size = size;
+    ring.owned_name.clear();
+    return true;
+}
+
+void shm_ring_close(struct Shm_Ring &ring)
+{
+    if (!ring.header) return;
+
+    if (ring.owned_name.size()) {
+        ring.header->closed.store(1, std::memory_order_release);
+        shm_unlink(ring.owned_name.c_str());
+    }
+
+    munmap(ring.header, ring.mapped_size);
+    ring = Shm_Ring{};
+}
+
+bool shm_ring_push(struct Shm_Ring &ring, const char *prefix, size_t prefix_size, const std::string &data)
+{
+    struct Shm_Ring_Header *header = ring.header;
+    uint64 capacity = header->capacity;
+    size_t size = prefix_size + data.size();
+    size_t record = record_size(size);
+    if (record > capacity / 2) return false;
+
+    uint64 tail = header->tail.load(std::memory_order_relaxed);
+    uint64 head = header->head.load(std::memory_order_acquire);
+    size_t offset = (size_t)(tail & (capacity - 1));
+    size_t contiguous = (size_t)capacity - offset;
+    size_t needed = record + (contiguous < record ? contiguous : 0);
+    if (capacity - (tail - head) < needed) return false;
+
+    if (contiguous < record) {
+        uint32 wrap = SHM_RING_WRAP;
+        memcpy(header->data + offset, &wrap, sizeof(wrap));
+        tail += contiguous;
+        offset = 0;
+    }
+
+    uint32 record_data_size = (uint32)size;
+    char *out = header->data + offset;
+    memcpy(out, &record_data_size, sizeof(record_data_size));
+    if (prefix_size) memcpy(out + SHM_RECORD_HEADER_SIZE, prefix, prefix_size);
+    memcpy(out + SHM_RECORD_HEADER_SIZE + prefix_size, data.data(), data.size());
+    header->tail.store(tail + record, std::memory_order_release);
+    return true;
+}
+
+bool shm_ring_pop(struct Shm_Ring &ring, std::string &data)
+{
+    struct Shm_Ring_Header *header = ring.header;
+    uint64 capacity = header->capacity;
+    uint64 head = header->head.load(std::memory_order_relaxed);
+    uint64 tail = header->tail.load(std::memory_order_acquire);
+    while (head != tail) {
+        size_t offset = (size_t)(head & (capacity - 1));
+        uint32 size;
+        memcpy(&size, header->data + offset, sizeof(size));
+        if (size == SHM_RING_WRAP) {
+            head += capacity - offset;
+            continue;
+        }
+
+        size_t record = record_size(size);
+        if (record > capacity - offset || record > tail - head) {
+            // the other side is broken, drop everything
+            PRINT_DEBUG("corrupted shared memory ring");
+            header->head.store(tail, std::memory_order_release);
+            return false;
+        }
+
+        data.assign(header->data + offset + SHM_RECORD_HEADER_SIZE, size);
+        header->head.store(head + record, std::memory_order_release);
+        return true;
+    }
+
+    header->head.store(head, std::memory_order_release);
+    return false;
+}
+
+bool shm_doorbell_create(struct Shm_Doorbell &bell, const std::string &name)
+{
+    struct Shm_Doorbell_Header *header = (struct Shm_Doorbell_Header *)shm_map(name, sizeof(struct Shm_Doorbell_Header), true);
+    if (!header) return false;
+
+    header->magic.store(SHM_DOORBELL_MAGIC, std::memory_order_release);
+    bell.header = header;
+    bell.owned_name = name;
+    return true;
+}
+
+bool shm_doorbell_open(struct Shm_Doorbell &bell, const std::string &name)
+{
+    struct Shm_Doorbell_Header *header = (struct Shm_Doorbell_Header *)shm_map(name, sizeof(struct Shm_Doorbell_Header), false);
+    if (!header) return false;
+
+    if (header->magic.load(std::memory_order_acquire) != SHM_DOORBELL_MAGIC) {
+        munmap(header, sizeof(struct Shm_Doorbell_Header));
+        return false;
+    }
+
+    bell.header = header;
+    bell.owned_name.clear();
+    return true;
+}
+
+void shm_doorbell_close(struct Shm_Doorbell &bell)
+{
+    if (!bell.header) return;
+
+    munmap(bell.header, sizeof(struct Shm_Doorbell_Header));
+    if (bell.owned_name.size()) shm_unlink(bell.owned_name.c_str());
+    bell = Shm_Doorbell{};
+}
+
+void shm_doorbell_ring(struct Shm_Doorbell &bell)
+{
+    if (!bell.header) return;
+
+    // orders the write of the ring before reading 'waiting', the owner does the opposite
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!bell.header->waiting.load(std::memory_order_relaxed)) return;
+    shm_doorbell_wake(bell);
+}
+
+void shm_doorbell_wake(struct Shm_Doorbell &bell)
+{
+    bell.header->seq.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, (uint32 *)&bell.header->seq, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+void shm_doorbell_set_waiting(struct Shm_Doorbell &bell, bool waiting)
+{
+    bell.header->waiting.store(waiting ? 1 : 0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void shm_doorbell_wait(struct Shm_Doorbell &bell, uint32 seq, int timeout_ms)
+{
+    struct timespec timeout{};
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    syscall(SYS_futex, (uint32 *)&bell.header->seq, FUTEX_WAIT, seq, &timeout, nullptr, 0);
+}
+
+#else
+
+uint64 shm_new_instance_id() { return 0; }
+uint64 shm_host_id() { return 0; }
+void shm_cleanup_stale() {}
+bool shm_ring_create(struct Shm_Ring &ring, const std::string &name, uint32 capacity) { return false; }
+bool shm_ring_open(struct Shm_Ring &ring, const std::string &name) { return false; }
+void shm_ring_close(struct Shm_Ring &ring) {}
+bool shm_ring_push(struct Shm_Ring &ring, const char *prefix, size_t prefix_size, const std::string &data) { return false; }
+bool shm_ring_pop(struct Shm_Ring &ring, std::string &data) { return false; }
+bool shm_doorbell_create(struct Shm_Doorbell &bell, const std::string &name) { return false; }
+bool shm_doorbell_open(struct Shm_Doorbell &bell, const std::string &name) { return false; }
+void shm_doorbell_close(struct Shm_Doorbell &bell) {}
+void shm_doorbell_ring(struct Shm_Doorbell &bell) {}
+void shm_doorbell_wake(struct Shm_Doorbell &bell) {}
+void shm_doorbell_set_waiting(struct Shm_Doorbell &bell, bool waiting) {}
+void shm_doorbell_wait(struct Shm_Doorbell &bell, uint32 seq, int timeout_ms) {}
+
+#endif
+
+std::string shm_ring_name(uint64 receiver_id, uint64 sender_id)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/" SHM_NAME_PREFIX "%016llx-%016llx", (unsigned long long)receiver_id, (unsigned long long)sender_id);
+    return name;
+}
+
+std::string shm_doorbell_name(uint64 owner_id)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/" SHM_NAME_PREFIX "%016llx", (unsigned long long)owner_id);
+    return name;
+}
+
+bool shm_ring_is_open(const struct Shm_Ring &ring)
+{
+    return ring.header != nullptr;
+}
+
+bool shm_ring_closed_by_peer(const struct Shm_Ring &ring)
+{
+    return ring.header && ring.header->closed.load(std::memory_order_acquire);
+}
+
+bool shm_ring_empty(const struct Shm_Ring &ring)
+{
+    return !ring.header || ring.header->head.load(std::memory_order_relaxed) == ring.header->tail.load(std::memory_order_acquire);
+}
+
+uint32 shm_doorbell_seq(const struct Shm_Doorbell &bell)
+{
+    return bell.header ? bell.header->seq.load(std::memory_order_acquire) : 0;
+}
@@ -74,6 +74,19 @@ Steam_Client::Steam_Client()
     local_storage->update_save_filenames(Local_Storage::remote_storage_folder);
 
     network = new Networking(settings_server->get_local_steam_id(), appid, settings_server->get_port(), &(settings_server->custom_broadcasts), settings_server->disable_networking);
+    network->setReliableUDP(settings_server->reliable_udp);
+    network->setCoalesceDelay(settings_server->udp_coalesce_delay_ms);
+    network->setGossipDiscovery(settings_server->gossip_discovery);
+    network->setSharedMemoryTransport(settings_server->shared_memory_transport);
+    network->setImpairmentSeed(settings_server->network_impairment_seed);
+    network->setImpairment(settings_server->network_impairment);
+    for (auto &peer : settings_server->network_impairment_peers) network->setImpairment(peer.second, peer.first);
+    if (settings_server->network_capture.size()) {
+        network->startCapture(settings_server->network_capture);
+    }
+    if (settings_server->network_io_thread) {
+        network->startIOThread();
+    }
 
     run_every_runcb = new RunEveryRunCB();
 
@@ -175,6 +188,7 @@ Steam_Client::Steam_Client()
     gameserver_has_ipv6_functions = false;
 
     last_cb_run = 0;
+    callbacks_time_budget = std::chrono::microseconds(settings_client->callbacks_time_budget_us);
     PRINT_DEBUG("end *********");
 
     reset_LastError();
@@ -942,6 +956,11 @@ void Steam_Client::RunCallbacks(bool runClientCB, bool runGameserverCB)
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     cb_run_active = true;
 
+    // the budget starts with the networking, which always runs, then what's left after the deadline
+    // runs first the next time (each step makes some progress): the interfaces, then the call results in order
+    auto deadline = CALLBACKS_NO_DEADLINE;
+    if (callbacks_time_budget.count()) deadline = std::chrono::high_resolution_clock::now() + callbacks_time_budget;
+
     // PRINT_DEBUG("network *********");
     network->Run(); // networking must run first since it receives messages use by each run_callback()
 
@@ -949,19 +968,19 @@ void Steam_Client::RunCallbacks(bool runClientCB, bool runGameserverCB)
     steam_matchmaking_servers->RunCallbacks();
     
     // PRINT_DEBUG("run_every_runcb *********");
-    run_every_runcb->run();
+    run_every_runcb->run(deadline);
 
     // PRINT_DEBUG("steam_gameserver *********");
     steam_gameserver->RunCallbacks();
 
     if (runClientCB) {
         // PRINT_DEBUG("callback_results_client *********");
-        callback_results_client->runCallResults();
+        callback_results_client->runCallResults(deadline);
     }
 
     if (runGameserverCB) {
         // PRINT_DEBUG("callback_results_server *********");
-        callback_results_server->runCallResults();
+        callback_results_server->runCallResults(deadline);
     }
 
     // PRINT_DEBUG("callbacks_server *********");
@@ -970,11 +989,27 @@ void Steam_Client::RunCallbacks(bool runClientCB, bool runGameserverCB)
     // PRINT_DEBUG("callbacks_client *********");
     callbacks_client->runCallBacks();
 
+    ++callbacks_runs;
+    if (deadline != CALLBACKS_NO_DEADLINE && std::chrono::high_resolution_clock::now() > deadline) ++callbacks_runs_over_budget;
+    dump_callbacks_counters();
+
     last_cb_run = (unsigned long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
     cb_run_active = false;
     PRINT_DEBUG("done ******************************************************");
 }
 
+void Steam_Client::dump_callbacks_counters()
+{
+    constexpr const static double COUNTERS_DUMP_INTERVAL = 60.0;
+    if (!callbacks_time_budget.count() || !check_timedout(last_callbacks_counters_dump, COUNTERS_DUMP_INTERVAL)) return;
+    last_callbacks_counters_dump = std::chrono::high_resolution_clock::now();
+
+    PRINT_DEBUG("callbacks: %llu runs, %llu over the budget of %llu us, deferred %llu interface callbacks, %llu client and %llu server call results",
+        callbacks_runs, callbacks_runs_over_budget,
+        (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(callbacks_time_budget).count(),
+        run_every_runcb->deferred(), callback_results_client->deferred(), callback_results_server->deferred());
+}
+
 void Steam_Client::DestroyAllInterfaces()
 {
     PRINT_DEBUG_TODO();
@@ -239,7 +239,7 @@ bool Steam_Networking::SendP2PPacket( CSteamID steamIDRemote, const void *pubDat
     new_connection_times.erase(steamIDRemote);
 
     conn->open_channels.insert(nChannel);
-    bool ret = network->sendTo(&msg, reliable);
+    bool ret = network->sendTo(&msg, reliable, NULL, eP2PSendType == k_EP2PSendUnreliableNoDelay);
     PRINT_DEBUG("Sent message with size: %zu %u", msg.network().data().size(), ret);
     return ret;
 }
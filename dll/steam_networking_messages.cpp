@@ -202,7 +202,8 @@ EResult Steam_Networking_Messages::SendMessageToUser( const SteamNetworkingIdent
     msg.mutable_networking_messages()->set_id_from(conn->second.id);
     msg.mutable_networking_messages()->set_data(pubData, cubData);
 
-    network->sendTo(&msg, reliable);
+    bool no_nagle = (nSendFlags & (k_nSteamNetworkingSend_NoNagle | k_nSteamNetworkingSend_NoDelay)) != 0;
+    network->sendTo(&msg, reliable, NULL, no_nagle);
     return k_EResultOK;
 }
 
@@ -345,10 +346,16 @@ ESteamNetworkingConnectionState Steam_Networking_Messages::GetSessionConnectionI
     if (pQuickStatus) {
         memset(pQuickStatus, 0, sizeof(SteamNetConnectionRealTimeStatus_t));
         pQuickStatus->m_eState = state;
-        pQuickStatus->m_nPing = 10; //TODO: calculate real numbers?
+        struct Connection_Stats stats{};
+        network->getConnectionStats(conn->second.remote_identity.GetSteamID(), stats);
+        pQuickStatus->m_nPing = stats.rtt_sampled ? (int)(stats.rtt_ms + 0.5) : 10;
         pQuickStatus->m_flConnectionQualityLocal = 1.0;
         pQuickStatus->m_flConnectionQualityRemote = 1.0;
-        //TODO
+        pQuickStatus->m_flOutPacketsPerSec = (float)stats.out_packets_per_sec;
+        pQuickStatus->m_flOutBytesPerSec = (float)stats.out_bytes_per_sec;
+        pQuickStatus->m_flInPacketsPerSec = (float)stats.in_packets_per_sec;
+        pQuickStatus->m_flInBytesPerSec = (float)stats.in_bytes_per_sec;
+        pQuickStatus->m_cbSentUnackedReliable = (int)stats.reliable_unacked_bytes;
     }
 
     return k_ESteamNetworkingConnectionState_Connected;
@@ -745,7 +745,8 @@ EResult Steam_Networking_Sockets::SendMessageToConnection( HSteamNetConnection h
 
     bool reliable = false;
     if (nSendFlags & k_nSteamNetworkingSend_Reliable) reliable = true;
-    if (network->sendTo(&msg, reliable)) {
+    bool no_nagle = (nSendFlags & (k_nSteamNetworkingSend_NoNagle | k_nSteamNetworkingSend_NoDelay)) != 0;
+    if (network->sendTo(&msg, reliable, NULL, no_nagle)) {
         if (pOutMessageNumber) *pOutMessageNumber = message_number;
         return k_EResultOK;
     }
@@ -820,8 +821,15 @@ void Steam_Networking_Sockets::SendMessages( int nMessages, SteamNetworkingMessa
 /// on the next transmission time (often that means right now).
 EResult Steam_Networking_Sockets::FlushMessagesOnConnection( HSteamNetConnection hConn )
 {
-    PRINT_DEBUG_TODO();
+    PRINT_DEBUG("%u", hConn);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
+
+    auto connect_socket = sbcs->connect_sockets.find(hConn);
+    if (connect_socket == sbcs->connect_sockets.end()) return k_EResultInvalidParam;
+    if (connect_socket->second.status == CONNECT_SOCKET_CLOSED) return k_EResultNoConnection;
+    if (connect_socket->second.status == CONNECT_SOCKET_TIMEDOUT) return k_EResultNoConnection;
+
+    network->flushMessages((uint64)connect_socket->second.remote_identity.GetSteamID64());
     return k_EResultOK;
 }
 
@@ -930,16 +938,17 @@ EResult Steam_Networking_Sockets::GetConnectionRealTimeStatus( HSteamNetConnecti
 
     if (pStatus) {
         pStatus->m_eState = convert_status(connect_socket->second.status);
-        pStatus->m_nPing = 10; //TODO: calculate real numbers?
+        struct Connection_Stats stats{};
+        network->getConnectionStats(connect_socket->second.remote_identity.GetSteamID(), stats);
+        pStatus->m_nPing = stats.rtt_sampled ? (int)(stats.rtt_ms + 0.5) : 10;
         pStatus->m_flConnectionQualityLocal = 1.0;
         pStatus->m_flConnectionQualityRemote = 1.0;
-        //TODO: rest
-        pStatus->m_flOutPacketsPerSec = 0.0;
-        pStatus->m_flOutBytesPerSec = 0.0;
-        pStatus->m_flInPacketsPerSec = 0.0;
-        pStatus->m_flInBytesPerSec = 0.0;
-        pStatus->m_cbSentUnackedReliable = 0.0;
-        pStatus->m_usecQueueTime = 0.0;
+        pStatus->m_flOutPacketsPerSec = (float)stats.out_packets_per_sec;
+        pStatus->m_flOutBytesPerSec = (float)stats.out_bytes_per_sec;
+        pStatus->m_flInPacketsPerSec = (float)stats.in_packets_per_sec;
+        pStatus->m_flInBytesPerSec = (float)stats.in_bytes_per_sec;
+        pStatus->m_cbSentUnackedReliable = (int)stats.reliable_unacked_bytes;
+        pStatus->m_usecQueueTime = 0;
 
         //Note some games (volcanoids) might not allocate a struct the whole size of SteamNetworkingQuickConnectionStatus
         //keep this in mind in future interface updates
@@ -40,6 +40,7 @@ Steam_Networking_Utils::Steam_Networking_Utils(class Settings *settings, class N
     this->callback_results = callback_results;
     this->callbacks = callbacks;
     this->run_every_runcb = run_every_runcb;
+    this->impairment = settings->network_impairment;
     
     this->network->setCallback(CALLBACK_ID_USER_STATUS, settings->get_local_steam_id(), &Steam_Networking_Utils::steam_callback, this);
     this->run_every_runcb->add(&Steam_Networking_Utils::steam_run_every_runcb, this);
@@ -51,6 +52,34 @@ Steam_Networking_Utils::~Steam_Networking_Utils()
     this->run_every_runcb->remove(&Steam_Networking_Utils::steam_run_every_runcb, this);
 }
 
+float *Steam_Networking_Utils::impairment_float(Impairment_Config &config, ESteamNetworkingConfigValue eValue)
+{
+    switch (eValue) {
+    case k_ESteamNetworkingConfig_FakePacketLoss_Send: return &config.send.loss_pct;
+    case k_ESteamNetworkingConfig_FakePacketLoss_Recv: return &config.recv.loss_pct;
+    case k_ESteamNetworkingConfig_FakePacketReorder_Send: return &config.send.reorder_pct;
+    case k_ESteamNetworkingConfig_FakePacketReorder_Recv: return &config.recv.reorder_pct;
+    case k_ESteamNetworkingConfig_FakePacketDup_Send: return &config.send.dup_pct;
+    case k_ESteamNetworkingConfig_FakePacketDup_Recv: return &config.recv.dup_pct;
+    default: return NULL;
+    }
+}
+
+int32 *Steam_Networking_Utils::impairment_int32(Impairment_Config &config, ESteamNetworkingConfigValue eValue)
+{
+    switch (eValue) {
+    case k_ESteamNetworkingConfig_FakePacketLag_Send: return &config.send.lag_ms;
+    case k_ESteamNetworkingConfig_FakePacketLag_Recv: return &config.recv.lag_ms;
+    case k_ESteamNetworkingConfig_FakePacketReorder_Time: return &config.reorder_time_ms;
+    case k_ESteamNetworkingConfig_FakePacketDup_TimeMax: return &config.dup_time_max_ms;
+    case k_ESteamNetworkingConfig_FakeRateLimit_Send_Rate: return &config.send.rate;
+    case k_ESteamNetworkingConfig_FakeRateLimit_Send_Burst: return &config.send.burst;
+    case k_ESteamNetworkingConfig_FakeRateLimit_Recv_Rate: return &config.recv.rate;
+    case k_ESteamNetworkingConfig_FakeRateLimit_Recv_Burst: return &config.recv.burst;
+    default: return NULL;
+    }
+}
+
 void Steam_Networking_Utils::free_steam_message_data(SteamNetworkingMessage_t *pMsg)
 {
     free(pMsg->m_pData);
@@ -145,13 +174,35 @@ ESteamNetworkingAvailability Steam_Networking_Utils::GetRelayNetworkStatus( Stea
     return k_ESteamNetworkingAvailability_Current;
 }
 
+// the ping locations carry the steam id of the user they belong to,
+// the estimates are the round trip times measured to that user
+#define PING_LOCATION_ID_OFFSET 16
+#define PING_ESTIMATE_DEFAULT 2
+
+static uint64 ping_location_id(const SteamNetworkPingLocation_t &location)
+{
+    uint64 id;
+    memcpy(&id, location.m_data + PING_LOCATION_ID_OFFSET, sizeof(id));
+    return id;
+}
+
+int Steam_Networking_Utils::estimate_ping(uint64 id)
+{
+    struct Connection_Stats stats{};
+    if (!id || id == settings->get_local_steam_id().ConvertToUint64()) return PING_ESTIMATE_DEFAULT;
+    if (!network->getConnectionStats(CSteamID(id), stats) || !stats.rtt_sampled) return PING_ESTIMATE_DEFAULT;
+    return (int)(stats.rtt_ms + 0.5);
+}
+
 float Steam_Networking_Utils::GetLocalPingLocation( SteamNetworkPingLocation_t &result )
 {
     PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (relay_initialized) {
+        uint64 id = settings->get_local_steam_id().ConvertToUint64();
         result.m_data[2] = 123;
         result.m_data[8] = 67;
+        memcpy(result.m_data + PING_LOCATION_ID_OFFSET, &id, sizeof(id));
         return 2.0;
     }
 
@@ -160,33 +211,54 @@ float Steam_Networking_Utils::GetLocalPingLocation( SteamNetworkPingLocation_t &
 
 int Steam_Networking_Utils::EstimatePingTimeBetweenTwoLocations( const SteamNetworkPingLocation_t &location1, const SteamNetworkPingLocation_t &location2 )
 {
-    PRINT_DEBUG_TODO();
+    PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    //return k_nSteamNetworkingPing_Unknown;
-    return 2;
+    uint64 local_id = settings->get_local_steam_id().ConvertToUint64();
+    uint64 id1 = ping_location_id(location1);
+    uint64 id2 = ping_location_id(location2);
+    // we only know the times between us and the other users
+    if (id1 == local_id) return estimate_ping(id2);
+    if (id2 == local_id) return estimate_ping(id1);
+    return PING_ESTIMATE_DEFAULT;
 }
 
 
 int Steam_Networking_Utils::EstimatePingTimeFromLocalHost( const SteamNetworkPingLocation_t &remoteLocation )
 {
-    PRINT_DEBUG_TODO();
+    PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return 2;
+    return estimate_ping(ping_location_id(remoteLocation));
 }
 
 
 void Steam_Networking_Utils::ConvertPingLocationToString( const SteamNetworkPingLocation_t &location, char *pszBuf, int cchBufSize )
 {
-    PRINT_DEBUG_TODO();
+    PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    strncpy(pszBuf, "fra=10+2", cchBufSize);
+    if (!pszBuf || cchBufSize <= 0) return;
+    uint64 id = ping_location_id(location);
+    if (id) {
+        snprintf(pszBuf, cchBufSize, "fra=10+2 id=%llu", (unsigned long long)id);
+    } else {
+        snprintf(pszBuf, cchBufSize, "fra=10+2");
+    }
 }
 
 
 bool Steam_Networking_Utils::ParsePingLocationString( const char *pszString, SteamNetworkPingLocation_t &result )
 {
-    PRINT_DEBUG_TODO();
+    PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    if (!pszString) return false;
+    memset(&result, 0, sizeof(result));
+    result.m_data[2] = 123;
+    result.m_data[8] = 67;
+    const char *id_str = strstr(pszString, "id=");
+    if (id_str) {
+        uint64 id = strtoull(id_str + 3, nullptr, 10);
+        memcpy(result.m_data + PING_LOCATION_ID_OFFSET, &id, sizeof(id));
+    }
+
     return true;
 }
 
@@ -358,8 +430,27 @@ bool Steam_Networking_Utils::SetConnectionConfigValueString( HSteamNetConnection
 bool Steam_Networking_Utils::SetConfigValue( ESteamNetworkingConfigValue eValue, ESteamNetworkingConfigScope eScopeType, intptr_t scopeObj,
     ESteamNetworkingConfigDataType eDataType, const void *pArg )
 {
-    PRINT_DEBUG("TODO %i %i " "%" PRIdPTR " %i %p", eValue, eScopeType, scopeObj, eDataType, pArg);
+    PRINT_DEBUG("%i %i " "%" PRIdPTR " %i %p", eValue, eScopeType, scopeObj, eDataType, pArg);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
+
+    // the fake network conditions are global only, NULL restores the default
+    Impairment_Config defaults{};
+    float *float_value = impairment_float(impairment, eValue);
+    int32 *int32_value = impairment_int32(impairment, eValue);
+    if (float_value) {
+        if (eScopeType != k_ESteamNetworkingConfig_Global) return false;
+        if (pArg && eDataType != k_ESteamNetworkingConfig_Float) return false;
+        *float_value = pArg ? std::min(std::max(*(const float *)pArg, 0.0f), 100.0f) : *impairment_float(defaults, eValue);
+    } else if (int32_value) {
+        if (eScopeType != k_ESteamNetworkingConfig_Global) return false;
+        if (pArg && eDataType != k_ESteamNetworkingConfig_Int32) return false;
+        *int32_value = pArg ? std::max(*(const int32 *)pArg, 0) : *impairment_int32(defaults, eValue);
+    } else {
+        PRINT_DEBUG("TODO");
+        return true;
+    }
+
+    network->setImpairment(impairment);
     return true;
 }
 
@@ -374,9 +465,26 @@ bool Steam_Networking_Utils::SetConfigValue( ESteamNetworkingConfigValue eValue,
 ESteamNetworkingGetConfigValueResult Steam_Networking_Utils::GetConfigValue( ESteamNetworkingConfigValue eValue, ESteamNetworkingConfigScope eScopeType, intptr_t scopeObj,
     ESteamNetworkingConfigDataType *pOutDataType, void *pResult, size_t *cbResult )
 {
-    PRINT_DEBUG_TODO();
+    PRINT_DEBUG("%i %i " "%" PRIdPTR " %p %zu", eValue, eScopeType, scopeObj, pResult, cbResult ? *cbResult : (size_t)0);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return k_ESteamNetworkingGetConfigValue_BadValue;
+
+    float *float_value = impairment_float(impairment, eValue);
+    int32 *int32_value = impairment_int32(impairment, eValue);
+    if (!float_value && !int32_value) return k_ESteamNetworkingGetConfigValue_BadValue;
+    if (eScopeType != k_ESteamNetworkingConfig_Global) return k_ESteamNetworkingGetConfigValue_BadScopeObj;
+    if (!cbResult) return k_ESteamNetworkingGetConfigValue_BadValue;
+
+    const void *value = float_value ? (const void *)float_value : (const void *)int32_value;
+    size_t size = float_value ? sizeof(*float_value) : sizeof(*int32_value);
+    if (pOutDataType) *pOutDataType = float_value ? k_ESteamNetworkingConfig_Float : k_ESteamNetworkingConfig_Int32;
+    if (!pResult || *cbResult < size) {
+        *cbResult = size;
+        return k_ESteamNetworkingGetConfigValue_BufferTooSmall;
+    }
+
+    memcpy(pResult, value, size);
+    *cbResult = size;
+    return k_ESteamNetworkingGetConfigValue_OK;
 }
 
 
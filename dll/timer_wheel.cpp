@@ -0,0 +1,145 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "dll/timer_wheel.h"
+
+#define SLOT_MASK ((uint64)Timer_Wheel::SLOTS - 1)
+
+static unsigned lowest_bit(uint64 value)
+{
+    unsigned bit = 0;
+    while (!(value & 1)) {
+        value >>= 1;
+        ++bit;
+    }
+
+    return bit;
+}
+
+Timer_Wheel::Timer_Wheel()
+{
+    start = std::chrono::high_resolution_clock::now();
+}
+
+uint64 Timer_Wheel::tick_of(std::chrono::high_resolution_clock::time_point time) const
+{
+    if (time <= start) return 0;
+
+    // rounded up, a timer never expires before its deadline
+    auto elapsed = time - start;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed);
+    return (uint64)ms.count() + (ms < elapsed ? 1 : 0);
+}
+
+void Timer_Wheel::insert(const struct Timer_Wheel_Entry &entry)
+{
+    uint64 tick = entry.tick < current ? current : entry.tick;
+
+    // the level is the one of the highest bit which differs from the current tick, so the slot
+    // is reached when the levels below go around and cascade it
+    uint64 diff = tick ^ current;
+    unsigned level = 0;
+    while (level + 1 < LEVELS && (diff >> (SLOT_BITS * (level + 1)))) ++level;
+
+    unsigned slot;
+    if (tick - current >= (1ULL << (SLOT_BITS * LEVELS))) {
+        // farther than the whole wheel: the top level slot reached last, it's inserted again from there
+        slot = (unsigned)(((current >> (SLOT_BITS * level)) - 1) & SLOT_MASK);
+    } else {
+        slot = (unsigned)((tick >> (SLOT_BITS * level)) & SLOT_MASK);
+    }
+
+    slots[level][slot].push_back(entry);
+    occupied[level] |= 1ULL << slot;
+}
+
+void Timer_Wheel::cascade()
+{
+    // 'current' just reached the start of a level 0 rotation, the levels which went around
+    // redistribute their slot, the highest first since it can fill the slots of the others
+    unsigned top = 1;
+    while (top + 1 < LEVELS && !((current >> (SLOT_BITS * top)) & SLOT_MASK)) ++top;
+
+    for (unsigned level = top; level >= 1; --level) {
+        unsigned slot = (unsigned)((current >> (SLOT_BITS * level)) & SLOT_MASK);
+        if (!(occupied[level] & (1ULL << slot))) continue;
+
+        cascading.swap(slots[level][slot]);
+        occupied[level] &= ~(1ULL << slot);
+        for (auto &entry : cascading) insert(entry);
+        cascading.clear();
+    }
+}
+
+uint64 Timer_Wheel::schedule(uint64 key, std::chrono::high_resolution_clock::time_point deadline)
+{
+    struct Timer_Wheel_Entry entry{};
+    entry.key = key;
+    entry.tick = tick_of(deadline);
+    insert(entry);
+    ++count;
+    return entry.tick;
+}
+
+void Timer_Wheel::advance(std::chrono::high_resolution_clock::time_point now, std::vector<struct Timer_Wheel_Entry> &expired)
+{
+    // rounded down unlike the deadlines, tick N only expires once N ms have fully elapsed
+    if (now <= start) return;
+    uint64 target = (uint64)std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
+    while (current <= target) {
+        unsigned slot = (unsigned)(current & SLOT_MASK);
+        if (occupied[0] & (1ULL << slot)) {
+            auto &entries = slots[0][slot];
+            expired.insert(expired.end(), entries.begin(), entries.end());
+            count -= entries.size();
+            entries.clear(); // keeps the capacity for the next rotation
+            occupied[0] &= ~(1ULL << slot);
+        }
+
+        // straight to the next occupied slot of this rotation or to the next rotation
+        uint64 later = slot + 1 < SLOTS ? occupied[0] >> (slot + 1) : 0;
+        uint64 next = later ? current + 1 + lowest_bit(later) : (current | SLOT_MASK) + 1;
+        current = next <= target + 1 ? next : target + 1;
+        if (!(current & SLOT_MASK)) cascade();
+    }
+}
+
+std::chrono::high_resolution_clock::time_point Timer_Wheel::next_deadline() const
+{
+    // the slots of a level all come after the ones of the levels below, only the slot
+    // reached first in the lowest occupied level matters
+    for (unsigned level = 0; level < LEVELS; ++level) {
+        if (!occupied[level]) continue;
+
+        unsigned shift = SLOT_BITS * level;
+        uint64 rotation = (current >> (shift + SLOT_BITS)) << (shift + SLOT_BITS);
+        unsigned slot = (unsigned)((current >> shift) & SLOT_MASK);
+        // the current slot of a higher level was already cascaded
+        if (level) ++slot;
+
+        uint64 later = slot < SLOTS ? occupied[level] >> slot : 0;
+        uint64 tick = later ? rotation + ((uint64)(slot + lowest_bit(later)) << shift) : rotation + ((uint64)SLOTS << shift);
+        return start + std::chrono::milliseconds(tick);
+    }
+
+    return std::chrono::high_resolution_clock::time_point::max();
+}
+
+size_t Timer_Wheel::size() const
+{
+    return count;
+}
@@ -0,0 +1,825 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/*
+  Microbenchmarks of the emu internals, run without any game.
+  usage: benchmark <mode> [args...]
+*/
+
+#include "dll/common_includes.h"
+#include "dll/steam_networking.h"
+#include "dll/steam_networking_sockets.h"
+#include "dll/steam_networking_messages.h"
+#include "dll/dll.h"
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <ctime>
+#include <atomic>
+#include <new>
+
+// the emu networking listens on this port during the benchmarks, away from the default one
+#define BENCHMARK_PORT 47600
+// the peers of the load generator listen on the ports after it
+#define LOAD_MAX_PEERS 64
+// traffic before the measurement, to set up the connections and sessions
+#define LOAD_WARMUP_SECONDS 1.0
+// after the measurement, for the messages still on their way
+#define LOAD_DRAIN_SECONDS 1.0
+// without a rate limit, unreliable messages are sent to each destination by bursts of this size every loop
+// and reliable ones are sent as long as less than LOAD_MAX_IN_FLIGHT weren't received yet
+#define LOAD_UNLIMITED_BURST 32
+#define LOAD_MAX_IN_FLIGHT 1024
+#define BENCHMARK_APPID 480
+
+// counted by the replaced operator new below, see bench_recv
+static std::atomic<uint64> heap_allocations{};
+
+// the compiler must not see the malloc()/free() of the replaced operators in the callers, it would
+// pair them with the new/delete expressions and warn about a mismatch
+#if defined(_MSC_VER)
+#define ALLOCATION_HOOK __declspec(noinline)
+#else
+#define ALLOCATION_HOOK __attribute__((noinline))
+#endif
+
+ALLOCATION_HOOK void *operator new(std::size_t size)
+{
+    ++heap_allocations;
+    void *ptr = std::malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+ALLOCATION_HOOK void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+ALLOCATION_HOOK void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+static const uint64 local_id = CSteamID(1, k_EUniversePublic, k_EAccountTypeIndividual).ConvertToUint64();
+
+static uint64 fake_peer_id(uint32 index)
+{
+    return CSteamID(1000 + index, k_EUniversePublic, k_EAccountTypeIndividual).ConvertToUint64();
+}
+
+static double elapsed_ns(std::chrono::high_resolution_clock::time_point start)
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// plain UDP socket on localhost pretending to be a bunch of peers
+class Fake_Peers {
+    sock_t sock;
+    IP_PORT target{};
+
+public:
+    Fake_Peers(uint16 target_port)
+    {
+        sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(0x7F000001);
+        addr.sin_port = 0;
+        bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+
+        target.ip = htonl(0x7F000001);
+        target.port = htons(target_port);
+    }
+
+    ~Fake_Peers()
+    {
+#if defined(STEAM_WIN32)
+        closesocket(sock);
+#else
+        close(sock);
+#endif
+    }
+
+    // a PONG makes the emu consider the peer reachable over UDP right away
+    // without a 'tcp_port' the emu keeps trying to connect to it
+    void announce(uint64 peer_id, uint16 tcp_port = 0)
+    {
+        Common_Message msg;
+        msg.set_source_id(peer_id);
+        Announce *announce = msg.mutable_announce();
+        announce->set_type(Announce::PONG);
+        announce->add_ids(peer_id);
+        announce->set_tcp_port(tcp_port);
+        announce->set_appid(BENCHMARK_APPID);
+
+        send(msg.SerializeAsString());
+    }
+
+    void send(const std::string &buffer)
+    {
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = target.ip;
+        addr.sin_port = target.port;
+        sendto(sock, buffer.data(), (int)buffer.size(), 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+};
+
+// cost of routing a message to one of N peers with Networking::sendTo()
+static int bench_sendto(int argc, char **argv)
+{
+    uint32 max_peers = argc > 0 ? (uint32)std::stoul(argv[0]) : 1000;
+    constexpr const static unsigned ITERATIONS = 20000;
+
+    std::set<IP_PORT> custom_broadcasts{};
+    Networking network(CSteamID(local_id), BENCHMARK_APPID, BENCHMARK_PORT, &custom_broadcasts, false);
+    Fake_Peers peers(BENCHMARK_PORT);
+    std::mt19937 rng(1234);
+
+    std::cout << "peers, unreliable sendTo() ns/msg, reliable sendTo() without TCP ns/msg (routing only)" << std::endl;
+    uint32 announced = 0;
+    for (uint32 count = 1; count <= max_peers; count *= 10) {
+        while (announced < count) {
+            peers.announce(fake_peer_id(announced++));
+            // don't overflow the socket receive buffer
+            if (!(announced % 64)) network.Run();
+        }
+
+        for (int i = 0; i < 10; ++i) {
+            network.Run();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        Common_Message msg;
+        msg.set_source_id(local_id);
+        msg.mutable_network()->set_type(Network_pb::DATA);
+        msg.mutable_network()->set_data(std::string(64, 'x'));
+
+        std::uniform_int_distribution<uint32> pick(0, count - 1);
+        double times[2]{};
+        for (int reliable = 0; reliable < 2; ++reliable) {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (unsigned i = 0; i < ITERATIONS; ++i) {
+                msg.set_dest_id(fake_peer_id(pick(rng)));
+                network.sendTo(&msg, reliable == 1);
+            }
+
+            times[reliable] = elapsed_ns(start) / ITERATIONS;
+        }
+
+        std::cout << count << ", " << times[0] << ", " << times[1] << std::endl;
+        if (count == max_peers) break;
+        if (count * 10 > max_peers) count = max_peers / 10;
+    }
+
+    return 0;
+}
+
+static void count_message(void *object, Common_Message *msg)
+{
+    ++*(uint64 *)object;
+}
+
+// heap allocations of Networking::Run() while it receives and dispatches small unreliable messages,
+// the received messages are parsed in an arena so only the bytes fields longer than the small
+// string optimization of std::string should still allocate (the protobuf strings aren't in the arena)
+static int bench_recv(int argc, char **argv)
+{
+    constexpr const static unsigned ROUNDS = 2000;
+    constexpr const static unsigned MESSAGES_PER_ROUND = 32;
+
+    std::set<IP_PORT> custom_broadcasts{};
+    Networking network(CSteamID(local_id), BENCHMARK_APPID, BENCHMARK_PORT, &custom_broadcasts, false);
+    uint64 received = 0;
+    network.setCallback(CALLBACK_ID_NETWORKING, CSteamID(local_id), &count_message, &received);
+
+    // only accepted by the kernel, enough for the emu to stop reconnecting
+    sock_t listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x7F000001);
+    socklen_t addr_len = sizeof(addr);
+    bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+    listen(listener, 4);
+    getsockname(listener, (struct sockaddr *)&addr, &addr_len);
+
+    Fake_Peers peers(BENCHMARK_PORT);
+    peers.announce(fake_peer_id(0), ntohs(addr.sin_port));
+    for (int i = 0; i < 10; ++i) {
+        network.Run();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::cout << "payload size, received, heap allocations/msg, ns/msg, parse arena resets, overflows, peak bytes" << std::endl;
+    for (uint32 size : { 8u, 64u, 256u, 1024u }) {
+        Common_Message msg;
+        msg.set_source_id(fake_peer_id(0));
+        msg.set_dest_id(local_id);
+        msg.mutable_network()->set_type(Network_pb::DATA);
+        msg.mutable_network()->set_data(std::string(size, 'x'));
+        std::string buffer = msg.SerializeAsString();
+
+        // the first rounds grow the buffers which are kept afterwards
+        uint64 allocations = 0, measured = 0;
+        double run_ns = 0;
+        struct Network_Counters counters_before = network.getCounters();
+        for (unsigned round = 0; round < ROUNDS; ++round) {
+            for (unsigned i = 0; i < MESSAGES_PER_ROUND; ++i) peers.send(buffer);
+
+            uint64 received_before = received;
+            uint64 allocations_before = heap_allocations;
+            auto start = std::chrono::high_resolution_clock::now();
+            network.Run();
+            if (round < ROUNDS / 10) continue;
+
+            run_ns += elapsed_ns(start);
+            allocations += heap_allocations - allocations_before;
+            measured += received - received_before;
+        }
+
+        struct Network_Counters counters = network.getCounters();
+        std::cout << size << ", " << measured << ", " << (measured ? (double)allocations / measured : 0) << ", " << (measured ? run_ns / measured : 0) << ", "
+            << counters.parse_arena_resets - counters_before.parse_arena_resets << ", "
+            << counters.parse_arena_overflows - counters_before.parse_arena_overflows << ", " << counters.parse_arena_peak << std::endl;
+    }
+
+    network.rmCallback(CALLBACK_ID_NETWORKING, CSteamID(local_id), &count_message, &received);
+#if defined(STEAM_WIN32)
+    closesocket(listener);
+#else
+    close(listener);
+#endif
+    return 0;
+}
+
+enum Load_Api {
+    LOAD_API_SOCKETS, // ISteamNetworkingSockets
+    LOAD_API_MESSAGES, // ISteamNetworkingMessages
+    LOAD_API_P2P, // ISteamNetworking P2P packets
+};
+
+enum Load_Pattern {
+    LOAD_PATTERN_RING, // every peer sends to the next one
+    LOAD_PATTERN_ALL, // every peer sends to all the others
+    LOAD_PATTERN_FANIN, // every peer sends to the first one, like clients to a server
+};
+
+// every message starts with this, the rest is padding
+struct Load_Header {
+    uint64 sent_ns;
+    uint32 sender;
+};
+
+static uint64 load_clock_ns()
+{
+    return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Load_Stats {
+    uint64 sent{};
+    uint64 received{}; // only the messages sent during the measurement
+    uint64 received_bytes{};
+    std::vector<double> latencies_us{};
+};
+
+// a whole emu client (minus everything unrelated to the networking) in this process
+class Load_Peer : public CCallbackBase {
+public:
+    uint32 index{};
+    CSteamID id{};
+    std::unique_ptr<Settings> settings{};
+    std::unique_ptr<Networking> network{};
+    std::unique_ptr<SteamCallResults> callback_results{};
+    std::unique_ptr<SteamCallBacks> callbacks{};
+    std::unique_ptr<RunEveryRunCB> run_every_runcb{};
+    // the interfaces have no virtual destructor, they're destroyed first as members instead of deleted
+    Steam_Networking p2p;
+    Steam_Networking_Sockets sockets;
+    Steam_Networking_Messages messages;
+
+    HSteamListenSocket listen_socket = k_HSteamListenSocket_Invalid;
+    HSteamNetPollGroup poll_group = k_HSteamNetPollGroup_Invalid;
+    std::map<uint32, HSteamNetConnection> outgoing{}; // sockets api: by destination peer index
+    std::vector<uint32> destinations{};
+    // by peer index, warmup included
+    std::vector<uint64> sent_to{};
+    std::vector<uint64> received_from{};
+    std::set<uint64> connected{}; // steam ids, the messages can only be sent reliably once connected
+
+    static void user_status(void *object, Common_Message *msg)
+    {
+        Load_Peer *peer = (Load_Peer *)object;
+        if (!msg->has_low_level()) return;
+
+        if (msg->low_level().type() == Low_Level::CONNECT) {
+            peer->connected.insert((uint64)msg->source_id());
+        } else if (msg->low_level().type() == Low_Level::DISCONNECT) {
+            peer->connected.erase((uint64)msg->source_id());
+        }
+    }
+
+    Load_Peer(uint32 index, std::set<IP_PORT> *custom_broadcasts, bool io_thread) :
+        index(index),
+        id(2000 + index, k_EUniversePublic, k_EAccountTypeIndividual),
+        settings(new Settings(id, CGameID(BENCHMARK_APPID), "peer " + std::to_string(index), "english", false)),
+        network(new Networking(id, BENCHMARK_APPID, BENCHMARK_PORT + 1 + index, custom_broadcasts, false)),
+        callback_results(new SteamCallResults()),
+        callbacks(new SteamCallBacks(callback_results.get())),
+        run_every_runcb(new RunEveryRunCB()),
+        p2p(settings.get(), network.get(), callbacks.get(), run_every_runcb.get()),
+        sockets(settings.get(), network.get(), callback_results.get(), callbacks.get(), run_every_runcb.get(), NULL),
+        messages(settings.get(), network.get(), callback_results.get(), callbacks.get(), run_every_runcb.get())
+    {
+        callbacks->addCallBack(SteamNetConnectionStatusChangedCallback_t::k_iCallback, this);
+        network->setCallback(CALLBACK_ID_USER_STATUS, id, &Load_Peer::user_status, this);
+        if (io_thread) network->startIOThread();
+    }
+
+    ~Load_Peer()
+    {
+        callbacks->rmCallBack(SteamNetConnectionStatusChangedCallback_t::k_iCallback, this);
+        network->rmCallback(CALLBACK_ID_USER_STATUS, id, &Load_Peer::user_status, this);
+        network->stopIOThread();
+    }
+
+    // what SteamAPI_RunCallbacks() does for these interfaces
+    void run()
+    {
+        std::lock_guard<std::recursive_mutex> lock(global_mutex);
+        network->Run();
+        run_every_runcb->run();
+        callback_results->runCallResults();
+        callbacks->runCallBacks();
+    }
+
+    // accepts all the incoming connections of the sockets api
+    void Run(void *param)
+    {
+        SteamNetConnectionStatusChangedCallback_t *data = (SteamNetConnectionStatusChangedCallback_t *)param;
+        if (data->m_info.m_eState == k_ESteamNetworkingConnectionState_Connecting && data->m_info.m_hListenSocket != k_HSteamListenSocket_Invalid) {
+            sockets.AcceptConnection(data->m_hConn);
+            sockets.SetConnectionPollGroup(data->m_hConn, poll_group);
+        }
+    }
+
+    void Run(void *param, bool io_failure, SteamAPICall_t api_call)
+    {
+        Run(param);
+    }
+
+    int GetCallbackSizeBytes()
+    {
+        return sizeof(SteamNetConnectionStatusChangedCallback_t);
+    }
+};
+
+static bool load_send(enum Load_Api api, Load_Peer &peer, Load_Peer &dest, const std::string &payload, bool reliable)
+{
+    switch (api) {
+    case LOAD_API_SOCKETS:
+        return peer.sockets.SendMessageToConnection(peer.outgoing[dest.index], payload.data(), (uint32)payload.size(), reliable ? k_nSteamNetworkingSend_Reliable : k_nSteamNetworkingSend_Unreliable, nullptr) == k_EResultOK;
+
+    case LOAD_API_MESSAGES: {
+        SteamNetworkingIdentity identity{};
+        identity.SetSteamID(dest.id);
+        return peer.messages.SendMessageToUser(identity, payload.data(), (uint32)payload.size(), reliable ? k_nSteamNetworkingSend_Reliable : k_nSteamNetworkingSend_Unreliable, 0) == k_EResultOK;
+    }
+
+    case LOAD_API_P2P:
+        return peer.p2p.SendP2PPacket(dest.id, payload.data(), (uint32)payload.size(), reliable ? k_EP2PSendReliable : k_EP2PSendUnreliable, 0);
+    }
+
+    return false;
+}
+
+static void load_count(Load_Peer &peer, struct Load_Stats &stats, const void *data, uint32 size, uint64 measure_start_ns)
+{
+    struct Load_Header header{};
+    if (size < sizeof(header)) return;
+
+    memcpy(&header, data, sizeof(header));
+    if (header.sender < peer.received_from.size()) ++peer.received_from[header.sender];
+    if (header.sent_ns < measure_start_ns) return;
+
+    ++stats.received;
+    stats.received_bytes += size;
+    stats.latencies_us.push_back((double)(load_clock_ns() - header.sent_ns) / 1000.0);
+}
+
+static void load_receive(enum Load_Api api, Load_Peer &peer, struct Load_Stats &stats, uint64 measure_start_ns)
+{
+    constexpr const static int MAX_MESSAGES = 64;
+
+    switch (api) {
+    case LOAD_API_SOCKETS:
+    case LOAD_API_MESSAGES: {
+        SteamNetworkingMessage_t *msgs[MAX_MESSAGES];
+        int count;
+        do {
+            if (api == LOAD_API_SOCKETS) {
+                count = peer.sockets.ReceiveMessagesOnPollGroup(peer.poll_group, msgs, MAX_MESSAGES);
+            } else {
+                count = peer.messages.ReceiveMessagesOnChannel(0, msgs, MAX_MESSAGES);
+            }
+
+            for (int i = 0; i < count; ++i) {
+                load_count(peer, stats, msgs[i]->m_pData, (uint32)msgs[i]->m_cbSize, measure_start_ns);
+                msgs[i]->Release();
+            }
+        } while (count == MAX_MESSAGES);
+        break;
+    }
+
+    case LOAD_API_P2P: {
+        std::vector<char> buffer{};
+        uint32 size = 0;
+        CSteamID remote{};
+        while (peer.p2p.IsP2PPacketAvailable(&size, 0)) {
+            buffer.resize(std::max(size, (uint32)1));
+            if (!peer.p2p.ReadP2PPacket(buffer.data(), (uint32)buffer.size(), &size, &remote, 0)) break;
+            load_count(peer, stats, buffer.data(), size, measure_start_ns);
+        }
+        break;
+    }
+    }
+}
+
+static double percentile(const std::vector<double> &sorted, double fraction)
+{
+    if (sorted.empty()) return 0;
+    size_t index = (size_t)(fraction * (double)(sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// N emu networking instances on localhost in this process, exchanging messages through the steam apis
+static int bench_load(int argc, char **argv)
+{
+    std::string api_name = argc > 0 ? argv[0] : "sockets";
+    std::string pattern_name = argc > 1 ? argv[1] : "ring";
+    uint32 peer_count = argc > 2 ? (uint32)std::stoul(argv[2]) : 4;
+    double seconds = argc > 3 ? std::stod(argv[3]) : 5.0;
+    uint32 size = argc > 4 ? (uint32)std::stoul(argv[4]) : 256;
+    uint32 rate = argc > 5 ? (uint32)std::stoul(argv[5]) : 0;
+    bool reliable = argc > 6 ? std::stoul(argv[6]) != 0 : true;
+    bool io_thread = argc > 7 ? std::stoul(argv[7]) != 0 : false;
+
+    enum Load_Api api;
+    if (api_name == "sockets") api = LOAD_API_SOCKETS;
+    else if (api_name == "messages") api = LOAD_API_MESSAGES;
+    else if (api_name == "p2p") api = LOAD_API_P2P;
+    else {
+        std::cerr << "unknown api '" << api_name << "'" << std::endl;
+        return 1;
+    }
+
+    enum Load_Pattern pattern;
+    if (pattern_name == "ring") pattern = LOAD_PATTERN_RING;
+    else if (pattern_name == "all") pattern = LOAD_PATTERN_ALL;
+    else if (pattern_name == "fanin") pattern = LOAD_PATTERN_FANIN;
+    else {
+        std::cerr << "unknown pattern '" << pattern_name << "'" << std::endl;
+        return 1;
+    }
+
+    if (peer_count < 2 || peer_count > LOAD_MAX_PEERS) {
+        std::cerr << "peers must be between 2 and " << LOAD_MAX_PEERS << std::endl;
+        return 1;
+    }
+
+    size = std::max(size, (uint32)sizeof(struct Load_Header));
+
+    std::set<IP_PORT> custom_broadcasts{};
+    for (uint32 i = 0; i < peer_count; ++i) custom_broadcasts.insert(IP_PORT{0x7F000001, (uint16)(BENCHMARK_PORT + 1 + i)});
+
+    std::vector<std::unique_ptr<Load_Peer>> peers{};
+    for (uint32 i = 0; i < peer_count; ++i) peers.emplace_back(new Load_Peer(i, &custom_broadcasts, io_thread));
+
+    for (auto &peer : peers) {
+        for (uint32 i = 0; i < peer_count; ++i) {
+            if (i == peer->index) continue;
+            if (pattern == LOAD_PATTERN_RING && i != (peer->index + 1) % peer_count) continue;
+            if (pattern == LOAD_PATTERN_FANIN && (i != 0 || peer->index == 0)) continue;
+            peer->destinations.push_back(i);
+        }
+
+        peer->sent_to.resize(peer_count);
+        peer->received_from.resize(peer_count);
+    }
+
+    // discovery, every peer must be connected to its destinations and the other way around
+    auto start = std::chrono::high_resolution_clock::now();
+    bool discovered = false;
+    while (!discovered && !check_timedout(start, 20.0)) {
+        for (auto &peer : peers) peer->run();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        discovered = true;
+        for (auto &peer : peers) {
+            for (uint32 dest : peer->destinations) {
+                if (!peer->connected.count(peers[dest]->id.ConvertToUint64())) discovered = false;
+                if (!peers[dest]->connected.count(peer->id.ConvertToUint64())) discovered = false;
+            }
+        }
+    }
+
+    if (!discovered) {
+        std::cerr << "the peers didn't find each other" << std::endl;
+        return 1;
+    }
+
+    for (auto &peer : peers) {
+        std::lock_guard<std::recursive_mutex> lock(global_mutex);
+        if (api == LOAD_API_SOCKETS) {
+            peer->poll_group = peer->sockets.CreatePollGroup();
+            peer->listen_socket = peer->sockets.CreateListenSocketP2P(0, 0, nullptr);
+        } else if (api == LOAD_API_P2P) {
+            for (uint32 i = 0; i < peer_count; ++i) {
+                if (i != peer->index) peer->p2p.AcceptP2PSessionWithUser(peers[i]->id);
+            }
+        }
+    }
+
+    if (api == LOAD_API_SOCKETS) {
+        for (auto &peer : peers) {
+            std::lock_guard<std::recursive_mutex> lock(global_mutex);
+            for (uint32 dest : peer->destinations) {
+                SteamNetworkingIdentity identity{};
+                identity.SetSteamID(peers[dest]->id);
+                peer->outgoing[dest] = peer->sockets.ConnectP2P(identity, 0, 0, nullptr);
+            }
+        }
+    }
+
+    std::string payload(size, 'x');
+    std::mt19937 rng(1234);
+    for (size_t i = sizeof(struct Load_Header); i < payload.size(); ++i) payload[i] = (char)(rng() & 0xFF);
+
+    struct Load_Stats stats{};
+    uint64 warmup_end_ns = load_clock_ns() + (uint64)(LOAD_WARMUP_SECONDS * 1e9);
+    uint64 measure_end_ns = warmup_end_ns + (uint64)(seconds * 1e9);
+    uint64 drain_end_ns = measure_end_ns + (uint64)(LOAD_DRAIN_SECONDS * 1e9);
+    std::clock_t cpu_start = 0;
+    uint64 loop_start_ns = load_clock_ns();
+    bool measuring = false;
+    for (uint64 now_ns = load_clock_ns(); now_ns < drain_end_ns; now_ns = load_clock_ns()) {
+        if (!measuring && now_ns >= warmup_end_ns) {
+            measuring = true;
+            cpu_start = std::clock();
+            // what was lost while the connections were set up doesn't count against the in flight limit
+            for (auto &peer : peers) {
+                for (uint32 dest : peer->destinations) peer->sent_to[dest] = peers[dest]->received_from[peer->index];
+            }
+        }
+
+        for (auto &peer : peers) {
+            if (now_ns < measure_end_ns) {
+                struct Load_Header header{};
+                header.sent_ns = now_ns;
+                header.sender = peer->index;
+                memcpy(&payload[0], &header, sizeof(header));
+
+                for (uint32 dest : peer->destinations) {
+                    uint64 &sent = peer->sent_to[dest];
+                    uint64 due;
+                    if (rate) {
+                        // what should have been sent since the beginning
+                        due = (now_ns - loop_start_ns) * rate / 1000000000ULL;
+                    } else if (reliable) {
+                        due = peers[dest]->received_from[peer->index] + LOAD_MAX_IN_FLIGHT;
+                    } else {
+                        due = sent + LOAD_UNLIMITED_BURST;
+                    }
+
+                    while (sent < due) {
+                        ++sent;
+                        if (load_send(api, *peer, *peers[dest], payload, reliable) && measuring) ++stats.sent;
+                    }
+                }
+            }
+
+            peer->run();
+            load_receive(api, *peer, stats, warmup_end_ns);
+        }
+
+        if (rate) std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    double cpu_seconds = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    std::sort(stats.latencies_us.begin(), stats.latencies_us.end());
+    std::cout << "api, pattern, peers, size, reliable, io thread, sent, received, msgs/s, MB/s, p50 us, p99 us, p999 us, cpu us/msg" << std::endl;
+    std::cout << api_name << ", " << pattern_name << ", " << peer_count << ", " << size << ", " << reliable << ", " << io_thread << ", "
+        << stats.sent << ", " << stats.received << ", "
+        << stats.received / seconds << ", " << stats.received_bytes / seconds / (1024.0 * 1024.0) << ", "
+        << percentile(stats.latencies_us, 0.5) << ", " << percentile(stats.latencies_us, 0.99) << ", " << percentile(stats.latencies_us, 0.999) << ", "
+        << (stats.received ? cpu_seconds * 1e6 / stats.received : 0) << std::endl;
+    return 0;
+}
+
+// feed a capture recorded with the network_capture option to a fresh instance, configured by the
+// steam_settings next to the benchmark, speed 0 replays everything as fast as possible
+// the instance should use disable_networking=1 so nothing from the LAN is mixed with the replay,
+// what it sends is then counted and dropped
+static int bench_replay(int argc, char **argv)
+{
+    if (argc < 1) {
+        std::cerr << "missing the capture file" << std::endl;
+        return 1;
+    }
+
+    double speed = argc > 1 ? std::stod(argv[1]) : 1.0;
+    Capture_Reader reader{};
+    if (!reader.open(argv[0])) {
+        std::cerr << "'" << argv[0] << "' isn't a supported capture" << std::endl;
+        return 1;
+    }
+
+    SteamAPI_Init();
+    Steam_Client *client = get_steam_client();
+    uint64 own_id = client->settings_client->get_local_steam_id().ConvertToUint64();
+    if (!client->settings_client->disable_networking) {
+        std::cerr << "warning: networking isn't disabled, the LAN traffic will be mixed with the replay" << std::endl;
+    }
+
+    auto sent_count = [client]() {
+        uint64 total = 0;
+        for (auto count : client->network->getCounters().messages_sent) total += count;
+        return total;
+    };
+
+    uint64 replayed = 0, recorded_sent = 0, invalid = 0, last_time_us = 0;
+    uint64 sent_before = sent_count();
+    std::clock_t cpu_start = std::clock();
+    auto start = std::chrono::high_resolution_clock::now();
+    Capture_Record record{};
+    while (reader.next(record)) {
+        if (record.type == CAPTURE_SENT) {
+            ++recorded_sent;
+            continue;
+        }
+
+        Common_Message msg{};
+        if (!msg.ParseFromString(record.data)) {
+            ++invalid;
+            continue;
+        }
+
+        // the instance may not have the steam id of the recording one
+        if (msg.dest_id() == reader.steam_id) msg.set_dest_id(own_id);
+
+        if (speed > 0) {
+            auto due = start + std::chrono::microseconds((uint64)(record.time_us / speed));
+            while (std::chrono::high_resolution_clock::now() < due) {
+                SteamAPI_RunCallbacks();
+                std::this_thread::sleep_until(std::min(due, std::chrono::high_resolution_clock::now() + std::chrono::milliseconds(1)));
+            }
+        } else if (record.time_us != last_time_us) {
+            // same batches as during the recording, each one handled by its own run of the callbacks
+            SteamAPI_RunCallbacks();
+        }
+
+        client->network->replayMessage(&msg, record.type == CAPTURE_USER_STATUS);
+        last_time_us = record.time_us;
+        ++replayed;
+    }
+
+    SteamAPI_RunCallbacks();
+    double seconds = elapsed_ns(start) / 1e9;
+    double cpu_seconds = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    std::cout << "replayed, invalid, recorded duration s, duration s, cpu us/msg, sent during the recording, sent by the replay" << std::endl;
+    std::cout << replayed << ", " << invalid << ", " << record.time_us / 1e6 << ", " << seconds << ", "
+        << (replayed ? cpu_seconds * 1e6 / replayed : 0) << ", " << recorded_sent << ", " << sent_count() - sent_before << std::endl;
+    return 0;
+}
+
+// counts the runs, never unregistered so it can be a plain local
+class Counting_Callback : public CCallbackBase {
+public:
+    uint64 runs{};
+
+    void Run(void *pvParam) { ++runs; }
+    void Run(void *pvParam, bool bIOFailure, SteamAPICall_t hSteamAPICall) { ++runs; }
+    int GetCallbackSizeBytes() { return sizeof(SteamAPICallCompleted_t); }
+};
+
+// cost of the SteamCallResults operations with N results pending, like a game with that many async calls in flight
+// delivering them only allocates while the buffers of the new store grow, the payloads are shared instead of copied
+// the run after the delivery doesn't touch the delivered results, they're freed by their expiry timers
+static int bench_callresults(int argc, char **argv)
+{
+    uint32 max_results = argc > 0 ? (uint32)std::stoul(argv[0]) : 10000;
+    // runCallResults() unlocks it around the callbacks
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+
+    std::cout << "results, addCallResult() ns, addCallBack() ns, exists() ns, rmCallBack(cb) ns, runCallResults() delivering all us, heap allocations of that run, runCallResults() after delivery us" << std::endl;
+    for (uint32 count = 100; count <= max_results; count *= 10) {
+        SteamCallResults results{};
+        std::vector<Counting_Callback> callbacks(count);
+        std::vector<SteamAPICall_t> calls(count);
+        SteamAPICallCompleted_t data{};
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (uint32 i = 0; i < count; ++i) {
+            calls[i] = results.addCallResult(data.k_iCallback, &data, sizeof(data));
+        }
+
+        double add_result = elapsed_ns(start) / count;
+        start = std::chrono::high_resolution_clock::now();
+        for (uint32 i = 0; i < count; ++i) {
+            results.addCallBack(calls[i], &callbacks[i]);
+        }
+
+        double add_callback = elapsed_ns(start) / count;
+        // exists() is only true once the results completed
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uint64 found = 0;
+        start = std::chrono::high_resolution_clock::now();
+        for (uint32 i = 0; i < count; ++i) {
+            found += results.exists(calls[count - 1 - i]) ? 1 : 0;
+        }
+
+        double exists = elapsed_ns(start) / count;
+        // the callbacks of the second half go away, like CCallResult objects destroyed before the result
+        start = std::chrono::high_resolution_clock::now();
+        for (uint32 i = count / 2; i < count; ++i) {
+            results.rmCallBack(&callbacks[i]);
+        }
+
+        double remove = elapsed_ns(start) / (count - count / 2);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        uint64 allocations = heap_allocations;
+        start = std::chrono::high_resolution_clock::now();
+        results.runCallResults();
+        double run_all = elapsed_ns(start) / 1e3;
+        allocations = heap_allocations - allocations;
+        start = std::chrono::high_resolution_clock::now();
+        results.runCallResults();
+        double run_idle = elapsed_ns(start) / 1e3;
+
+        uint64 runs = 0;
+        for (auto &cb : callbacks) runs += cb.runs;
+        if (found != count || runs != count / 2) {
+            // every result was still there for exists(), only the ones of the first half still had a callback
+            std::cerr << "unexpected state: " << found << " results found, " << runs << " callbacks run" << std::endl;
+            return 1;
+        }
+
+        std::cout << count << ", " << add_result << ", " << add_callback << ", " << exists << ", " << remove << ", "
+            << run_all << ", " << allocations << ", " << run_idle << std::endl;
+        if (count == max_results) break;
+        if (count * 10 > max_results) count = max_results / 10;
+    }
+
+    return 0;
+}
+
+struct Benchmark_Mode {
+    const char *name;
+    const char *args;
+    int (*run)(int argc, char **argv);
+};
+
+static const struct Benchmark_Mode modes[] = {
+    { "sendto", "[max peers = 1000]", &bench_sendto },
+    { "recv", "", &bench_recv },
+    { "load", "[sockets|messages|p2p = sockets] [ring|all|fanin = ring] [peers = 4] [seconds = 5] [message size = 256] [msgs/s per destination, 0 = unlimited] [reliable = 1] [io thread = 0]", &bench_load },
+    { "replay", "<capture file> [speed = 1, 0 = as fast as possible]", &bench_replay },
+    { "callresults", "[max results = 10000]", &bench_callresults },
+};
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2) {
+        for (auto &mode : modes) {
+            if (std::string(argv[1]) == mode.name) {
+                return mode.run(argc - 2, argv + 2);
+            }
+        }
+    }
+
+    std::cerr << "usage: " << argv[0] << " <mode> [args...]" << std::endl << "modes:" << std::endl;
+    for (auto &mode : modes) {
+        std::cerr << "  " << mode.name << " " << mode.args << std::endl;
+    }
+
+    return 1;
+}